@@ -3,6 +3,9 @@
 #include "expression.h"
 #include "operator.h"
 #include "hashtable.h"
+#include "vector.h"
+#include "map.h"
+#include "hash.h"
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -10,13 +13,119 @@
 #include <math.h>
 
 static bool equal(TextBufferObj* a, TextBufferObj* b);
+static TextBufferObj eq(TextBufferObj* args);
+static TextBufferObj hash(TextBufferObj* args);
+static TextBufferObj lt(TextBufferObj* args);
+
+//the number of types returned by typeof
+#define NUM_TYPES 8
+
+/** How a global function is called for operands of given types. */
+typedef enum GlobalCall {
+    CALL_UNRESOLVED,    //not resolved yet
+    CALL_GLOBAL,        //the global function is called
+    CALL_NATIVE,        //the intrinsic is called
+    CALL_SWAPPED,       //the intrinsic is called with its two args swapped
+} GlobalCall;
+
+/**
+ * A global function used by the runtime (e.g. for map keys), which
+ * is called natively for the operand types for which it reduces to
+ * the expected intrinsic. The calls are resolved per operand type on
+ * first use, and resolved again whenever the global function changes.
+ */
+typedef struct GlobalFunc {
+    TextBufferObj* global;  //the global function value
+    Builtin intrinsic;      //the intrinsic it may forward to
+    int arity;              //the number of operands, 1 or 2
+    Operator* func;         //the function the calls were resolved for
+    bool checked;           //whether func is the current global function
+    bool forwards;          //whether func forwards to the intrinsic for all types
+    unsigned char calls[NUM_TYPES][NUM_TYPES];  //GlobalCall by operand types
+    size_t nativeCalls;     //calls made to the intrinsic
+    size_t globalCalls;     //calls made to the global function
+    char* name;
+} GlobalFunc;
+
+static GlobalFunc globalEquals = { &lv_globalEquals, eq, 2, .name = "global:=" };
+static GlobalFunc globalHash = { &lv_globalHash, hash, 1, .name = "global:hash" };
+static GlobalFunc globalLt = { &lv_globalLt, lt, 2, .name = "global:<" };
+
+static int typeIndex(TextBufferObj* obj);
+static GlobalCall resolveCall(GlobalFunc* g, int* operandTypes);
+
+/**
+ * Forgets the resolved calls if the global function changed.
+ * Without a global function, the intrinsic is always called.
+ */
+static void checkGlobal(GlobalFunc* g) {
+
+    Operator* func = LV_TYPE(g->global) == OPT_FUNCTION_VAL ? LV_FUNC(g->global) : NULL;
+    if(g->checked && func == g->func)
+        return;
+    g->func = func;
+    g->checked = true;
+    memset(g->calls, func ? CALL_UNRESOLVED : CALL_NATIVE, sizeof(g->calls));
+    bool swapped;
+    Operator* op = func ? lv_blt_resolve(func, &swapped) : NULL;
+    g->forwards = !func || (op && op->builtin == g->intrinsic);
+}
+
+/**
+ * Returns whether the intrinsic may be called in place of
+ * the given global function for the given args, and if so
+ * arranges the args in the order the global function passes
+ * them. The check is a table lookup once the call is resolved.
+ */
+static bool prepareNative(GlobalFunc* g, TextBufferObj* args) {
+
+    checkGlobal(g);
+    int types[2] = { typeIndex(&args[0]), 0 };
+    if(g->arity == 2)
+        types[1] = typeIndex(&args[1]);
+    unsigned char* call = &g->calls[types[0]][types[1]];
+    if(*call == CALL_UNRESOLVED)
+        *call = resolveCall(g, types);
+    if(*call == CALL_GLOBAL) {
+        g->globalCalls++;
+        return false;
+    }
+    if(*call == CALL_SWAPPED) {
+        TextBufferObj tmp = args[0];
+        args[0] = args[1];
+        args[1] = tmp;
+    }
+    g->nativeCalls++;
+    return true;
+}
+
+/**
+ * Stores the value of a result that is referenced nowhere else
+ * in value and releases the result. Returns false if the result
+ * is not an integer.
+ */
+static bool takeInteger(TextBufferObj* res, uint64_t* value) {
+
+    bool isInt = LV_TYPE(res) == OPT_INTEGER;
+    if(isInt)
+        *value = LV_INTEGER(res);
+    if(LV_IS_DYNAMIC(res)) {
+        ++*LV_REFCOUNT(res);
+        lv_expr_cleanup(res, 1);
+    }
+    return isInt;
+}
 
 bool lv_blt_equal(TextBufferObj* a, TextBufferObj* b) {
 
     TextBufferObj eq;
     TextBufferObj ab[2] = { *a, *b };
-    lv_callFunction(&lv_globalEquals, 2, ab, &eq);
-    return eq.type == OPT_INTEGER ? eq.integer : equal(a, b);
+    if(prepareNative(&globalEquals, ab))
+        eq = globalEquals.intrinsic(ab);
+    else
+        lv_callFunction(&lv_globalEquals, 2, ab, &eq);
+    uint64_t res;
+    return takeInteger(&eq, &res) ? res != 0 : equal(a, b);
 }
 
 // evaluates any by-name expressions in the arguments
@@ -26,8 +135,8 @@ static void getArgs(TextBufferObj* dst, TextBufferObj* src, size_t len) {
         if(!lv_evalByName(&src[i], &dst[i])) {
             dst[i] = src[i];
         }
-        if(dst[i].type & LV_DYNAMIC) {
-            ++*dst[i].refCount;
+        if(LV_IS_DYNAMIC(&dst[i])) {
+            ++*LV_REFCOUNT(&dst[i]);
         }
     }
 }
@@ -37,6 +146,45 @@ static void clearArgs(TextBufferObj* args, size_t len) {
     lv_expr_cleanup(args, len);
 }
 
+//Built in functions own a reference to each value in their args array.
+//If that reference (and the one taken by getArgs) is the only reference
+//to a vect, map, or string, the function may reuse its storage.
+
+/**
+ * Whether the given arg, of which copy was made by getArgs,
+ * is referenced only by the args array and the copy.
+ */
+static bool isUnique(TextBufferObj* arg, TextBufferObj* copy) {
+
+    return LV_IS_DYNAMIC(copy)
+        && arg->bits == copy->bits
+        && *LV_REFCOUNT(copy) == 2;
+}
+
+/**
+ * Takes the references to a unique arg from the args array and
+ * the copy, leaving a value with a refCount of zero.
+ */
+static void takeArg(TextBufferObj* arg, TextBufferObj* copy) {
+
+    *LV_REFCOUNT(copy) = 0;
+    *arg = LV_UNDEFINED;
+    *copy = LV_UNDEFINED;
+}
+
+/**
+ * Returns the number of elements to allocate for a vect, map,
+ * or string of the given length that is grown in place.
+ * Growing geometrically makes repeated appends amortized constant.
+ */
+static size_t growCapacity(size_t len) {
+
+    size_t cap = 8;
+    while(cap < len)
+        cap *= 2;
+    return cap;
+}
+
 /**
  * Converts a string to a symbol.
  */
@@ -44,10 +192,10 @@ static TextBufferObj symb(TextBufferObj* args) {
 
     TextBufferObj arg, res;
     getArgs(&arg, args, 1);
-    if(arg.type == OPT_STRING) {
-        res = lv_tb_getSymb(arg.str->value);
+    if(LV_IS_STRING(&arg)) {
+        res = lv_tb_getSymb(LV_STR_VALUE(&arg));
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(&arg, 1);
     return res;
@@ -60,8 +208,7 @@ static TextBufferObj defined(TextBufferObj* args) {
 
     TextBufferObj arg, res;
     getArgs(&arg, args, 1);
-    res.type = OPT_INTEGER;
-    res.integer = (arg.type != OPT_UNDEFINED);
+    res = lv_tb_integer(LV_TYPE(&arg) != OPT_UNDEFINED);
     clearArgs(&arg, 1);
     return res;
 }
@@ -72,11 +219,10 @@ static TextBufferObj defined(TextBufferObj* args) {
 static TextBufferObj undefined(TextBufferObj* args) {
 
     TextBufferObj res;
-    res.type = OPT_UNDEFINED;
+    res = LV_UNDEFINED;
     return res;
 }
 
-#define NUM_TYPES 8
 static LvString* types[NUM_TYPES];
 
 static void mkTypes(void) {
@@ -86,6 +232,7 @@ static void mkTypes(void) {
         types[i] = lv_alloc(sizeof(LvString) + sizeof(n)); \
         types[i]->len = sizeof(n) - 1; \
         types[i]->refCount = 1; \
+        types[i]->hash.source = LV_HASH_NONE; \
         memcpy(types[i]->value, n, sizeof(n))
     INIT(0, "undefined");
     INIT(1, "number");
@@ -98,51 +245,83 @@ static void mkTypes(void) {
     #undef INIT
 }
 
-/**
- * Returns the type of this object, as a string.
- */
-static TextBufferObj typeof_(TextBufferObj* args) {
+/** Returns the index of the name of the object's type in types. */
+static int typeIndex(TextBufferObj* obj) {
 
-    TextBufferObj arg, res;
-    getArgs(&arg, args, 1);
-    res.type = OPT_STRING;
-    switch(arg.type) {
+    switch(LV_TYPE(obj)) {
         case OPT_UNDEFINED:
-            res.str = types[0];
-            break;
+            return 0;
         case OPT_NUMBER:
-            res.str = types[1];
-            break;
+            return 1;
         case OPT_INTEGER:
-            res.str = types[5];
-            break;
+            return 5;
         case OPT_SYMB:
-            res.str = types[6];
-            break;
+            return 6;
         case OPT_STRING:
-            res.str = types[2];
-            break;
+        case OPT_SHORT_STR:
+        case OPT_ROPE:
+        case OPT_STR_VIEW:
+            return 2;
         case OPT_VECT:
-            res.str = types[3];
-            break;
+        case OPT_VECT_TREE:
+        case OPT_VECT_VIEW:
+            return 3;
         case OPT_MAP:
-            res.str = types[7];
-            break;
+        case OPT_MAP_TRIE:
+            return 7;
         case OPT_CAPTURE:
         case OPT_FUNCTION_VAL:
-            res.str = types[4];
-            break;
+            return 4;
         default:
             assert(false);
+            return 0;
     }
+}
+
+/**
+ * Returns the type of this object, as a string.
+ */
+static TextBufferObj typeof_(TextBufferObj* args) {
+
+    TextBufferObj arg, res;
+    getArgs(&arg, args, 1);
+    res = lv_tb_box(OPT_STRING, types[typeIndex(&arg)]);
     clearArgs(&arg, 1);
     return res;
 }
 
 static void incRefCount(TextBufferObj* obj) {
 
-    if(obj->type & LV_DYNAMIC)
-        ++*obj->refCount;
+    if(LV_IS_DYNAMIC(obj))
+        ++*LV_REFCOUNT(obj);
+}
+
+/**
+ * Returns the type of the object, with inline strings, ropes and
+ * string views having the same type as other strings, vect trees
+ * and views the same type as flat vects, and map tries the same
+ * type as flat maps.
+ */
+static inline OpType baseType(TextBufferObj* obj) {
+
+    if(LV_IS_STRING(obj))
+        return OPT_STRING;
+    if(LV_IS_VECT(obj))
+        return OPT_VECT;
+    if(LV_IS_MAP(obj))
+        return OPT_MAP;
+    return LV_TYPE(obj);
+}
+
+/**
+ * The rank of the given object's type when ordering values of
+ * different types. Numbers sort after undefined and before
+ * integers, the remaining types in the order of their tags.
+ */
+static inline int typeOrder(TextBufferObj* obj) {
+
+    OpType type = baseType(obj);
+    return type == OPT_NUMBER ? 2 * OPT_UNDEFINED + 1 : 2 * type;
 }
 
 static inline bool isNegative(uint64_t repr) {
@@ -157,8 +336,8 @@ static int intCmp(uint64_t a, uint64_t b) {
         return 0;
     bool negA = isNegative(a);
     bool negB = isNegative(b);
-    if(negA || negB)
-        return a < b ? 1 : -1;
+    if(negA != negB)
+        return negA ? -1 : 1;
     else
         return a < b ? -1 : 1;
 }
@@ -181,12 +360,12 @@ static TextBufferObj cval(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if((args[0].type == OPT_CAPTURE)
-    && (args[1].type == OPT_INTEGER)
-    && (!isNegative(args[1].integer) && args[1].integer < args[0].capfunc->captureCount)) {
-        res = args[0].capture->value[(size_t)args[1].integer];
+    if((LV_TYPE(&args[0]) == OPT_CAPTURE)
+    && (LV_TYPE(&args[1]) == OPT_INTEGER)
+    && (!isNegative(LV_INTEGER(&args[1])) && LV_INTEGER(&args[1]) < LV_CAPTURE(&args[0])->func->captureCount)) {
+        res = LV_CAPTURE(&args[0])->value[(size_t)LV_INTEGER(&args[1])];
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -198,39 +377,41 @@ static TextBufferObj cval(TextBufferObj* _args) {
  */
 static TextBufferObj cat(TextBufferObj* args) {
 
-    TextBufferObj res;
-    res.type = OPT_VECT;
-    assert(args[0].type == OPT_VECT);
+    assert(LV_TYPE(&args[0]) == OPT_VECT);
     size_t len = 0;
-    for(size_t i = 0; i < args[0].vect->len; i++) {
-        // TextBufferObj* obj = &args[0].vect->data[i];
+    for(size_t i = 0; i < LV_VECT(&args[0])->len; i++) {
+        // TextBufferObj* obj = &LV_VECT(&args[0])->data[i];
         TextBufferObj obj;
-        getArgs(&obj, &args[0].vect->data[i], 1);
-        len += obj.type == OPT_VECT ? obj.vect->len : 1;
+        getArgs(&obj, &LV_VECT(&args[0])->data[i], 1);
+        len += LV_IS_VECT(&obj) ? LV_VECT_LEN(&obj) : 1;
         clearArgs(&obj, 1);
-        // len += obj->type == OPT_VECT ? obj->vect->len : 1;
+        // len += LV_TYPE(obj) == OPT_VECT ? LV_VECT(obj)->len : 1;
     }
-    res.vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-    res.vect->refCount = 0;
-    res.vect->len = len;
+    LvVect* vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+    vect->refCount = 0;
+    vect->len = len;
+    vect->hash.source = LV_HASH_NONE;
     size_t idx = 0;
-    for(size_t i = 0; i < args[0].vect->len; i++) {
-        // TextBufferObj* obj = &args[0].vect->data[i];
+    for(size_t i = 0; i < LV_VECT(&args[0])->len; i++) {
+        // TextBufferObj* obj = &LV_VECT(&args[0])->data[i];
         TextBufferObj obj;
-        getArgs(&obj, &args[0].vect->data[i], 1);
-        if(obj.type == OPT_VECT) {
-            for(int j = 0; j < obj.vect->len; j++) {
-                incRefCount(&obj.vect->data[j]);
-                res.vect->data[idx++] = obj.vect->data[j];
+        getArgs(&obj, &LV_VECT(&args[0])->data[i], 1);
+        if(LV_IS_VECT(&obj)) {
+            LvVectIter it;
+            lv_vec_iter(&it, &obj, 0);
+            for(size_t j = 0; j < LV_VECT_LEN(&obj); j++) {
+                TextBufferObj* elem = lv_vec_next(&it);
+                incRefCount(elem);
+                vect->data[idx++] = *elem;
             }
         } else {
             incRefCount(&obj);
-            res.vect->data[idx++] = obj;
+            vect->data[idx++] = obj;
         }
         clearArgs(&obj, 1);
     }
     assert(idx == len);
-    return res;
+    return lv_tb_box(OPT_VECT, vect);
 }
 
 /**
@@ -242,20 +423,79 @@ static TextBufferObj call(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[1].type != OPT_VECT) {
-        res.type = OPT_UNDEFINED;
+    if(LV_TYPE(&args[1]) == OPT_VECT) {
+        lv_callFunction(&args[0], LV_VECT(&args[1])->len, LV_VECT(&args[1])->data, &res);
+    } else if(LV_TYPE(&args[1]) == OPT_VECT_VIEW) {
+        lv_callFunction(&args[0], LV_VVIEW(&args[1])->len, LV_VVIEW(&args[1])->data, &res);
+    } else if(LV_TYPE(&args[1]) == OPT_VECT_TREE) {
+        //the args must be contiguous, the tree keeps the references
+        size_t len = LV_TREE(&args[1])->len;
+        TextBufferObj* data = lv_alloc(len * sizeof(TextBufferObj));
+        LvVectIter it;
+        lv_vec_iter(&it, &args[1], 0);
+        for(size_t i = 0; i < len; i++)
+            data[i] = *lv_vec_next(&it);
+        lv_callFunction(&args[0], len, data, &res);
+        lv_free(data);
     } else {
-        lv_callFunction(&args[0], args[1].vect->len, args[1].vect->data, &res);
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
 }
 
+/** Returns the number of slots in the hash index of a map. */
+static size_t indexSize(size_t len) {
+
+    size_t size = LV_MAP_INDEX_MIN;
+    while(size < 2 * len)
+        size *= 2;
+    return size;
+}
+
+/**
+ * Builds the hash index of the given map. Each slot holds the index
+ * of an entry plus one, or zero if empty, and entries are found by
+ * probing linearly from the slot given by the low bits of the hash.
+ */
+static uint32_t* indexMap(LvMap* map) {
+
+    size_t mask = indexSize(map->len) - 1;
+    uint32_t* index = lv_alloc((mask + 1) * sizeof(uint32_t));
+    memset(index, 0, (mask + 1) * sizeof(uint32_t));
+    for(size_t i = 0; i < map->len; i++) {
+        size_t slot = map->data[i].hash & mask;
+        while(index[slot])
+            slot = (slot + 1) & mask;
+        index[slot] = i + 1;
+    }
+    return index;
+}
+
+static void searchIndex(LvMap* map, uint64_t h, TextBufferObj* key, TextBufferObj* res) {
+
+    if(!map->index)
+        map->index = indexMap(map);
+    size_t mask = indexSize(map->len) - 1;
+    for(size_t slot = h & mask; map->index[slot]; slot = (slot + 1) & mask) {
+        LvMapNode* n = &map->data[map->index[slot] - 1];
+        if(n->hash == h && lv_blt_equal(&n->key, key)) {
+            *res = n->value;
+            return;
+        }
+    }
+    *res = LV_UNDEFINED;
+}
+
 static void bsearchMap(TextBufferObj* map, TextBufferObj* key, TextBufferObj* res) {
 
     uint64_t h = lv_blt_hash(key);
-    LvMapNode* lo = map->map->data;
-    LvMapNode* hi = lo + map->map->len;
+    if(LV_MAP(map)->len >= LV_MAP_INDEX_MIN) {
+        searchIndex(LV_MAP(map), h, key, res);
+        return;
+    }
+    LvMapNode* lo = LV_MAP(map)->data;
+    LvMapNode* hi = lo + LV_MAP(map)->len;
     while(lo < hi) {
         LvMapNode* mid = lo + (hi - lo) / 2;
         if(h == mid->hash) {
@@ -280,7 +520,7 @@ static void bsearchMap(TextBufferObj* map, TextBufferObj* key, TextBufferObj* re
             lo = mid + 1;
         }
     }
-    res->type = OPT_UNDEFINED;
+    *res = LV_UNDEFINED;
 }
 
 /**
@@ -290,26 +530,28 @@ static TextBufferObj at(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[1].type == OPT_MAP) {
-        //binary search the given key in the map
+    if(LV_TYPE(&args[1]) == OPT_MAP) {
+        //search the index or binary search the given key in the map
         bsearchMap(&args[1], &args[0], &res);
-    } else if(args[0].type == OPT_INTEGER) {
-        if(args[1].type == OPT_STRING
-        && !isNegative(args[0].integer) && args[0].integer < args[1].str->len) {
-            res.type = OPT_STRING;
-            res.str = lv_alloc(sizeof(LvString) + 2);
-            res.str->refCount = 0;
-            res.str->len = 1;
-            res.str->value[0] = args[1].str->value[(size_t)args[0].integer];
-            res.str->value[1] = '\0';
-        } else if(args[1].type == OPT_VECT
-            && !isNegative(args[0].integer) && args[0].integer < args[1].vect->len) {
-            res = args[1].vect->data[(size_t)args[0].integer];
+    } else if(LV_TYPE(&args[1]) == OPT_MAP_TRIE) {
+        TextBufferObj* value = lv_map_get(LV_TRIE(&args[1]), lv_blt_hash(&args[0]), &args[0]);
+        if(value) {
+            res = *value;
         } else {
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
+        }
+    } else if(LV_TYPE(&args[0]) == OPT_INTEGER) {
+        if(LV_IS_STRING(&args[1])
+        && !isNegative(LV_INTEGER(&args[0])) && LV_INTEGER(&args[0]) < LV_STR_LEN(&args[1])) {
+            lv_tb_newString(&res, 1)[0] = LV_STR_CHARS(&args[1])[(size_t)LV_INTEGER(&args[0])];
+        } else if(LV_IS_VECT(&args[1])
+            && !isNegative(LV_INTEGER(&args[0])) && LV_INTEGER(&args[0]) < LV_VECT_LEN(&args[1])) {
+            res = *lv_vec_at(&args[1], (size_t)LV_INTEGER(&args[0]));
+        } else {
+            res = LV_UNDEFINED;
         }
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -317,17 +559,85 @@ static TextBufferObj at(TextBufferObj* _args) {
 
 bool lv_blt_toBool(TextBufferObj* obj) {
 
-    switch(obj->type) {
+    switch(LV_TYPE(obj)) {
         case OPT_UNDEFINED: return false;
         case OPT_NUMBER: return obj->number != 0.0;
-        case OPT_INTEGER: return obj->integer != 0;
-        case OPT_STRING: return obj->str->len != 0;
-        case OPT_VECT: return obj->vect->len != 0;
-        case OPT_MAP: return obj->map->len != 0;
+        case OPT_INTEGER: return LV_INTEGER(obj) != 0;
+        case OPT_STRING: return LV_STR(obj)->len != 0;
+        case OPT_SHORT_STR: return LV_SHORT_LEN(obj) != 0;
+        case OPT_ROPE: return LV_ROPE(obj)->len != 0;
+        case OPT_STR_VIEW: return LV_SVIEW(obj)->len != 0;
+        case OPT_VECT: return LV_VECT(obj)->len != 0;
+        case OPT_VECT_TREE: return LV_TREE(obj)->len != 0;
+        case OPT_VECT_VIEW: return LV_VVIEW(obj)->len != 0;
+        case OPT_MAP: return LV_MAP(obj)->len != 0;
+        case OPT_MAP_TRIE: return LV_TRIE(obj)->len != 0;
         default: return true;
     }
 }
 
+/**
+ * Makes a heap string holding a copy of the given string, with room
+ * to append characters in place. The string has a refCount of one.
+ */
+static TextBufferObj ropeLeaf(TextBufferObj* str) {
+
+    size_t len = LV_STR_LEN(str);
+    TextBufferObj res;
+    res = lv_tb_box(OPT_STRING, lv_alloc(sizeof(LvString) + growCapacity(len + 1)));
+    LV_STR(&res)->refCount = 1;
+    LV_STR(&res)->len = len;
+    LV_STR(&res)->hash.source = LV_HASH_NONE;
+    memcpy(LV_STR(&res)->value, LV_STR_CHARS(str), len);
+    LV_STR(&res)->value[len] = '\0';
+    return res;
+}
+
+/**
+ * Concatenates two strings without copying the left one. If the
+ * left string is a unique rope whose right piece is short, the right
+ * string is appended to that piece in place. Otherwise a new rope
+ * refers to both strings, except that short right strings are copied
+ * into their own piece so that later appends may go there.
+ */
+static TextBufferObj concatRope(TextBufferObj* _args, TextBufferObj* args) {
+
+    TextBufferObj res;
+    size_t blen = LV_STR_LEN(&args[1]);
+    if(LV_TYPE(&args[0]) == OPT_ROPE && isUnique(&_args[0], &args[0])) {
+        LvRope* rope = LV_ROPE(&args[0]);
+        TextBufferObj* leaf = &rope->right;
+        if(!rope->flat && LV_TYPE(leaf) == OPT_STRING && LV_STR(leaf)->refCount == 1
+            && LV_STR(leaf)->len + blen < LV_ROPE_LEAF_LEN) {
+            takeArg(&_args[0], &args[0]);
+            size_t llen = LV_STR(leaf)->len;
+            *leaf = lv_tb_box(OPT_STRING,
+                lv_realloc(LV_STR(leaf), sizeof(LvString) + growCapacity(llen + blen + 1)));
+            memcpy(LV_STR(leaf)->value + llen, LV_STR_CHARS(&args[1]), blen);
+            LV_STR(leaf)->len = llen + blen;
+            LV_STR(leaf)->value[LV_STR(leaf)->len] = '\0';
+            LV_STR(leaf)->hash.source = LV_HASH_NONE;
+            rope->len += blen;
+            res = lv_tb_box(OPT_ROPE, rope);
+            return res;
+        }
+    }
+    LvRope* rope = lv_alloc(sizeof(LvRope));
+    rope->refCount = 0;
+    rope->len = LV_STR_LEN(&args[0]) + blen;
+    rope->flat = NULL;
+    rope->left = args[0];
+    incRefCount(&rope->left);
+    if(blen < LV_ROPE_LEAF_LEN) {
+        rope->right = ropeLeaf(&args[1]);
+    } else {
+        rope->right = args[1];
+        incRefCount(&rope->right);
+    }
+    res = lv_tb_box(OPT_ROPE, rope);
+    return res;
+}
+
 /**
  * Concatenates two values together.
  */
@@ -335,66 +645,112 @@ static TextBufferObj concat(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[0].type != args[1].type) {
-        res.type = OPT_UNDEFINED;
+    if(baseType(&args[0]) != baseType(&args[1])) {
+        res = LV_UNDEFINED;
     } else {
-        switch(args[0].type) {
+        switch(baseType(&args[0])) {
             case OPT_STRING: {
                 //string concatenation
-                size_t alen = args[0].str->len;
-                size_t blen = args[1].str->len;
-                LvString* str = lv_alloc(sizeof(LvString) + alen + blen + 1);
-                str->refCount = 0;
-                str->len = alen + blen;
-                memcpy(str->value, args[0].str->value, alen);
-                memcpy(str->value + alen, args[1].str->value, blen);
-                str->value[alen + blen] = '\0';
-                res.type = OPT_STRING;
-                res.str = str;
+                size_t alen = LV_STR_LEN(&args[0]);
+                size_t blen = LV_STR_LEN(&args[1]);
+                if(alen + blen > LV_SHORT_STR_CAP
+                    && LV_TYPE(&args[0]) == OPT_STRING && isUnique(&_args[0], &args[0])) {
+                    //append to the left string in place
+                    LvString* str = LV_STR(&args[0]);
+                    takeArg(&_args[0], &args[0]);
+                    str = lv_realloc(str, sizeof(LvString) + growCapacity(alen + blen + 1));
+                    memcpy(str->value + alen, LV_STR_CHARS(&args[1]), blen);
+                    str->len = alen + blen;
+                    str->value[str->len] = '\0';
+                    str->hash.source = LV_HASH_NONE;
+                    res = lv_tb_box(OPT_STRING, str);
+                    break;
+                }
+                if(alen + blen >= LV_ROPE_MIN_LEN) {
+                    res = concatRope(_args, args);
+                    break;
+                }
+                char* value = lv_tb_newString(&res, alen + blen);
+                memcpy(value, LV_STR_CHARS(&args[0]), alen);
+                memcpy(value + alen, LV_STR_CHARS(&args[1]), blen);
                 break;
             }
             case OPT_VECT: {
                 //vect concatenation
-                size_t alen = args[0].vect->len;
-                size_t blen = args[1].vect->len;
-                LvVect* vec = lv_alloc(sizeof(LvVect) + (alen + blen) * sizeof(TextBufferObj));
-                vec->refCount = 0;
-                vec->len = alen + blen;
-                for(size_t i = 0; i < alen; i++) {
-                    vec->data[i] = args[0].vect->data[i];
-                    incRefCount(&vec->data[i]);
+                size_t alen = LV_VECT_LEN(&args[0]);
+                size_t blen = LV_VECT_LEN(&args[1]);
+                LvVect* vec;
+                if(LV_TYPE(&args[0]) == OPT_VECT && blen <= alen && isUnique(&_args[0], &args[0])) {
+                    //append to the left vect in place
+                    vec = LV_VECT(&args[0]);
+                    takeArg(&_args[0], &args[0]);
+                    vec = lv_realloc(vec, sizeof(LvVect) + growCapacity(alen + blen) * sizeof(TextBufferObj));
+                } else if(alen + blen >= LV_VECT_TREE_MIN) {
+                    //share the elements of both vects in a tree
+                    lv_vec_concat(&args[0], &args[1], &res);
+                    break;
+                } else {
+                    vec = lv_alloc(sizeof(LvVect) + (alen + blen) * sizeof(TextBufferObj));
+                    vec->refCount = 0;
+                    LvVectIter it;
+                    lv_vec_iter(&it, &args[0], 0);
+                    for(size_t i = 0; i < alen; i++) {
+                        vec->data[i] = *lv_vec_next(&it);
+                        incRefCount(&vec->data[i]);
+                    }
                 }
+                vec->len = alen + blen;
+                vec->hash.source = LV_HASH_NONE;
+                LvVectIter it;
+                lv_vec_iter(&it, &args[1], 0);
                 for(size_t i = 0; i < blen; i++) {
-                    vec->data[alen + i] = args[1].vect->data[i];
+                    vec->data[alen + i] = *lv_vec_next(&it);
                     incRefCount(&vec->data[alen + i]);
                 }
-                res.type = OPT_VECT;
-                res.vect = vec;
+                res = lv_tb_box(OPT_VECT, vec);
                 break;
             }
             case OPT_MAP: {
-                size_t alen = args[0].map->len;
-                size_t blen = args[1].map->len;
-                LvMap* map = lv_alloc(sizeof(LvMap) + (alen + blen) * sizeof(LvMapNode));
-                map->refCount = 0;
-                map->len = alen + blen;
-                for(size_t i = 0; i < alen; i++) {
-                    map->data[i] = args[0].map->data[i];
-                    incRefCount(&map->data[i].key);
-                    incRefCount(&map->data[i].value);
+                size_t alen = LV_MAP_LEN(&args[0]);
+                size_t blen = LV_MAP_LEN(&args[1]);
+                if(alen + blen >= LV_MAP_TRIE_MIN || LV_TYPE(&args[0]) == OPT_MAP_TRIE
+                    || LV_TYPE(&args[1]) == OPT_MAP_TRIE) {
+                    //add the entries to a trie, in place
+                    //if the left trie is unique and longer
+                    TextBufferObj left = args[0];
+                    if(LV_TYPE(&args[0]) == OPT_MAP_TRIE && alen >= blen
+                        && isUnique(&_args[0], &args[0])) {
+                        takeArg(&_args[0], &args[0]);
+                    }
+                    lv_map_concat(&left, &args[1], &res);
+                    break;
                 }
-                for(size_t i = 0; i < blen; i++) {
-                    map->data[alen + i] = args[1].map->data[i];
-                    incRefCount(&map->data[alen + i].key);
-                    incRefCount(&map->data[alen + i].value);
+                LvMap* map;
+                if(isUnique(&_args[0], &args[0])) {
+                    //add to the left map in place
+                    map = LV_MAP(&args[0]);
+                    takeArg(&_args[0], &args[0]);
+                    map = lv_realloc(map, sizeof(LvMap) + growCapacity(alen + blen) * sizeof(LvMapNode));
+                    lv_free(map->index);
+                } else {
+                    map = lv_alloc(sizeof(LvMap) + (alen + blen) * sizeof(LvMapNode));
+                    map->refCount = 0;
+                    for(size_t i = 0; i < alen; i++) {
+                        map->data[i] = LV_MAP(&args[0])->data[i];
+                        incRefCount(&map->data[i].key);
+                        incRefCount(&map->data[i].value);
+                    }
                 }
-                lv_tb_initMap(&map);
-                res.type = OPT_MAP;
-                res.map = map;
+                //both maps are sorted, so merge instead of sorting again
+                map->len = alen;
+                map->index = NULL;
+                map->hash.source = LV_HASH_NONE;
+                lv_tb_mergeMap(map, LV_MAP(&args[1]));
+                res = lv_tb_box(OPT_MAP, map);
                 break;
             }
             default:
-                res.type = OPT_UNDEFINED;
+                res = LV_UNDEFINED;
         }
     }
     clearArgs(args, 2);
@@ -408,8 +764,7 @@ static TextBufferObj bool_(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    res.type = OPT_INTEGER;
-    res.integer = lv_blt_toBool(&args[0]);
+    res = lv_tb_integer(lv_blt_toBool(&args[0]));
     clearArgs(args, 1);
     return res;
 }
@@ -419,12 +774,20 @@ static TextBufferObj bool_(TextBufferObj* _args) {
  */
 static TextBufferObj str(TextBufferObj* _args) {
 
-    if(_args[0].type == OPT_STRING)
+    if(LV_IS_STRING(&_args[0]))
         return _args[0];
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    res.type = OPT_STRING;
-    res.str = lv_tb_getString(&args[0]);
+    if(LV_TYPE(&args[0]) == OPT_NUMBER || LV_TYPE(&args[0]) == OPT_INTEGER) {
+        //format numbers without allocating, most fit inline
+        char buf[24];
+        int len = LV_TYPE(&args[0]) == OPT_NUMBER
+            ? snprintf(buf, sizeof(buf), "%g", args[0].number)
+            : snprintf(buf, sizeof(buf), "%"PRId64, (int64_t) LV_INTEGER(&args[0]));
+        memcpy(lv_tb_newString(&res, len), buf, len);
+    } else {
+        res = lv_tb_box(OPT_STRING, lv_tb_getString(&args[0]));
+    }
     clearArgs(args, 1);
     return res;
 }
@@ -434,31 +797,29 @@ static TextBufferObj int_(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_INTEGER)
+    if(LV_TYPE(&args[0]) == OPT_INTEGER)
         return args[0];
-    if(args[0].type == OPT_NUMBER) {
+    if(LV_TYPE(&args[0]) == OPT_NUMBER) {
         //get magnitude
         double mag = args[0].number;
         if(!isfinite(mag)) {
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
         } else {
-            res.type = OPT_INTEGER;
-            res.integer = (uint64_t) mag;
+            res = lv_tb_integer((uint64_t) mag);
         }
-    } else if(args[0].type == OPT_STRING) {
+    } else if(LV_IS_STRING(&args[0])) {
         char* rest;
-        LvString* str = args[0].str;
+        char* str = LV_STR_VALUE(&args[0]);
         //unsigned negation is the same as two's complement negation
-        uint64_t i64 = (uint64_t) strtoumax(str->value, &rest, 10);
-        if(rest != str->value + str->len) {
+        uint64_t i64 = (uint64_t) strtoumax(str, &rest, 10);
+        if(rest != str + LV_STR_LEN(&args[0])) {
             //not all chars interpreted
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
         } else {
-            res.type = OPT_INTEGER;
-            res.integer = i64;
+            res = lv_tb_integer(i64);
         }
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -469,24 +830,22 @@ static TextBufferObj num(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_NUMBER)
+    if(LV_TYPE(&args[0]) == OPT_NUMBER)
         return args[0];
-    else if(args[0].type == OPT_INTEGER) {
-        res.type = OPT_NUMBER;
-        res.number = intToNum(args[0].integer);
-    } else if(args[0].type == OPT_STRING) {
+    else if(LV_TYPE(&args[0]) == OPT_INTEGER) {
+        res = lv_tb_number(intToNum(LV_INTEGER(&args[0])));
+    } else if(LV_IS_STRING(&args[0])) {
         char* rest;
-        LvString* str = args[0].str;
-        double d = strtod(str->value, &rest);
-        if(rest != str->value + str->len) {
+        char* str = LV_STR_VALUE(&args[0]);
+        double d = strtod(str, &rest);
+        if(rest != str + LV_STR_LEN(&args[0])) {
             //not all chars interpreted, error
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
         } else {
-            res.type = OPT_NUMBER;
-            res.number = d;
+            res = lv_tb_number(d);
         }
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -499,88 +858,120 @@ static TextBufferObj len(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    switch(args[0].type) {
+    switch(LV_TYPE(&args[0])) {
         case OPT_STRING:
+        case OPT_SHORT_STR:
+        case OPT_ROPE:
+        case OPT_STR_VIEW:
             //length of string
-            res.type = OPT_INTEGER;
-            res.integer = args[0].str->len;
+            res = lv_tb_integer(LV_STR_LEN(&args[0]));
             break;
         case OPT_FUNCTION_VAL:
             //arity of function
-            res.type = OPT_INTEGER;
-            res.integer = args[0].func->arity;
+            res = lv_tb_integer(LV_FUNC(&args[0])->arity);
             break;
         case OPT_CAPTURE:
-            res.type = OPT_INTEGER;
-            res.integer = args[0].capfunc->arity - args[0].capfunc->captureCount;
+            res = lv_tb_integer(LV_CAPTURE(&args[0])->func->arity - LV_CAPTURE(&args[0])->func->captureCount);
             break;
         case OPT_VECT:
-            res.type = OPT_INTEGER;
-            res.integer = args[0].vect->len;
+        case OPT_VECT_TREE:
+        case OPT_VECT_VIEW:
+            res = lv_tb_integer(LV_VECT_LEN(&args[0]));
             break;
         case OPT_MAP:
-            res.type = OPT_INTEGER;
-            res.integer = args[0].map->len;
+        case OPT_MAP_TRIE:
+            res = lv_tb_integer(LV_MAP_LEN(&args[0]));
             break;
         default:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
 }
 
-static uint64_t hashOf(void* mem, size_t len) {
-    //djb2 hash
-    uint64_t res = 5381;
-    unsigned char* str = mem;
-    while(len-- > 0)
-        res = ((res << 5) + res) + *str++;
-    return res;
+/** Returns where the hash of the given value is cached, or NULL. */
+static LvHashCache* hashCache(TextBufferObj* arg) {
+
+    switch(LV_TYPE(arg)) {
+        case OPT_STRING:
+            return &LV_STR(arg)->hash;
+        case OPT_ROPE:
+            return &lv_tb_flatten(LV_ROPE(arg))->hash;
+        case OPT_VECT:
+            return &LV_VECT(arg)->hash;
+        case OPT_VECT_TREE:
+            return &LV_TREE(arg)->hash;
+        case OPT_MAP:
+            return &LV_MAP(arg)->hash;
+        case OPT_MAP_TRIE:
+            return &LV_TRIE(arg)->hash;
+        default:
+            return NULL;
+    }
 }
 
 static uint64_t hashcode(TextBufferObj* arg) {
 
+    LvHashCache* cache = hashCache(arg);
+    LvHashSource source = LV_HASH_NONE;
+    if(cache) {
+        checkGlobal(&globalHash);
+        source = globalHash.forwards ? LV_HASH_INTRINSIC : LV_HASH_USER;
+        if(cache->source == source)
+            return cache->value;
+    }
     uint64_t res;
-    switch(arg->type) {
+    switch(LV_TYPE(arg)) {
         case OPT_UNDEFINED:
             res = 0;
             break;
         case OPT_NUMBER:
-            res = hashOf(&arg->number, sizeof(arg->number));
+            res = lv_hash_bytes(&arg->number, sizeof(arg->number));
             break;
         case OPT_INTEGER:
-            res = arg->integer;
+            res = LV_INTEGER(arg);
             break;
         case OPT_SYMB:
-            res = arg->symbIdx;
+            res = LV_SYMB(arg);
             break;
         case OPT_STRING:
-            res = hashOf(arg->str->value, arg->str->len);
+        case OPT_SHORT_STR:
+        case OPT_ROPE:
+        case OPT_STR_VIEW:
+            res = lv_hash_bytes(LV_STR_CHARS(arg), LV_STR_LEN(arg));
             break;
         case OPT_FUNCTION_VAL:
-            res = (uint64_t)arg->func;
+            res = (uint64_t)LV_FUNC(arg);
             break;
         case OPT_CAPTURE: {
             uint64_t h = 5381;
-            for(size_t i = 0; i < arg->capfunc->captureCount; i++) {
-                h = ((h << 5) + h) + lv_blt_hash(&arg->capture->value[i]);
+            for(size_t i = 0; i < LV_CAPTURE(arg)->func->captureCount; i++) {
+                h = ((h << 5) + h) + lv_blt_hash(&LV_CAPTURE(arg)->value[i]);
             }
             res = h;
             break;
         }
-        case OPT_VECT: {
+        case OPT_VECT:
+        case OPT_VECT_TREE:
+        case OPT_VECT_VIEW: {
             uint64_t h = 5381;
-            for(size_t i = 0; i < arg->vect->len; i++) {
-                h = ((h << 5) + h) + lv_blt_hash(&arg->vect->data[i]);
+            LvVectIter it;
+            lv_vec_iter(&it, arg, 0);
+            for(size_t i = 0; i < LV_VECT_LEN(arg); i++) {
+                h = ((h << 5) + h) + lv_blt_hash(lv_vec_next(&it));
             }
             res = h;
             break;
         }
-        case OPT_MAP: {
+        case OPT_MAP:
+        case OPT_MAP_TRIE: {
             uint64_t h = 5381;
-            for(size_t i = 0; i < arg->map->len; i++) {
-                h = ((h << 5) + h) + arg->map->data[i].hash;
-                h = ((h << 5) + h) + lv_blt_hash(&arg->map->data[i].value);
+            LvMapIter it;
+            lv_map_iter(&it, arg);
+            for(size_t i = 0; i < LV_MAP_LEN(arg); i++) {
+                LvMapNode* node = lv_map_next(&it);
+                h = ((h << 5) + h) + node->hash;
+                h = ((h << 5) + h) + lv_blt_hash(&node->value);
             }
             res = h;
             break;
@@ -588,6 +979,10 @@ static uint64_t hashcode(TextBufferObj* arg) {
         default:
             assert(false);
     }
+    if(cache) {
+        cache->value = res;
+        cache->source = source;
+    }
     return res;
 }
 
@@ -595,8 +990,7 @@ static TextBufferObj hash(TextBufferObj* _args) {
 
     TextBufferObj arg, res;
     getArgs(&arg, _args, 1);
-    res.type = OPT_INTEGER;
-    res.integer = hashcode(&arg);
+    res = lv_tb_integer(hashcode(&arg));
     clearArgs(&arg, 1);
     return res;
 }
@@ -604,61 +998,73 @@ static TextBufferObj hash(TextBufferObj* _args) {
 uint64_t lv_blt_hash(TextBufferObj* a) {
 
     TextBufferObj res;
-    lv_callFunction(&lv_globalHash, 1, a, &res);
-    return res.type == OPT_INTEGER ? res.integer : hashcode(a);
+    if(prepareNative(&globalHash, a))
+        res = globalHash.intrinsic(a);
+    else
+        lv_callFunction(&lv_globalHash, 1, a, &res);
+    uint64_t h;
+    return takeInteger(&res, &h) ? h : hashcode(a);
 }
 
 static bool equal(TextBufferObj* a, TextBufferObj* b) {
 
-    if(a->type != b->type) {
+    if(baseType(a) != baseType(b)) {
         //can't be equal if they have different types
         //numbers and integers are not equal!
         return false;
     }
-    switch(a->type) {
+    switch(baseType(a)) {
         case OPT_UNDEFINED:
             return true;
         case OPT_NUMBER:
             return a->number == b->number;
         case OPT_INTEGER:
-            return a->integer == b->integer;
+            return LV_INTEGER(a) == LV_INTEGER(b);
         case OPT_SYMB:
-            return a->symbIdx == b->symbIdx;
+            return LV_SYMB(a) == LV_SYMB(b);
         case OPT_STRING:
             //strings use value equality
-            return (a->str->len == b->str->len)
-                && (strcmp(a->str->value, b->str->value) == 0);
+            return (LV_STR_LEN(a) == LV_STR_LEN(b))
+                && (memcmp(LV_STR_CHARS(a), LV_STR_CHARS(b), LV_STR_LEN(a)) == 0);
         case OPT_FUNCTION_VAL:
-            return a->func == b->func;
+            return LV_FUNC(a) == LV_FUNC(b);
         case OPT_CAPTURE:
-            if(a->capfunc != b->capfunc)
+            if(LV_CAPTURE(a)->func != LV_CAPTURE(b)->func)
                 return false;
-            for(int i = 0; i < a->capfunc->captureCount; i++) {
-                if(!lv_blt_equal(&a->capture->value[i], &b->capture->value[i]))
+            for(int i = 0; i < LV_CAPTURE(a)->func->captureCount; i++) {
+                if(!lv_blt_equal(&LV_CAPTURE(a)->value[i], &LV_CAPTURE(b)->value[i]))
                     return false;
             }
             return true;
-        case OPT_VECT:
-            if(a->vect->len != b->vect->len)
+        case OPT_VECT: {
+            if(LV_VECT_LEN(a) != LV_VECT_LEN(b))
                 return false;
-            for(size_t i = 0; i < a->vect->len; i++) {
-                if(!lv_blt_equal(&a->vect->data[i], &b->vect->data[i]))
+            LvVectIter ia, ib;
+            lv_vec_iter(&ia, a, 0);
+            lv_vec_iter(&ib, b, 0);
+            for(size_t i = 0; i < LV_VECT_LEN(a); i++) {
+                if(!lv_blt_equal(lv_vec_next(&ia), lv_vec_next(&ib)))
                     return false;
             }
             return true;
-        case OPT_MAP:
-            //currently maps are stored in sorted order, so pairwise
-            //comparison is fine
-            if(a->map->len != b->map->len)
+        }
+        case OPT_MAP: {
+            //maps of either form iterate in sorted order,
+            //so pairwise comparison is fine
+            if(LV_MAP_LEN(a) != LV_MAP_LEN(b))
                 return false;
-            for(size_t i = 0; i < a->map->len; i++) {
-                LvMapNode* na = &a->map->data[i];
-                LvMapNode* nb = &b->map->data[i];
+            LvMapIter ia, ib;
+            lv_map_iter(&ia, a);
+            lv_map_iter(&ib, b);
+            for(size_t i = 0; i < LV_MAP_LEN(a); i++) {
+                LvMapNode* na = lv_map_next(&ia);
+                LvMapNode* nb = lv_map_next(&ib);
                 if(!lv_blt_equal(&na->key, &nb->key) || !lv_blt_equal(&na->value, &nb->value)) {
                     return false;
                 }
             }
             return true;
+        }
         default:
             assert(false);
     }
@@ -671,21 +1077,34 @@ static TextBufferObj eq(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    res.type = OPT_INTEGER;
-    res.integer = equal(&args[0], &args[1]);
+    res = lv_tb_integer(equal(&args[0], &args[1]));
     clearArgs(args, 2);
     return res;
 }
 
+/**
+ * Compares two strings of any form lexicographically,
+ * without requiring them to be terminated.
+ */
+static int strCmp(TextBufferObj* a, TextBufferObj* b) {
+
+    size_t alen = LV_STR_LEN(a);
+    size_t blen = LV_STR_LEN(b);
+    int cmp = memcmp(LV_STR_CHARS(a), LV_STR_CHARS(b), alen < blen ? alen : blen);
+    if(cmp != 0)
+        return cmp;
+    return (alen > blen) - (alen < blen);
+}
+
 /**
  * Compares two objects for less than.
  */
 static bool ltImpl(TextBufferObj* a, TextBufferObj* b) {
 
-    if(a->type != b->type) {
-        return (a->type < b->type);
+    if(baseType(a) != baseType(b)) {
+        return typeOrder(a) < typeOrder(b);
     }
-    switch(a->type) {
+    switch(baseType(a)) {
         case OPT_UNDEFINED:
             return false;
             break;
@@ -693,46 +1112,54 @@ static bool ltImpl(TextBufferObj* a, TextBufferObj* b) {
             return (a->number < b->number);
             break;
         case OPT_INTEGER:
-            return intCmp(a->integer, b->integer) < 0;
+            return intCmp(LV_INTEGER(a), LV_INTEGER(b)) < 0;
             break;
         case OPT_SYMB:
-            return (a->symbIdx < b->symbIdx);
+            return (LV_SYMB(a) < LV_SYMB(b));
         case OPT_STRING:
-            return (strcmp(a->str->value, b->str->value) < 0);
+            return strCmp(a, b) < 0;
             break;
         case OPT_FUNCTION_VAL:
-            return (uintptr_t)a->func < (uintptr_t)b->func;
+            return (uintptr_t)LV_FUNC(a) < (uintptr_t)LV_FUNC(b);
             break;
         //captures and vects compare the first nonequal values
         case OPT_CAPTURE:
-            if(a->capfunc == b->capfunc) {
-                for(int i = 0; i < a->capfunc->captureCount; i++) {
-                    if(lv_blt_lt(&a->capture->value[i], &b->capture->value[i])) {
+            if(LV_CAPTURE(a)->func == LV_CAPTURE(b)->func) {
+                for(int i = 0; i < LV_CAPTURE(a)->func->captureCount; i++) {
+                    if(lv_blt_lt(&LV_CAPTURE(a)->value[i], &LV_CAPTURE(b)->value[i])) {
                         return true;
-                    } else if(lv_blt_lt(&b->capture->value[i], &a->capture->value[i])) {
+                    } else if(lv_blt_lt(&LV_CAPTURE(b)->value[i], &LV_CAPTURE(a)->value[i])) {
                         return false;
                     }
                 }
                 return false;
             }
-            return (uintptr_t)a->capfunc < (uintptr_t)b->capfunc;
+            return (uintptr_t)LV_CAPTURE(a)->func < (uintptr_t)LV_CAPTURE(b)->func;
         case OPT_VECT:
-            if(a->vect->len == b->vect->len) {
-                for(size_t i = 0; i < a->vect->len; i++) {
-                    if(lv_blt_lt(&a->vect->data[i], &b->vect->data[i])) {
+            if(LV_VECT_LEN(a) == LV_VECT_LEN(b)) {
+                LvVectIter ia, ib;
+                lv_vec_iter(&ia, a, 0);
+                lv_vec_iter(&ib, b, 0);
+                for(size_t i = 0; i < LV_VECT_LEN(a); i++) {
+                    TextBufferObj* ea = lv_vec_next(&ia);
+                    TextBufferObj* eb = lv_vec_next(&ib);
+                    if(lv_blt_lt(ea, eb)) {
                         return true;
-                    } else if(lv_blt_lt(&b->vect->data[i], &a->vect->data[i])) {
+                    } else if(lv_blt_lt(eb, ea)) {
                         return false;
                     }
                 }
                 return false;
             }
-            return a->vect->len < b->vect->len;
+            return LV_VECT_LEN(a) < LV_VECT_LEN(b);
         case OPT_MAP:
-            if(a->map->len == b->map->len) {
-                for(size_t i = 0; i < a->map->len; i++) {
-                    LvMapNode* na = &a->map->data[i];
-                    LvMapNode* nb = &b->map->data[i];
+            if(LV_MAP_LEN(a) == LV_MAP_LEN(b)) {
+                LvMapIter ia, ib;
+                lv_map_iter(&ia, a);
+                lv_map_iter(&ib, b);
+                for(size_t i = 0; i < LV_MAP_LEN(a); i++) {
+                    LvMapNode* na = lv_map_next(&ia);
+                    LvMapNode* nb = lv_map_next(&ib);
                     if(lv_blt_lt(&na->key, &nb->key)) {
                         return true;
                     } else if(lv_blt_lt(&nb->key, &na->key)) {
@@ -745,7 +1172,7 @@ static bool ltImpl(TextBufferObj* a, TextBufferObj* b) {
                 }
                 return false;
             }
-            return a->map->len < b->map->len;
+            return LV_MAP_LEN(a) < LV_MAP_LEN(b);
         default:
             assert(false);
     }
@@ -755,22 +1182,24 @@ bool lv_blt_lt(TextBufferObj* a, TextBufferObj* b) {
 
     TextBufferObj lt;
     TextBufferObj ab[2] = { *a, *b };
-    lv_callFunction(&lv_globalLt, 2, ab, &lt);
-    return lt.type == OPT_INTEGER ? lt.integer : ltImpl(a, b);
+    if(prepareNative(&globalLt, ab))
+        lt = globalLt.intrinsic(ab);
+    else
+        lv_callFunction(&lv_globalLt, 2, ab, &lt);
+    uint64_t res;
+    return takeInteger(&lt, &res) ? res != 0 : ltImpl(a, b);
 }
 
 static TextBufferObj lt(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    res.type = OPT_INTEGER;
-    if((args[0].type == OPT_NUMBER && args[1].type == OPT_NUMBER)
+    if((LV_TYPE(&args[0]) == OPT_NUMBER && LV_TYPE(&args[1]) == OPT_NUMBER)
     && ((args[0].number != args[0].number) || (args[1].number != args[1].number))) {
         //one of them is NaN
-        res.number = 0.0;
-        return res;
+        return lv_tb_integer(0);
     }
-    res.integer = ltImpl(&args[0], &args[1]);
+    res = lv_tb_integer(ltImpl(&args[0], &args[1]));
     clearArgs(args, 2);
     return res;
 }
@@ -782,14 +1211,12 @@ static TextBufferObj ge(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    res.type = OPT_INTEGER;
-    if((args[0].type == OPT_NUMBER && args[1].type == OPT_NUMBER)
+    if((LV_TYPE(&args[0]) == OPT_NUMBER && LV_TYPE(&args[1]) == OPT_NUMBER)
     && ((args[0].number != args[0].number) || (args[1].number != args[1].number))) {
         //one of them is NaN
-        res.number = 0.0;
-        return res;
+        return lv_tb_integer(0);
     }
-    res.integer = !ltImpl(&args[0], &args[1]);
+    res = lv_tb_integer(!ltImpl(&args[0], &args[1]));
     clearArgs(args, 2);
     return res;
 }
@@ -802,28 +1229,28 @@ typedef union NumType { uint64_t integer; double number; } NumType;
  * integer to number if necessary.
  */
 static NumResult getObjsAsNumbers(TextBufferObj args[2], NumType res[2]) {
-    switch(args[0].type) {
+    switch(LV_TYPE(&args[0])) {
         case OPT_INTEGER:
-            switch(args[1].type) {
+            switch(LV_TYPE(&args[1])) {
                 case OPT_INTEGER:
                     //both are integers
-                    res[0].integer = args[0].integer;
-                    res[1].integer = args[1].integer;
+                    res[0].integer = LV_INTEGER(&args[0]);
+                    res[1].integer = LV_INTEGER(&args[1]);
                     return NR_INTEGER;
                 case OPT_NUMBER:
                     //convert args[0] to number
-                    res[0].number = intToNum(args[0].integer);
+                    res[0].number = intToNum(LV_INTEGER(&args[0]));
                     res[1].number = args[1].number;
                     return NR_NUMBER;
                 default:
                     return NR_ERROR;
             }
         case OPT_NUMBER:
-            switch(args[1].type) {
+            switch(LV_TYPE(&args[1])) {
                 case OPT_INTEGER:
                     //convert args[1] to number
                     res[0].number = args[0].number;
-                    res[1].number = intToNum(args[1].integer);
+                    res[1].number = intToNum(LV_INTEGER(&args[1]));
                     return NR_NUMBER;
                 case OPT_NUMBER:
                     //both are numbers
@@ -848,15 +1275,13 @@ static TextBufferObj add(TextBufferObj* _args) {
     getArgs(args, _args, 2);
     switch(getObjsAsNumbers(args, nums)) {
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = nums[0].number + nums[1].number;
+            res = lv_tb_number(nums[0].number + nums[1].number);
             break;
         case NR_INTEGER:
-            res.type = OPT_INTEGER;
-            res.integer = nums[0].integer + nums[1].integer;
+            res = lv_tb_integer(nums[0].integer + nums[1].integer);
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -873,15 +1298,13 @@ static TextBufferObj sub(TextBufferObj* _args) {
     getArgs(args, _args, 2);
     switch(getObjsAsNumbers(args, nums)) {
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = nums[0].number - nums[1].number;
+            res = lv_tb_number(nums[0].number - nums[1].number);
             break;
         case NR_INTEGER:
-            res.type = OPT_INTEGER;
-            res.integer = nums[0].integer - nums[1].integer;
+            res = lv_tb_integer(nums[0].integer - nums[1].integer);
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -896,15 +1319,13 @@ static TextBufferObj mul(TextBufferObj* _args) {
     getArgs(args, _args, 2);
     switch(getObjsAsNumbers(args, nums)) {
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = nums[0].number * nums[1].number;
+            res = lv_tb_number(nums[0].number * nums[1].number);
             break;
         case NR_INTEGER:
-            res.type = OPT_INTEGER;
-            res.integer = nums[0].integer * nums[1].integer;
+            res = lv_tb_integer(nums[0].integer * nums[1].integer);
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -956,11 +1377,10 @@ static TextBufferObj div_(TextBufferObj* _args) {
             nums[1].number = intToNum(nums[1].integer);
             //fallthrough
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = numDiv(nums[0].number, nums[1].number, false);
+            res = lv_tb_number(numDiv(nums[0].number, nums[1].number, false));
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -978,10 +1398,9 @@ static TextBufferObj idiv(TextBufferObj* _args) {
             double a = nums[0].number;
             double b = nums[1].number;
             if(isfinite(a) && isfinite(b) && b != 0.0) {
-                res.type = OPT_INTEGER;
-                res.integer = (uint64_t)((a - numDiv(a, b, true)) / b);
+                res = lv_tb_integer((uint64_t)((a - numDiv(a, b, true)) / b));
             } else {
-                res.type = OPT_UNDEFINED;
+                res = LV_UNDEFINED;
             }
             break;
         }
@@ -989,15 +1408,14 @@ static TextBufferObj idiv(TextBufferObj* _args) {
             uint64_t a = nums[0].integer;
             uint64_t b = nums[1].integer;
             if(b != 0) {
-                res.type = OPT_INTEGER;
-                res.integer = intDiv(a, b, false);
+                res = lv_tb_integer(intDiv(a, b, false));
             } else {
-                res.type = OPT_UNDEFINED;
+                res = LV_UNDEFINED;
             }
             break;
         }
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -1012,15 +1430,13 @@ static TextBufferObj rem(TextBufferObj* _args) {
     getArgs(args, _args, 2);
     switch(getObjsAsNumbers(args, nums)) {
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = numDiv(nums[0].number, nums[1].number, true);
+            res = lv_tb_number(numDiv(nums[0].number, nums[1].number, true));
             break;
         case NR_INTEGER:
-            res.type = OPT_INTEGER;
-            res.integer = intDiv(nums[0].integer, nums[1].integer, true);
+            res = lv_tb_integer(intDiv(nums[0].integer, nums[1].integer, true));
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -1035,24 +1451,21 @@ static TextBufferObj pow_(TextBufferObj* _args) {
     getArgs(args, _args, 2);
     switch(getObjsAsNumbers(args, nums)) {
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = pow(nums[0].number, nums[1].number);
+            res = lv_tb_number(pow(nums[0].number, nums[1].number));
             break;
         case NR_INTEGER: {
             uint64_t a = nums[0].integer;
             uint64_t b = nums[1].integer;
             if(isNegative(b)) {
                 if(a == 0) {
-                    res.type = OPT_UNDEFINED;
+                    res = LV_UNDEFINED;
                 } else {
                     //negative powers are equiv. to 1 / (a ** b)
-                    res.type = OPT_NUMBER;
-                    res.number = pow(intToNum(a), intToNum(b));
+                    res = lv_tb_number(pow(intToNum(a), intToNum(b)));
                 }
             } else if(a == 2) {
                 //2 ** x can be implemented with a bit shift by (b & 63)
-                res.type = OPT_INTEGER;
-                res.integer = UINT64_C(1) << (b & 63);
+                res = lv_tb_integer(UINT64_C(1) << (b & 63));
             } else {
                 //algorithm taken from everyone's favorite source of knowledge,
                 //stack overflow
@@ -1063,13 +1476,12 @@ static TextBufferObj pow_(TextBufferObj* _args) {
                     a *= a;
                     b >>= 1;
                 }
-                res.type = OPT_INTEGER;
-                res.integer = powres;
+                res = lv_tb_integer(powres);
             }
             break;
         }
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -1080,10 +1492,10 @@ static TextBufferObj pos(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_NUMBER || args[0].type == OPT_INTEGER) {
+    if(LV_TYPE(&args[0]) == OPT_NUMBER || LV_TYPE(&args[0]) == OPT_INTEGER) {
         return args[0];
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -1094,14 +1506,12 @@ static TextBufferObj neg(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_NUMBER) {
-        res.type = OPT_NUMBER;
-        res.number = -args[0].number;
-    } else if(args[0].type == OPT_INTEGER) {
-        res.type = OPT_INTEGER;
-        res.integer = -args[0].integer;
+    if(LV_TYPE(&args[0]) == OPT_NUMBER) {
+        res = lv_tb_number(-args[0].number);
+    } else if(LV_TYPE(&args[0]) == OPT_INTEGER) {
+        res = lv_tb_integer(-LV_INTEGER(&args[0]));
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -1111,14 +1521,12 @@ static TextBufferObj neg(TextBufferObj* _args) {
 static TextBufferObj fnc##_(TextBufferObj* _args) { \
     TextBufferObj args[1], res; \
     getArgs(args, _args, 1); \
-    if(args[0].type == OPT_NUMBER) { \
-        res.type = OPT_NUMBER; \
-        res.number = fnc(args[0].number); \
-    } else if(args[0].type == OPT_INTEGER) { \
-        res.type = OPT_NUMBER; \
-        res.number = fnc(intToNum(args[0].integer)); \
+    if(LV_TYPE(&args[0]) == OPT_NUMBER) { \
+        res = lv_tb_number(fnc(args[0].number)); \
+    } else if(LV_TYPE(&args[0]) == OPT_INTEGER) { \
+        res = lv_tb_number(fnc(intToNum(LV_INTEGER(&args[0])))); \
     } else { \
-        res.type = OPT_UNDEFINED; \
+        res = LV_UNDEFINED; \
     } \
     clearArgs(args, 1); \
     return res; \
@@ -1148,15 +1556,13 @@ static TextBufferObj abs_(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_NUMBER) {
-        res.type = OPT_NUMBER;
-        res.number = fabs(args[0].number);
-    } else if(args[0].type == OPT_INTEGER) {
-        uint64_t a = args[0].integer;
-        res.type = OPT_INTEGER;
-        res.integer = isNegative(a) ? -a : a;
+    if(LV_TYPE(&args[0]) == OPT_NUMBER) {
+        res = lv_tb_number(fabs(args[0].number));
+    } else if(LV_TYPE(&args[0]) == OPT_INTEGER) {
+        uint64_t a = LV_INTEGER(&args[0]);
+        res = lv_tb_integer(isNegative(a) ? -a : a);
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -1173,11 +1579,10 @@ static TextBufferObj atan2_(TextBufferObj* _args) {
             nums[1].number = intToNum(nums[1].integer);
             //fallthrough
         case NR_NUMBER:
-            res.type = OPT_NUMBER;
-            res.number = atan2(nums[0].number, nums[1].number);
+            res = lv_tb_number(atan2(nums[0].number, nums[1].number));
             break;
         case NR_ERROR:
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
             break;
     }
     clearArgs(args, 2);
@@ -1189,17 +1594,15 @@ static TextBufferObj sgn(TextBufferObj* _args) {
 
     TextBufferObj args[1], res;
     getArgs(args, _args, 1);
-    if(args[0].type == OPT_NUMBER) {
-        res.type = OPT_INTEGER;
+    if(LV_TYPE(&args[0]) == OPT_NUMBER) {
         // (-inf, -0] -> -1 : [+0, inf) -> +1
-        res.integer = 1 - ((bool)signbit(args[0].number) << 1);
-    } else if(args[0].type == OPT_INTEGER) {
-        uint64_t a = args[0].integer;
-        res.type = OPT_INTEGER;
+        res = lv_tb_integer(1 - ((bool)signbit(args[0].number) << 1));
+    } else if(LV_TYPE(&args[0]) == OPT_INTEGER) {
+        uint64_t a = LV_INTEGER(&args[0]);
         //[min, -1] -> -1, [0] -> 0, [1, max] -> +1
-        res.integer = (a && (a < (UINT64_C(1) << 63))) - (a >> 63);
+        res = lv_tb_integer((a && (a < (UINT64_C(1) << 63))) - (a >> 63));
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 1);
     return res;
@@ -1212,42 +1615,80 @@ static TextBufferObj map(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[0].type == OPT_VECT) {
+    //a unique flat vect or map is mapped in place
+    bool inPlace = (LV_TYPE(&args[0]) == OPT_VECT || LV_TYPE(&args[0]) == OPT_MAP)
+        && isUnique(&_args[0], &args[0]);
+    if(LV_IS_VECT(&args[0])) {
         TextBufferObj func = args[1]; //in case the stack is reallocated
-        TextBufferObj* oldData = args[0].vect->data;
-        size_t len = args[0].vect->len;
-        LvVect* vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-        vect->refCount = 0;
-        vect->len = len;
+        size_t len = LV_VECT_LEN(&args[0]);
+        LvVect* vect = LV_VECT(&args[0]);
+        if(!inPlace) {
+            vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+            vect->refCount = 0;
+            vect->len = len;
+        }
+        LvVectIter it;
+        lv_vec_iter(&it, &args[0], 0);
         for(size_t i = 0; i < len; i++) {
+            TextBufferObj* elem = lv_vec_next(&it);
             TextBufferObj obj;
-            lv_callFunction(&func, 1, &oldData[i], &obj);
+            lv_callFunction(&func, 1, elem, &obj);
             incRefCount(&obj);
+            if(inPlace)
+                lv_expr_cleanup(elem, 1);
             vect->data[i] = obj;
         }
-        res.type = OPT_VECT;
-        res.vect = vect;
-    } else if(args[0].type == OPT_MAP) {
+        if(inPlace)
+            takeArg(&_args[0], &args[0]);
+        vect->hash.source = LV_HASH_NONE;
+        res = lv_tb_box(OPT_VECT, vect);
+    } else if(LV_TYPE(&args[0]) == OPT_MAP) {
         TextBufferObj func = args[1];
-        LvMapNode* oldData = args[0].map->data;
-        size_t len = args[0].map->len;
-        LvMap* map = lv_alloc(sizeof(LvMap) + len * sizeof(LvMapNode));
-        map->refCount = 0;
-        map->len = len;
+        LvMapNode* oldData = LV_MAP(&args[0])->data;
+        size_t len = LV_MAP(&args[0])->len;
+        LvMap* map = LV_MAP(&args[0]);
+        //in place, the keys stay where they are, so the index is kept
+        if(!inPlace) {
+            map = lv_alloc(sizeof(LvMap) + len * sizeof(LvMapNode));
+            map->refCount = 0;
+            map->len = len;
+            map->index = NULL;
+        }
         for(size_t i = 0; i < len; i++) {
             TextBufferObj keyValue[2] = { oldData[i].key, oldData[i].value };
             TextBufferObj obj;
             lv_callFunction(&func, 2, keyValue, &obj);
             incRefCount(&obj);
+            if(inPlace) {
+                lv_expr_cleanup(&oldData[i].value, 1);
+            } else {
+                incRefCount(&oldData[i].key);
+                map->data[i].key = oldData[i].key;
+                map->data[i].hash = oldData[i].hash;
+            }
             map->data[i].value = obj;
-            incRefCount(&oldData[i].key);
-            map->data[i].key = oldData[i].key;
-            map->data[i].hash = oldData[i].hash;
         }
-        res.type = OPT_MAP;
-        res.map = map;
+        if(inPlace)
+            takeArg(&_args[0], &args[0]);
+        map->hash.source = LV_HASH_NONE;
+        res = lv_tb_box(OPT_MAP, map);
+    } else if(LV_TYPE(&args[0]) == OPT_MAP_TRIE) {
+        //the trie keeps its shape, only the values change
+        TextBufferObj func = args[1];
+        size_t len = LV_TRIE(&args[0])->len;
+        TextBufferObj* values = lv_alloc(len * sizeof(TextBufferObj));
+        LvMapIter it;
+        lv_map_iter(&it, &args[0]);
+        for(size_t i = 0; i < len; i++) {
+            LvMapNode* node = lv_map_next(&it);
+            TextBufferObj keyValue[2] = { node->key, node->value };
+            lv_callFunction(&func, 2, keyValue, &values[i]);
+            incRefCount(&values[i]);
+        }
+        lv_map_withValues(LV_TRIE(&args[0]), values, &res);
+        lv_free(values);
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -1258,60 +1699,95 @@ static TextBufferObj filter(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[0].type == OPT_VECT) {
+    //a unique flat vect or map is filtered in place
+    bool inPlace = (LV_TYPE(&args[0]) == OPT_VECT || LV_TYPE(&args[0]) == OPT_MAP)
+        && isUnique(&_args[0], &args[0]);
+    if(LV_IS_VECT(&args[0])) {
         TextBufferObj func = args[1];
-        TextBufferObj* oldData = args[0].vect->data;
-        size_t len = args[0].vect->len;
-        LvVect* vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-        vect->refCount = 0;
+        size_t len = LV_VECT_LEN(&args[0]);
+        LvVect* vect = LV_VECT(&args[0]);
+        if(!inPlace) {
+            vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+            vect->refCount = 0;
+        }
         size_t newLen = 0;
+        LvVectIter it;
+        lv_vec_iter(&it, &args[0], 0);
         for(size_t i = 0; i < len; i++) {
+            TextBufferObj* elem = lv_vec_next(&it);
             TextBufferObj passed;
-            lv_callFunction(&func, 1, &oldData[i], &passed);
+            lv_callFunction(&func, 1, elem, &passed);
             incRefCount(&passed); //so lv_expr_cleanup doesn't blow up
             if(lv_blt_toBool(&passed)) {
-                incRefCount(&oldData[i]);
-                vect->data[newLen] = oldData[i];
+                //in place, the vect's reference is moved
+                if(!inPlace)
+                    incRefCount(elem);
+                vect->data[newLen] = *elem;
                 newLen++;
+            } else if(inPlace) {
+                lv_expr_cleanup(elem, 1);
             }
             lv_expr_cleanup(&passed, 1);
         }
+        if(inPlace)
+            takeArg(&_args[0], &args[0]);
         vect->len = newLen;
+        vect->hash.source = LV_HASH_NONE;
         if(newLen < len) {
             vect = lv_realloc(vect, sizeof(LvVect) + newLen * sizeof(TextBufferObj));
         }
-        res.type = OPT_VECT;
-        res.vect = vect;
-    } else if(args[0].type == OPT_MAP) {
+        res = lv_tb_box(OPT_VECT, vect);
+    } else if(LV_IS_MAP(&args[0])) {
         TextBufferObj func = args[1];
-        LvMapNode* oldData = args[0].map->data;
-        size_t len = args[0].map->len;
-        LvMap* map = lv_alloc(sizeof(LvMap) + len * sizeof(LvMapNode));
-        map->refCount = 0;
+        size_t len = LV_MAP_LEN(&args[0]);
+        LvMap* map = LV_MAP(&args[0]);
+        if(!inPlace) {
+            map = lv_alloc(sizeof(LvMap) + len * sizeof(LvMapNode));
+            map->refCount = 0;
+        } else {
+            lv_free(map->index);
+        }
+        map->index = NULL;
+        map->hash.source = LV_HASH_NONE;
         size_t newLen = 0;
+        LvMapIter it;
+        lv_map_iter(&it, &args[0]);
         for(size_t i = 0; i < len; i++) {
-            TextBufferObj keyValue[2] = { oldData[i].key, oldData[i].value };
+            LvMapNode* node = lv_map_next(&it);
+            TextBufferObj keyValue[2] = { node->key, node->value };
+            uint64_t hash = node->hash;
             TextBufferObj passed;
             lv_callFunction(&func, 2, keyValue, &passed);
             incRefCount(&passed);
             if(lv_blt_toBool(&passed)) {
-                incRefCount(&keyValue[0]);
+                //in place, the map's references are moved
+                if(!inPlace) {
+                    incRefCount(&keyValue[0]);
+                    incRefCount(&keyValue[1]);
+                }
                 map->data[newLen].key = keyValue[0];
-                map->data[newLen].hash = oldData[i].hash;
-                incRefCount(&keyValue[1]);
+                map->data[newLen].hash = hash;
                 map->data[newLen].value = keyValue[1];
                 newLen++;
+            } else if(inPlace) {
+                lv_expr_cleanup(keyValue, 2);
             }
             lv_expr_cleanup(&passed, 1);
         }
+        if(inPlace)
+            takeArg(&_args[0], &args[0]);
         map->len = newLen;
-        if(newLen < len) {
-            map = lv_realloc(map, sizeof(LvMap) + newLen * sizeof(LvMapNode));
+        if(LV_TYPE(&args[0]) == OPT_MAP_TRIE && newLen >= LV_MAP_TRIE_MIN) {
+            //the kept entries are in order, so they form a flat map
+            lv_map_fromFlat(map, &res);
+        } else {
+            if(newLen < len) {
+                map = lv_realloc(map, sizeof(LvMap) + newLen * sizeof(LvMapNode));
+            }
+            res = lv_tb_box(OPT_MAP, map);
         }
-        res.type = OPT_MAP;
-        res.map = map;
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -1322,29 +1798,32 @@ static TextBufferObj fold(TextBufferObj* _args) {
 
     TextBufferObj args[3], res;
     getArgs(args, _args, 3);
-    if(args[0].type == OPT_VECT) {
-        size_t len = args[0].vect->len;
-        TextBufferObj* oldData = args[0].vect->data;
+    if(LV_IS_VECT(&args[0])) {
+        size_t len = LV_VECT_LEN(&args[0]);
         TextBufferObj accum[2] = { args[1] };
         TextBufferObj func = args[2];
+        LvVectIter it;
+        lv_vec_iter(&it, &args[0], 0);
         for(size_t i = 0; i < len; i++) {
-            accum[1] = oldData[i];
+            accum[1] = *lv_vec_next(&it);
             lv_callFunction(&func, 2, accum, &accum[0]);
         }
         res = accum[0];
-    } else if(args[0].type == OPT_MAP) {
-        size_t len = args[0].map->len;
-        LvMapNode* oldData = args[0].map->data;
+    } else if(LV_IS_MAP(&args[0])) {
+        size_t len = LV_MAP_LEN(&args[0]);
         TextBufferObj accum[3] = { args[1] };
         TextBufferObj func = args[2];
+        LvMapIter it;
+        lv_map_iter(&it, &args[0]);
         for(size_t i = 0; i < len; i++) {
-            accum[1] = oldData[i].key;
-            accum[2] = oldData[i].value;
+            LvMapNode* node = lv_map_next(&it);
+            accum[1] = node->key;
+            accum[2] = node->value;
             lv_callFunction(&func, 3, accum, &accum[0]);
         }
         res = accum[0];
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 3);
     return res;
@@ -1355,52 +1834,36 @@ static TextBufferObj slice(TextBufferObj* _args) {
 
     TextBufferObj args[3], res;
     getArgs(args, _args, 3);
-    if(args[1].type != OPT_INTEGER || args[2].type != OPT_INTEGER) {
+    if(LV_TYPE(&args[1]) != OPT_INTEGER || LV_TYPE(&args[2]) != OPT_INTEGER) {
         //check that index args are numbers
-        res.type = OPT_UNDEFINED;
-    } else if(args[0].type != OPT_VECT && args[0].type != OPT_STRING) {
+        res = LV_UNDEFINED;
+    } else if(!LV_IS_VECT(&args[0]) && !LV_IS_STRING(&args[0])) {
         //check that the receiver is of appropriate type
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     } else {
-        uint64_t start = args[1].integer;
-        uint64_t end = args[2].integer;
+        uint64_t start = LV_INTEGER(&args[1]);
+        uint64_t end = LV_INTEGER(&args[2]);
         //sanity check
         if(start > end || isNegative(start) || isNegative(end)) {
-            res.type = OPT_UNDEFINED;
-        } else if(args[0].type == OPT_VECT) {
-            size_t len = args[0].vect->len;
+            res = LV_UNDEFINED;
+        } else if(LV_IS_VECT(&args[0])) {
+            size_t len = LV_VECT_LEN(&args[0]);
             //bounds check
             if((size_t)start > len || (size_t)end > len) {
-                res.type = OPT_UNDEFINED;
+                res = LV_UNDEFINED;
             } else {
-                //create new vect
-                res.type = OPT_VECT;
-                res.vect = lv_alloc(sizeof(LvVect) + (end - start) * sizeof(TextBufferObj));
-                res.vect->refCount = 0;
-                res.vect->len = end - start;
-                //copy over elements
-                for(size_t i = 0; i < res.vect->len; i++) {
-                    res.vect->data[i] = args[0].vect->data[start + i];
-                    incRefCount(&res.vect->data[i]);
-                }
+                lv_vec_slice(&args[0], start, end, &res);
             }
-        } else if(args[0].type == OPT_STRING) {
-            size_t len = args[0].str->len;
+        } else if(LV_IS_STRING(&args[0])) {
+            size_t len = LV_STR_LEN(&args[0]);
             //bounds check
             if((size_t)start > len || (size_t)end > len) {
-                res.type = OPT_UNDEFINED;
+                res = LV_UNDEFINED;
             } else {
-                //create new string (include NUL terminator)
-                res.type = OPT_STRING;
-                res.str = lv_alloc(sizeof(LvString) + (end - start + 1));
-                res.str->refCount = 0;
-                res.str->len = end - start;
-                //copy over elements
-                memcpy(res.str->value, &args[0].str->value[start], res.str->len);
-                res.str->value[res.str->len] = '\0';
+                lv_tb_substring(&args[0], start, end, &res);
             }
         } else {
-            res.type = OPT_UNDEFINED;
+            res = LV_UNDEFINED;
         }
     }
     clearArgs(args, 3);
@@ -1412,34 +1875,27 @@ TextBufferObj take(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[0].type == OPT_VECT) {
+    if(LV_IS_VECT(&args[0])) {
         TextBufferObj func = args[1];
-        TextBufferObj* data = args[0].vect->data;
-        size_t len = args[0].vect->len;
-        //overestimate
-        LvVect* vec = lv_alloc(sizeof(LvVect) + args[0].vect->len * sizeof(TextBufferObj));
-        vec->refCount = 0;
+        size_t len = LV_VECT_LEN(&args[0]);
         size_t newLen = 0;
         bool cont = true;
+        LvVectIter it;
+        lv_vec_iter(&it, &args[0], 0);
         while(cont && newLen < len) {
             TextBufferObj satisfied;
-            lv_callFunction(&func, 1, &data[newLen], &satisfied);
+            lv_callFunction(&func, 1, lv_vec_next(&it), &satisfied);
             incRefCount(&satisfied);
             if(lv_blt_toBool(&satisfied)) {
-                incRefCount(&data[newLen]);
-                vec->data[newLen] = data[newLen];
                 newLen++;
             } else {
                 cont = false;
             }
             lv_expr_cleanup(&satisfied, 1);
         }
-        vec = lv_realloc(vec, sizeof(LvVect) + newLen * sizeof(TextBufferObj));
-        vec->len = newLen;
-        res.type = OPT_VECT;
-        res.vect = vec;
+        lv_vec_slice(&args[0], 0, newLen, &res);
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
@@ -1450,15 +1906,16 @@ TextBufferObj skip(TextBufferObj* _args) {
 
     TextBufferObj args[2], res;
     getArgs(args, _args, 2);
-    if(args[0].type == OPT_VECT) {
+    if(LV_IS_VECT(&args[0])) {
         TextBufferObj func = args[1];
-        TextBufferObj* data = args[0].vect->data;
-        size_t len = args[0].vect->len;
+        size_t len = LV_VECT_LEN(&args[0]);
         size_t skipLen = 0;
         bool cont = true;
+        LvVectIter it;
+        lv_vec_iter(&it, &args[0], 0);
         while(cont && skipLen < len) {
             TextBufferObj satisfied;
-            lv_callFunction(&func, 1, &data[skipLen], &satisfied);
+            lv_callFunction(&func, 1, lv_vec_next(&it), &satisfied);
             incRefCount(&satisfied);
             if(lv_blt_toBool(&satisfied)) {
                 skipLen++;
@@ -1467,22 +1924,411 @@ TextBufferObj skip(TextBufferObj* _args) {
             }
             lv_expr_cleanup(&satisfied, 1);
         }
-        LvVect* vec = lv_alloc(sizeof(LvVect) + (len - skipLen) * sizeof(TextBufferObj));
-        vec->refCount = 0;
-        vec->len = len - skipLen;
-        for(size_t i = skipLen; i < len; i++) {
-            incRefCount(&data[i]);
-            vec->data[i - skipLen] = data[i];
-        }
-        res.type = OPT_VECT;
-        res.vect = vec;
+        lv_vec_slice(&args[0], skipLen, len, &res);
     } else {
-        res.type = OPT_UNDEFINED;
+        res = LV_UNDEFINED;
     }
     clearArgs(args, 2);
     return res;
 }
 
+/**
+ * Evaluates a quickened arithmetic or comparison opcode on two
+ * numeric arguments. The semantics match the corresponding
+ * intrinsic functions.
+ */
+bool lv_blt_quickOp(OpType op, TextBufferObj* args, TextBufferObj* res) {
+
+    NumType nums[2];
+    NumResult kind;
+    if(LV_IS_SMALL_INT(&args[0]) && LV_IS_SMALL_INT(&args[1])) {
+        //the common case
+        nums[0].integer = LV_INTEGER(&args[0]);
+        nums[1].integer = LV_INTEGER(&args[1]);
+        kind = NR_INTEGER;
+    } else if(LV_IS_DYNAMIC(&args[0]) || LV_IS_DYNAMIC(&args[1])) {
+        //the result replaces the args without releasing them
+        return false;
+    } else {
+        kind = getObjsAsNumbers(args, nums);
+        if(kind == NR_ERROR)
+            return false;
+    }
+    switch(op) {
+        case OPT_ADD:
+        case OPT_SUB:
+        case OPT_MUL:
+            if(kind == NR_INTEGER) {
+                uint64_t r = op == OPT_ADD ? nums[0].integer + nums[1].integer
+                    : op == OPT_SUB ? nums[0].integer - nums[1].integer
+                    : nums[0].integer * nums[1].integer;
+                //results that need the heap go through the intrinsic
+                if(!LV_FITS_SMALL_INT(r))
+                    return false;
+                *res = lv_tb_integer(r);
+            } else {
+                *res = lv_tb_number(op == OPT_ADD ? nums[0].number + nums[1].number
+                    : op == OPT_SUB ? nums[0].number - nums[1].number
+                    : nums[0].number * nums[1].number);
+            }
+            return true;
+        case OPT_DIV:
+            if(kind == NR_INTEGER) {
+                nums[0].number = intToNum(nums[0].integer);
+                nums[1].number = intToNum(nums[1].integer);
+            }
+            *res = lv_tb_number(numDiv(nums[0].number, nums[1].number, false));
+            return true;
+        case OPT_IDIV:
+        case OPT_REM:
+            //leave the edge cases to the intrinsics
+            if(kind != NR_INTEGER || nums[1].integer == 0)
+                return false;
+            nums[0].integer = intDiv(nums[0].integer, nums[1].integer, op == OPT_REM);
+            if(!LV_FITS_SMALL_INT(nums[0].integer))
+                return false;
+            *res = lv_tb_integer(nums[0].integer);
+            return true;
+        default:
+            break;
+    }
+    //comparisons between ints and nums order by type
+    if(LV_TYPE(&args[0]) != LV_TYPE(&args[1]))
+        return false;
+    bool cmp;
+    if(kind == NR_INTEGER) {
+        int c = intCmp(nums[0].integer, nums[1].integer);
+        switch(op) {
+            case OPT_EQ: cmp = c == 0; break;
+            case OPT_LT: cmp = c < 0; break;
+            case OPT_GT: cmp = c > 0; break;
+            case OPT_LE: cmp = c <= 0; break;
+            case OPT_GE: cmp = c >= 0; break;
+            default: assert(false); return false;
+        }
+    } else {
+        //comparisons with NaN are always false
+        double a = nums[0].number;
+        double b = nums[1].number;
+        switch(op) {
+            case OPT_EQ: cmp = a == b; break;
+            case OPT_LT: cmp = a < b; break;
+            case OPT_GT: cmp = a > b; break;
+            case OPT_LE: cmp = a <= b; break;
+            case OPT_GE: cmp = a >= b; break;
+            default: assert(false); return false;
+        }
+    }
+    *res = lv_tb_integer(cmp);
+    return true;
+}
+
+Operator* lv_blt_resolve(Operator* func, bool* swapped) {
+
+    *swapped = false;
+    //wrappers may call other wrappers, but not too deeply
+    for(int depth = 0; depth < 4; depth++) {
+        if(func->type == FUN_BUILTIN)
+            return func;
+        if(func->type != FUN_FUNCTION
+            || func->arity == 0
+            || func->arity > 2
+            || func->captureCount != 0
+            || func->locals != 0
+            || func->varargs
+            || func->byName[0] != 0) {
+            return NULL;
+        }
+        //the body must be exactly the params, a call, and a return
+        LvInst* body = &TEXT_BUFFER[func->textOffset];
+        int ar = func->arity;
+        for(int i = 0; i < ar; i++) {
+            if(body[i].type != OPT_PARAM && body[i].type != OPT_MOVE_PARAM)
+                return NULL;
+        }
+        if(body[ar].type != OPT_FUNCTION
+            && body[ar].type != OPT_TAIL
+            && !(body[ar].type >= OPT_ADD && body[ar].type <= OPT_GE)) {
+            return NULL;
+        }
+        Operator* callee = body[ar].func;
+        if(body[ar + 1].type != OPT_RETURN
+            || callee->arity != ar
+            || callee->varargs) {
+            return NULL;
+        }
+        if(ar == 2 && body[0].param == 1 && body[1].param == 0) {
+            *swapped = !*swapped;
+        } else {
+            for(int i = 0; i < ar; i++) {
+                if(body[i].param != i)
+                    return NULL;
+            }
+        }
+        func = callee;
+    }
+    return NULL;
+}
+
+/**
+ * What is known about a value while resolving a global function
+ * for operands of given types.
+ */
+typedef struct AbstractValue {
+    enum {
+        AV_UNKNOWN,     //nothing is known
+        AV_OPERAND,     //one of the operands, whose type is known
+        AV_CONST,       //a literal value
+        AV_NATIVE,      //the result of calling the intrinsic on the operands
+    } kind;
+    int operand;            //the index of the operand
+    bool swapped;           //whether the intrinsic's args are swapped
+    TextBufferObj value;    //the literal value, not refCounted
+} AbstractValue;
+
+//how deeply functions called by a global function are followed
+#define MAX_RESOLVE_DEPTH 4
+
+static AbstractValue resolveBody(GlobalFunc* g, int* operandTypes,
+    Operator* func, AbstractValue* args, int depth);
+
+/** Returns what is known about the result of calling func with args. */
+static AbstractValue resolveApply(GlobalFunc* g, int* operandTypes,
+    Operator* func, AbstractValue* args, int depth) {
+
+    AbstractValue res = { AV_UNKNOWN };
+    if(func->varargs)
+        return res;
+    if(func->type == FUN_FUNCTION) {
+        if(depth < MAX_RESOLVE_DEPTH)
+            res = resolveBody(g, operandTypes, func, args, depth + 1);
+        return res;
+    }
+    if(func->type != FUN_BUILTIN)
+        return res;
+    int ar = func->arity;
+    if(func->builtin == g->intrinsic && ar == g->arity) {
+        //the intrinsic applied to the operands, in either order
+        bool inOrder = true;
+        bool reversed = ar == 2;
+        for(int i = 0; i < ar; i++) {
+            inOrder = inOrder && args[i].kind == AV_OPERAND && args[i].operand == i;
+            reversed = reversed && args[i].kind == AV_OPERAND && args[i].operand == ar - 1 - i;
+        }
+        if(inOrder || reversed) {
+            res.kind = AV_NATIVE;
+            res.swapped = !inOrder;
+            return res;
+        }
+    }
+    if(func->builtin == typeof_ && args[0].kind != AV_UNKNOWN && args[0].kind != AV_NATIVE) {
+        //the type names are not refCounted while resolving
+        res.kind = AV_CONST;
+        res.value = lv_tb_box(OPT_STRING, types[args[0].kind == AV_OPERAND
+            ? operandTypes[args[0].operand] : typeIndex(&args[0].value)]);
+        return res;
+    }
+    //pure intrinsics of literals, such as comparing type names
+    TextBufferObj values[ar];
+    for(int i = 0; i < ar; i++) {
+        if(args[i].kind != AV_CONST)
+            return res;
+        values[i] = args[i].value;
+    }
+    if(lv_blt_fold(func, values, &res.value)) {
+        if(LV_IS_DYNAMIC(&res.value))
+            lv_expr_cleanup(&res.value, 1);
+        else
+            res.kind = AV_CONST;
+    }
+    return res;
+}
+
+/**
+ * Follows the code of func called with args, taking the branches
+ * whose conditions are known from the operand types. Returns what
+ * is known about the returned value.
+ */
+static AbstractValue resolveBody(GlobalFunc* g, int* operandTypes,
+    Operator* func, AbstractValue* args, int depth) {
+
+    AbstractValue unknown = { AV_UNKNOWN };
+    if(func->locals != 0 || func->captureCount != 0)
+        return unknown;
+    for(int i = 0; i < func->arity; i++) {
+        if(func->byName[i])
+            return unknown;
+    }
+    AbstractValue stack[func->maxStack + 1];
+    int top = 0;
+    for(size_t pc = func->textOffset;; pc++) {
+        LvInst* inst = &TEXT_BUFFER[pc];
+        switch(inst->type) {
+            case OPT_PARAM:
+            case OPT_MOVE_PARAM:
+                stack[top++] = args[inst->param];
+                break;
+            case OPT_UNDEFINED:
+                stack[top].kind = AV_CONST;
+                stack[top++].value = LV_UNDEFINED;
+                break;
+            case OPT_CONSTANT:
+                stack[top].kind = AV_CONST;
+                stack[top++].value = TEXT_CONSTANTS[inst->constant];
+                break;
+            case OPT_SWITCH:
+                //the cases following the switch are tested in order
+                break;
+            case OPT_BEQZ: {
+                AbstractValue* cond = &stack[--top];
+                if(cond->kind != AV_CONST)
+                    return unknown;
+                if(!lv_blt_toBool(&cond->value))
+                    pc += inst->branchAddr - 1;
+                break;
+            }
+            case OPT_FUNCTION:
+            case OPT_TAIL:
+            case OPT_ADD:
+            case OPT_SUB:
+            case OPT_MUL:
+            case OPT_DIV:
+            case OPT_IDIV:
+            case OPT_REM:
+            case OPT_EQ:
+            case OPT_LT:
+            case OPT_GT:
+            case OPT_LE:
+            case OPT_GE: {
+                top -= inst->func->arity;
+                stack[top] = resolveApply(g, operandTypes, inst->func, &stack[top], depth);
+                top++;
+                break;
+            }
+            case OPT_RETURN:
+                return stack[top - 1];
+            default:
+                return unknown;
+        }
+    }
+}
+
+/**
+ * Resolves how the global function is called for operands of the
+ * given types, by following its conditional pieces. The intrinsic
+ * is called if the code taken for those types is a call to the
+ * intrinsic with the operands as its args.
+ */
+static GlobalCall resolveCall(GlobalFunc* g, int* operandTypes) {
+
+    AbstractValue operands[2];
+    for(int i = 0; i < g->arity; i++) {
+        operands[i].kind = AV_OPERAND;
+        operands[i].operand = i;
+    }
+    AbstractValue res = { AV_UNKNOWN };
+    if(g->func->arity == g->arity)
+        res = resolveApply(g, operandTypes, g->func, operands, 0);
+    if(res.kind != AV_NATIVE)
+        return CALL_GLOBAL;
+    return res.swapped ? CALL_SWAPPED : CALL_NATIVE;
+}
+
+OpType lv_blt_getQuickOp(Operator* func) {
+
+    bool swapped;
+    Operator* bfunc = lv_blt_resolve(func, &swapped);
+    if(!bfunc || bfunc->arity != 2)
+        return OPT_FUNCTION;
+    static const struct {
+        Builtin func;
+        OpType op;
+        OpType swapped;
+    } quickOps[] = {
+        { add, OPT_ADD, OPT_ADD },
+        { sub, OPT_SUB, OPT_FUNCTION },
+        { mul, OPT_MUL, OPT_MUL },
+        { div_, OPT_DIV, OPT_FUNCTION },
+        { idiv, OPT_IDIV, OPT_FUNCTION },
+        { rem, OPT_REM, OPT_FUNCTION },
+        { eq, OPT_EQ, OPT_EQ },
+        { lt, OPT_LT, OPT_GT },
+        { ge, OPT_GE, OPT_LE },
+    };
+    for(size_t i = 0; i < sizeof(quickOps) / sizeof(quickOps[0]); i++) {
+        if(quickOps[i].func == bfunc->builtin)
+            return swapped ? quickOps[i].swapped : quickOps[i].op;
+    }
+    return OPT_FUNCTION;
+}
+
+bool lv_blt_fold(Operator* func, TextBufferObj* args, TextBufferObj* res) {
+
+    bool swapped;
+    Operator* bfunc = lv_blt_resolve(func, &swapped);
+    if(!bfunc)
+        return false;
+    //intrinsics which do not depend on anything but their args
+    static const Builtin pureFuncs[] = {
+        add, sub, mul, div_, idiv, rem, pow_, pos, neg,
+        eq, lt, ge, concat, str, len,
+    };
+    bool pure = false;
+    for(size_t i = 0; i < sizeof(pureFuncs) / sizeof(pureFuncs[0]); i++) {
+        if(pureFuncs[i] == bfunc->builtin) {
+            pure = true;
+            break;
+        }
+    }
+    if(!pure)
+        return false;
+    TextBufferObj bargs[2];
+    assert(bfunc->arity <= 2);
+    memcpy(bargs, args, bfunc->arity * sizeof(TextBufferObj));
+    if(swapped) {
+        bargs[0] = args[1];
+        bargs[1] = args[0];
+    }
+    //leave integer division by zero to run time
+    if((bfunc->builtin == idiv || bfunc->builtin == rem)
+        && LV_TYPE(&bargs[1]) == OPT_INTEGER && LV_INTEGER(&bargs[1]) == 0) {
+        return false;
+    }
+    //the args array holds a reference to each arg, as the stack would
+    for(int i = 0; i < bfunc->arity; i++)
+        incRefCount(&bargs[i]);
+    TextBufferObj val = bfunc->builtin(bargs);
+    lv_expr_cleanup(bargs, bfunc->arity);
+    switch(LV_TYPE(&val)) {
+        case OPT_NUMBER:
+        case OPT_SHORT_STR:
+            break;
+        case OPT_INTEGER:
+        case OPT_STRING:
+            //the text buffer keeps a reference to heap values
+            if(LV_IS_DYNAMIC(&val))
+                ++*LV_REFCOUNT(&val);
+            break;
+        case OPT_ROPE: {
+            //the text buffer holds flat strings only
+            LvString* str = lv_tb_flatten(LV_ROPE(&val));
+            ++str->refCount;
+            ++LV_ROPE(&val)->refCount;
+            lv_expr_cleanup(&val, 1);
+            val = lv_tb_box(OPT_STRING, str);
+            break;
+        }
+        default:
+            if(LV_IS_DYNAMIC(&val)) {
+                ++*LV_REFCOUNT(&val);
+                lv_expr_cleanup(&val, 1);
+            }
+            return false;
+    }
+    *res = val;
+    return true;
+}
+
 static Hashtable intrinsics;
 
 Builtin lv_blt_getIntrinsic(char* name) {
@@ -1490,6 +2336,16 @@ Builtin lv_blt_getIntrinsic(char* name) {
     return lv_tbl_get(&intrinsics, name);
 }
 
+void lv_blt_printStats(void) {
+
+    lv_tbl_printStats(&intrinsics, "intrinsic");
+    GlobalFunc* globals[] = { &globalEquals, &globalHash, &globalLt };
+    for(size_t i = 0; i < sizeof(globals) / sizeof(globals[0]); i++) {
+        printf("%s: %lu native calls, %lu global calls\n", globals[i]->name,
+            (unsigned long) globals[i]->nativeCalls, (unsigned long) globals[i]->globalCalls);
+    }
+}
+
 void lv_blt_onStartup(void) {
 
     #define SYS "sys:"
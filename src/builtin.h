@@ -11,6 +11,45 @@ uint64_t lv_blt_hash(TextBufferObj* obj);
 bool lv_blt_toBool(TextBufferObj* obj);
 Builtin lv_blt_getIntrinsic(char* name);
 
+/**
+ * If the given function is a built in function, or a Lavender
+ * function that only passes its parameters on to another function
+ * that resolves to a built in function, returns that built in function.
+ * Otherwise returns NULL. The out param swapped is set if the
+ * wrappers pass the two parameters of a binary function in
+ * reverse order.
+ */
+Operator* lv_blt_resolve(Operator* func, bool* swapped);
+
+/**
+ * Returns the quickened opcode for calls to the given function, or
+ * OPT_FUNCTION if the function does not resolve to a built in
+ * arithmetic or comparison function.
+ */
+OpType lv_blt_getQuickOp(Operator* func);
+
+/**
+ * Evaluates the quickened opcode op on the two arguments and stores
+ * the result in res, if the arguments are numbers. Returns false if
+ * the function must be called normally instead.
+ */
+bool lv_blt_quickOp(OpType op, TextBufferObj* args, TextBufferObj* res);
+
+/**
+ * If the given function resolves to a pure built in function, such as
+ * arithmetic, comparison, or string concatenation, evaluates it on the
+ * given literal arguments. Returns true and stores the result in res
+ * if the result is a literal (string results have a refCount of 1).
+ * The arguments are not released.
+ */
+bool lv_blt_fold(Operator* func, TextBufferObj* args, TextBufferObj* res);
+
+/**
+ * Prints how the intrinsic names are spread
+ * over the buckets of their table.
+ */
+void lv_blt_printStats(void);
+
 void lv_blt_onStartup(void);
 void lv_blt_onShutdown(void);
 
@@ -10,11 +10,11 @@
 #define INIT_STACK_LEN 16
 typedef struct TextStack {
     size_t len;
-    TextBufferObj* top;
-    TextBufferObj* stack;
+    LvInst* top;
+    LvInst* stack;
 } TextStack;
 
-static void pushStack(TextStack* stack, TextBufferObj* obj);
+static void pushStack(TextStack* stack, LvInst* obj);
 
 // kept in sync with cxt.ops. It's hacky, but requires minimal
 // changes. This whole stack thing should be refactored anyway.
@@ -48,28 +48,26 @@ typedef struct ExprContext {
     IntStack maps;          //the map stack - which levels of nesting are maps
 } ExprContext;
 
-static int compare(TextBufferObj* a, TextBufferObj* b);
-static void parseLiteral(TextBufferObj* obj, ExprContext* cxt);
-static void parseIdent(TextBufferObj* obj, ExprContext* cxt);
-static void parseSymbol(TextBufferObj* obj, ExprContext* cxt);
-static void parseQualName(TextBufferObj* obj, ExprContext* cxt);
-static void parseNumber(TextBufferObj* obj, ExprContext* cxt);
-static void parseInteger(TextBufferObj* obj, ExprContext* cxt);
-static void parseString(TextBufferObj* obj, ExprContext* cxt);
-static void parseDotSymb(TextBufferObj* obj, ExprContext* cxt);
-static void parseFuncValue(TextBufferObj* obj, ExprContext* cxt);
-static void parseTextObj(TextBufferObj* obj, ExprContext* cxt); //calls above functions
+static int compare(LvInst* a, LvInst* b);
+static void parseLiteral(LvInst* obj, ExprContext* cxt);
+static void parseIdent(LvInst* obj, ExprContext* cxt);
+static void parseSymbol(LvInst* obj, ExprContext* cxt);
+static void parseQualName(LvInst* obj, ExprContext* cxt);
+static void parseNumber(LvInst* obj, ExprContext* cxt);
+static void parseInteger(LvInst* obj, ExprContext* cxt);
+static void parseString(LvInst* obj, ExprContext* cxt);
+static void parseDotSymb(LvInst* obj, ExprContext* cxt);
+static void parseFuncValue(LvInst* obj, ExprContext* cxt);
+static void parseTextObj(LvInst* obj, ExprContext* cxt); //calls above functions
 //runs one cycle of shunting yard
-static void shuntingYard(TextBufferObj* obj, ExprContext* cxt);
-static bool isLiteral(TextBufferObj* obj, char c);
+static void shuntingYard(LvInst* obj, ExprContext* cxt);
+static bool isLiteral(LvInst* obj, char c);
 static bool shuntOps(ExprContext* cxt);
-static TextBufferObj makeByName(TextBufferObj* expr, size_t len, ExprContext* cxt);
+static LvInst makeByName(LvInst* expr, size_t len, ExprContext* cxt);
 
 #define IF_ERROR_CLEANUP \
     if(LV_EXPR_ERROR) { \
-        lv_expr_cleanup(cxt.out.stack, cxt.out.top - cxt.out.stack + 1); \
-        lv_expr_cleanup(cxt.ops.stack, cxt.ops.top - cxt.ops.stack + 1); \
-        lv_free(cxt.out.stack); \
+        lv_expr_free(cxt.out.stack, cxt.out.top - cxt.out.stack + 1); \
         lv_free(cxt.ops.stack); \
         lv_free(cxt.tok.stack); \
         lv_free(cxt.params.stack); \
@@ -77,7 +75,7 @@ static TextBufferObj makeByName(TextBufferObj* expr, size_t len, ExprContext* cx
         return cxt.head; \
     } else (void)0
 
-Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_t* len) {
+Token* lv_expr_parseExpr(Token* head, Operator* decl, LvInst** res, size_t* len) {
 
     if(LV_EXPR_ERROR)
         return head;
@@ -92,11 +90,11 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
     cxt.nesting = 0;
     //initialize stacks. Set the zeroth element to a sentinel value.
     cxt.out.len = INIT_STACK_LEN;
-    cxt.out.stack = lv_alloc(INIT_STACK_LEN * sizeof(TextBufferObj));
+    cxt.out.stack = lv_alloc(INIT_STACK_LEN * sizeof(LvInst));
     cxt.out.top = cxt.out.stack;
     cxt.out.stack[0].type = OPT_UNDEFINED;
     cxt.ops.len = INIT_STACK_LEN;
-    cxt.ops.stack = lv_alloc(INIT_STACK_LEN * sizeof(TextBufferObj));
+    cxt.ops.stack = lv_alloc(INIT_STACK_LEN * sizeof(LvInst));
     cxt.ops.top = cxt.ops.stack;
     cxt.ops.stack[0].type = OPT_UNDEFINED;
     cxt.tok.len = INIT_STACK_LEN;
@@ -115,7 +113,7 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
     //(end-of-stream, closing grouper ')', or expression split ';')
     do {
         //is this a def?
-        TextBufferObj obj;
+        LvInst obj;
         if(lv_tkn_cmp(cxt.head, "def") == 0) {
             //must be expecting an operand
             if(!cxt.expectOperand) {
@@ -161,7 +159,7 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
                     case '[':
                     case '{': {
                         //explicit by-name expression
-                        TextBufferObj* byNameExprBody;
+                        LvInst* byNameExprBody;
                         size_t byNameExprLen;
                         cxt.head = lv_expr_parseExpr(cxt.head->next, decl, &byNameExprBody, &byNameExprLen);
                         IF_ERROR_CLEANUP;
@@ -203,10 +201,6 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
         LV_EXPR_ERROR = XPE_MISSING_BODY;
         IF_ERROR_CLEANUP;
     }
-    //check for tail call
-    if(cxt.out.top->type == OPT_FUNCTION && cxt.out.top->func == cxt.decl) {
-        cxt.out.top->type = OPT_TAIL;
-    }
     *res = cxt.out.stack;
     *len = cxt.out.top - cxt.out.stack + 1;
     //calling plain lv_free is ok because ops is empty
@@ -221,9 +215,9 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
 
 //static helpers for lv_expr_parseExpr
 
-static TextBufferObj makeByName(TextBufferObj* expr, size_t len, ExprContext* cxt) {
+static LvInst makeByName(LvInst* expr, size_t len, ExprContext* cxt) {
 
-    TextBufferObj res;
+    LvInst res;
     if(len == 1) {
         //trivial call-by-name expr, no need to wrap
         res = *expr;
@@ -245,7 +239,7 @@ static TextBufferObj makeByName(TextBufferObj* expr, size_t len, ExprContext* cx
         op->enclosing = cxt->decl;
         op->next = NULL;
         op->varargs = false;
-        op->textOffset = (int) lv_tb_addExpr(len, expr);
+        lv_tb_addExpr(op, len, expr);
         memset(op->byName, 0, sizeof(op->byName));
         lv_op_addOperator(op, FNS_PREFIX);
         //add capture to expr body
@@ -278,7 +272,7 @@ static int getLexicographicPrecedence(char c) {
     }
 }
 
-static int getFixingValue(TextBufferObj* obj) {
+static int getFixingValue(LvInst* obj) {
 
     if(obj->type == OPT_FUNC_CALL2) {
         return 1;
@@ -292,13 +286,13 @@ static int getFixingValue(TextBufferObj* obj) {
 }
 
 /** Whether this object represents the literal character c. */
-static bool isLiteral(TextBufferObj* obj, char c) {
+static bool isLiteral(LvInst* obj, char c) {
 
     return obj->type == OPT_LITERAL && obj->literal == c;
 }
 
 /** Compares a and b by precedence. */
-static int compare(TextBufferObj* a, TextBufferObj* b) {
+static int compare(LvInst* a, LvInst* b) {
 
     //values have highest precedence
     {
@@ -360,7 +354,7 @@ static char* concat(char* a, int alen, char* b, int blen) {
     return res;
 }
 
-static void parseLiteral(TextBufferObj* obj, ExprContext* cxt) {
+static void parseLiteral(LvInst* obj, ExprContext* cxt) {
 
     obj->type = OPT_LITERAL;
     obj->literal = cxt->head->start[0];
@@ -433,7 +427,7 @@ static void parseLiteral(TextBufferObj* obj, ExprContext* cxt) {
         cxt->expectOperand = true;
 }
 
-static void parseSymbolImpl(TextBufferObj* obj, FuncNamespace ns, char* _name, size_t nameLen, ExprContext* cxt) {
+static void parseSymbolImpl(LvInst* obj, FuncNamespace ns, char* _name, size_t nameLen, ExprContext* cxt) {
 
     //we find the function with the simple name
     //in the innermost scope possible by going
@@ -491,7 +485,7 @@ static void parseSymbolImpl(TextBufferObj* obj, FuncNamespace ns, char* _name, s
         ((!cxt->expectOperand && func->arity != 1) || func->arity == 0);
 }
 
-static void parseSymbolHelp(TextBufferObj* obj, char* name, size_t nameLen, ExprContext* cxt) {
+static void parseSymbolHelp(LvInst* obj, char* name, size_t nameLen, ExprContext* cxt) {
 
     FuncNamespace ns = cxt->expectOperand ? FNS_PREFIX : FNS_INFIX;
     parseSymbolImpl(obj, ns, name, nameLen, cxt);
@@ -507,12 +501,12 @@ static void parseSymbolHelp(TextBufferObj* obj, char* name, size_t nameLen, Expr
     }
 }
 
-static void parseSymbol(TextBufferObj* obj, ExprContext* cxt) {
+static void parseSymbol(LvInst* obj, ExprContext* cxt) {
 
     parseSymbolHelp(obj, cxt->head->start, cxt->head->len, cxt);
 }
 
-static void parseQualNameImpl(TextBufferObj* obj, FuncNamespace ns, char* _name, size_t nameLen, ExprContext* cxt) {
+static void parseQualNameImpl(LvInst* obj, FuncNamespace ns, char* _name, size_t nameLen, ExprContext* cxt) {
 
     //change ':' to '#' in names, but only after the namespace separator
     char name[nameLen + 1];
@@ -538,7 +532,7 @@ static void parseQualNameImpl(TextBufferObj* obj, FuncNamespace ns, char* _name,
         ((!cxt->expectOperand && func->arity != 1) || func->arity == 0);
 }
 
-static void parseQualNameHelp(TextBufferObj* obj, char* name, size_t nameLen, ExprContext* cxt) {
+static void parseQualNameHelp(LvInst* obj, char* name, size_t nameLen, ExprContext* cxt) {
 
     FuncNamespace ns = cxt->expectOperand ? FNS_PREFIX : FNS_INFIX;
     parseQualNameImpl(obj, ns, name, nameLen, cxt);
@@ -554,12 +548,12 @@ static void parseQualNameHelp(TextBufferObj* obj, char* name, size_t nameLen, Ex
     }
 }
 
-static void parseQualName(TextBufferObj* obj, ExprContext* cxt) {
+static void parseQualName(LvInst* obj, ExprContext* cxt) {
 
     parseQualNameHelp(obj, cxt->head->start, cxt->head->len, cxt);
 }
 
-static void parseFuncValue(TextBufferObj* obj, ExprContext* cxt) {
+static void parseFuncValue(LvInst* obj, ExprContext* cxt) {
 
     bool expectedOperand = cxt->expectOperand;
     size_t len = cxt->head->len;
@@ -596,7 +590,7 @@ static void parseFuncValue(TextBufferObj* obj, ExprContext* cxt) {
     cxt->expectOperand = false;
 }
 
-static void parseIdent(TextBufferObj* obj, ExprContext* cxt) {
+static void parseIdent(LvInst* obj, ExprContext* cxt) {
 
     //try parameter names first
     int numParams = cxt->decl->arity + cxt->decl->locals;
@@ -617,11 +611,11 @@ static void parseIdent(TextBufferObj* obj, ExprContext* cxt) {
     parseSymbol(obj, cxt);
 }
 
-static void parseNumber(TextBufferObj* obj, ExprContext* cxt) {
+static void parseNumber(LvInst* obj, ExprContext* cxt) {
 
     double num = strtod(cxt->head->start, NULL);
-    obj->type = OPT_NUMBER;
-    obj->number = num;
+    obj->type = OPT_CONSTANT;
+    obj->value = lv_tb_number(num);
     if(!cxt->expectOperand) {
         obj->fromType = obj->type;
         obj->type = OPT_FUNC_CALL2;
@@ -629,7 +623,7 @@ static void parseNumber(TextBufferObj* obj, ExprContext* cxt) {
     cxt->expectOperand = false;
 }
 
-static void parseInteger(TextBufferObj* obj, ExprContext* cxt) {
+static void parseInteger(LvInst* obj, ExprContext* cxt) {
 
     uint64_t num;
     if(cxt->head->start[0] == '0') {
@@ -653,8 +647,10 @@ static void parseInteger(TextBufferObj* obj, ExprContext* cxt) {
     } else {
         num = (uint64_t) strtoumax(cxt->head->start, NULL, 10);
     }
-    obj->type = OPT_INTEGER;
-    obj->integer = num;
+    obj->type = OPT_CONSTANT;
+    obj->value = lv_tb_integer(num);
+    if(LV_IS_DYNAMIC(&obj->value))
+        ++*LV_REFCOUNT(&obj->value); //it will be added to the text buffer
     if(!cxt->expectOperand) {
         obj->fromType = obj->type;
         obj->type = OPT_FUNC_CALL2;
@@ -691,17 +687,18 @@ static size_t getStringValue(char* c, char* str) {
     return len;
 }
 
-static void parseString(TextBufferObj* obj, ExprContext* cxt) {
+static void parseString(LvInst* obj, ExprContext* cxt) {
 
     char* c = cxt->head->start + 1; //skip open quote
     LvString* newStr = lv_alloc(sizeof(LvString) + cxt->head->len);
     newStr->refCount = 1; //it will be added to the text buffer
+    newStr->hash.source = LV_HASH_NONE;
     size_t len = getStringValue(c, newStr->value);
     newStr = lv_realloc(newStr, sizeof(LvString) + len + 1);
     newStr->value[len] = '\0';
     newStr->len = len;
-    obj->type = OPT_STRING;
-    obj->str = newStr;
+    obj->type = OPT_CONSTANT;
+    obj->value = lv_tb_box(OPT_STRING, newStr);
     if(!cxt->expectOperand) {
         obj->fromType = obj->type;
         obj->type = OPT_FUNC_CALL2;
@@ -709,7 +706,7 @@ static void parseString(TextBufferObj* obj, ExprContext* cxt) {
     cxt->expectOperand = false;
 }
 
-static void parseDotSymb(TextBufferObj* obj, ExprContext* cxt) {
+static void parseDotSymb(LvInst* obj, ExprContext* cxt) {
 
     char name[cxt->head->len];
     if(cxt->head->start[1] == '"') {
@@ -720,7 +717,8 @@ static void parseDotSymb(TextBufferObj* obj, ExprContext* cxt) {
         memcpy(name, cxt->head->start + 1, cxt->head->len - 1);
         name[cxt->head->len - 1] = '\0';
     }
-    *obj = lv_tb_getSymb(name);
+    obj->type = OPT_CONSTANT;
+    obj->value = lv_tb_getSymb(name);
     if(!cxt->expectOperand) {
         obj->fromType = obj->type;
         obj->type = OPT_FUNC_CALL2;
@@ -728,7 +726,7 @@ static void parseDotSymb(TextBufferObj* obj, ExprContext* cxt) {
     cxt->expectOperand = false;
 }
 
-static void parseTextObj(TextBufferObj* obj, ExprContext* cxt) {
+static void parseTextObj(LvInst* obj, ExprContext* cxt) {
 
     switch(cxt->head->type) {
         case TTY_LITERAL:
@@ -767,7 +765,7 @@ static void parseTextObj(TextBufferObj* obj, ExprContext* cxt) {
     }
 }
 
-static void pushStack(TextStack* stack, TextBufferObj* obj) {
+static void pushStack(TextStack* stack, LvInst* obj) {
     //overwrite empty args because it's just a signal.
     //an abuse of the stack, but oh well
     //note that empty args will NEVER appear in the final text.
@@ -780,7 +778,7 @@ static void pushStack(TextStack* stack, TextBufferObj* obj) {
         stack->len *= 2;
         size_t sz = stack->top - stack->stack;
         stack->stack = lv_realloc(stack->stack,
-            stack->len * sizeof(TextBufferObj));
+            stack->len * sizeof(LvInst));
         stack->top = stack->stack + sz;
     }
     *++stack->top = *obj;
@@ -804,7 +802,7 @@ static void pushParam(IntStack* stack, int num) {
         stack->len *= 2;
         size_t sz = stack->top - stack->stack;
         stack->stack = lv_realloc(stack->stack,
-            stack->len * sizeof(TextBufferObj));
+            stack->len * sizeof(LvInst));
         stack->top = stack->stack + sz;
     }
     *++stack->top = num;
@@ -854,17 +852,14 @@ static int arityFor(Operator* func, Operator* scope) {
 /**
  * Given the last operation of an expression, returns a pointer to the beginning.
  */
-static TextBufferObj* getExprBounds(TextBufferObj* end) {
+static LvInst* getExprBounds(LvInst* end) {
 
-    TextBufferObj* bgn = end;
+    LvInst* bgn = end;
     switch(end->type) {
         case OPT_UNDEFINED:
-        case OPT_NUMBER:
-        case OPT_INTEGER:
+        case OPT_CONSTANT:
         case OPT_PARAM:
         case OPT_FUNCTION_VAL:
-        case OPT_STRING:
-        case OPT_SYMB:
             break;
         case OPT_FUNCTION:
             // get the beginning of the argument list
@@ -875,7 +870,7 @@ static TextBufferObj* getExprBounds(TextBufferObj* end) {
         case OPT_FUNC_CAP: {
             // get the beginning of the capture list
             // capture list is (1 + captureCount)
-            TextBufferObj* func = end - 1;
+            LvInst* func = end - 1;
             assert(func->type == OPT_FUNCTION_VAL);
             for(int i = 0; i <= func->func->captureCount; i++) {
                 bgn = getExprBounds(bgn - 1);
@@ -902,7 +897,7 @@ static TextBufferObj* getExprBounds(TextBufferObj* end) {
     return bgn;
 }
 
-static void collectByNameArgs(TextBufferObj* func, int ar, ExprContext* cxt) {
+static void collectByNameArgs(LvInst* func, int ar, ExprContext* cxt) {
 
     //stack to hold by-name expressions for the current function
     //the stack holds the by-name expressions in reverse operation order
@@ -913,23 +908,23 @@ static void collectByNameArgs(TextBufferObj* func, int ar, ExprContext* cxt) {
     }
     TextStack tmpByNames;
     tmpByNames.len = INIT_STACK_LEN;
-    tmpByNames.stack = lv_alloc(INIT_STACK_LEN * sizeof(TextBufferObj));
+    tmpByNames.stack = lv_alloc(INIT_STACK_LEN * sizeof(LvInst));
     tmpByNames.top = tmpByNames.stack;
     tmpByNames.stack[0].type = OPT_UNDEFINED;
     int lastParam = func->func->arity - func->func->captureCount - 1;
     assert(lastParam >= 0);
     for(int i = ar - 1; i >= 0; i--) {
         int p = i > lastParam ? lastParam : i;
-        TextBufferObj* bgn = getExprBounds(cxt->out.top);
+        LvInst* bgn = getExprBounds(cxt->out.top);
         if(LV_GET_BYNAME(func->func, p)) {
             //wrap in a by-name expression
             size_t len = cxt->out.top + 1 - bgn;
-            TextBufferObj val = makeByName(bgn, len, cxt);
+            LvInst val = makeByName(bgn, len, cxt);
             if(val.type == OPT_FUNCTION_VAL
                 && val.func->arity > 0
                 && val.func->arity == val.func->captureCount) {
                 //must capture
-                TextBufferObj tmp = { .type = OPT_FUNC_CAP };
+                LvInst tmp = { .type = OPT_FUNC_CAP };
                 pushStack(&tmpByNames, &tmp);
                 pushStack(&tmpByNames, &val);
                 tmp.type = OPT_PARAM;
@@ -961,7 +956,7 @@ static void collectByNameArgs(TextBufferObj* func, int ar, ExprContext* cxt) {
 //Returns whether an error occurred.
 static bool shuntOps(ExprContext* cxt) {
 
-    TextBufferObj* tmp = cxt->ops.top;
+    LvInst* tmp = cxt->ops.top;
     //if we need to push capture params onto the out stack,
     //we do so now, because we don't know the enclosing
     //function's arity at runtime.
@@ -973,7 +968,7 @@ static bool shuntOps(ExprContext* cxt) {
         if(tmp->func->varargs) {
             //make last arg + extra args on the end into a vector
             //zero vector args is allowed
-            TextBufferObj obj;
+            LvInst obj;
             int lastParam = tmp->func->arity - tmp->func->captureCount - 1;
             assert(lastParam >= 0);
             obj.type = OPT_MAKE_VECT;
@@ -990,7 +985,7 @@ static bool shuntOps(ExprContext* cxt) {
         //push any extra implicit capture args
         int end = arityFor(tmp->func, cxt->decl);
         for(int i = tmp->func->captureCount; i > 0; i--) {
-            TextBufferObj obj;
+            LvInst obj;
             obj.type = OPT_PARAM;
             obj.param = end - i;
             assert(obj.param >= 0);
@@ -1031,7 +1026,7 @@ static bool shuntOps(ExprContext* cxt) {
  *  2. Validation that the number of parameters passed
  *      to functions match arity.
  */
-static void shuntingYard(TextBufferObj* obj, ExprContext* cxt) {
+static void shuntingYard(LvInst* obj, ExprContext* cxt) {
 
     if(obj->type == OPT_EMPTY_ARGS) {
         //set source args explicitly to 0 (or 1 for infix)
@@ -1075,7 +1070,7 @@ static void shuntingYard(TextBufferObj* obj, ExprContext* cxt) {
                 int arity = *cxt->params.top--;
                 if(arity < 0) //{} construct
                     arity = 0;
-                TextBufferObj vect = { .callArity = arity };
+                LvInst vect = { .callArity = arity };
                 if(-*cxt->maps.top - 1 == cxt->nesting) {
                     vect.type = OPT_MAKE_MAP;
                     cxt->maps.top--;
@@ -1149,14 +1144,14 @@ static void shuntingYard(TextBufferObj* obj, ExprContext* cxt) {
 
         int ar = arityFor(obj->func, cxt->decl);
         for(int i = obj->func->captureCount; i > 0; i--) {
-            TextBufferObj tbo;
+            LvInst tbo;
             tbo.type = OPT_PARAM;
             tbo.param = ar - i;
             assert(tbo.param >= 0);
             pushStack(&cxt->out, &tbo);
         }
         pushStack(&cxt->out, obj);
-        TextBufferObj cap;
+        LvInst cap;
         cap.type = OPT_FUNC_CAP;
         fixArityFirstArg(cxt);
         pushStack(&cxt->out, &cap);
@@ -1175,7 +1170,7 @@ static void shuntingYard(TextBufferObj* obj, ExprContext* cxt) {
             pushToken(&cxt->tok, cxt->head);
             //func call 2 is an 'infix' operator
             pushParam(&cxt->params, -2);
-            TextBufferObj obj2 = *obj;
+            LvInst obj2 = *obj;
             obj2.type = obj->fromType;
             shuntingYard(&obj2, cxt);
         } else {
@@ -2,8 +2,13 @@
 #include "textbuffer.h"
 #include "operator.h"
 #include "lavender.h"
+#include "dynbuffer.h"
+#include "vector.h"
+#include "map.h"
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdio.h>
 
 bool lv_expr_isReserved(char* id, size_t len) {
     switch(len) {
@@ -52,48 +57,152 @@ char* lv_expr_getError(ExprError error) {
     #undef LEN
 }
 
+size_t lv_expr_releaseLimit = 0;
+
+//Values whose refCount has reached zero are not released recursively,
+//since a value may be nested arbitrarily deep (as in a list built from
+//captures). Instead, they are pushed to the pending list, which is
+//drained by the outermost call to lv_expr_cleanup, or a few values at
+//a time by lv_expr_releasePending if lv_expr_releaseLimit is set.
+static DynBuffer pending;   //of TextBufferObj
+static bool releasing;      //whether the pending list is being drained
+static size_t pendingPeak;  //the greatest length of the pending list
+
+static void addPending(TextBufferObj* obj) {
+
+    if(!pending.data)
+        lv_buf_init(&pending, sizeof(TextBufferObj));
+    lv_buf_push(&pending, obj);
+    if(pending.len > pendingPeak)
+        pendingPeak = pending.len;
+}
+
+/**
+ * Frees a value whose refCount has reached zero. The values it
+ * references are released through lv_expr_cleanup, which adds
+ * them to the pending list instead of freeing them here.
+ */
+static void releaseValue(TextBufferObj* obj) {
+
+    switch(LV_TYPE(obj)) {
+        case OPT_ROPE: {
+            LvRope* rope = LV_ROPE(obj);
+            if(rope->flat && --rope->flat->refCount == 0)
+                lv_free(rope->flat);
+            lv_expr_cleanup(&rope->left, 1);
+            lv_expr_cleanup(&rope->right, 1);
+            lv_free(rope);
+            break;
+        }
+        case OPT_CAPTURE: {
+            CaptureObj* capture = LV_CAPTURE(obj);
+            lv_expr_cleanup(capture->value, LV_CAPTURE_LEN(capture->func));
+            lv_free(capture);
+            break;
+        }
+        case OPT_VECT:
+            lv_expr_cleanup(LV_VECT(obj)->data, LV_VECT(obj)->len);
+            lv_free(LV_VECT(obj));
+            break;
+        case OPT_VECT_TREE:
+            lv_vec_free(LV_TREE(obj));
+            break;
+        case OPT_VECT_VIEW: {
+            TextBufferObj parent = lv_tb_box(OPT_VECT, LV_VVIEW(obj)->parent);
+            lv_expr_cleanup(&parent, 1);
+            lv_free(LV_VVIEW(obj));
+            break;
+        }
+        case OPT_MAP: {
+            LvMap* map = LV_MAP(obj);
+            for(size_t j = 0; j < map->len; j++) {
+                lv_expr_cleanup(&map->data[j].key, 1);
+                lv_expr_cleanup(&map->data[j].value, 1);
+            }
+            lv_free(map->index);
+            lv_free(map);
+            break;
+        }
+        case OPT_MAP_TRIE:
+            lv_map_free(LV_TRIE(obj));
+            break;
+        default:
+            assert(false);
+    }
+}
+
+void lv_expr_releasePending(size_t max) {
+
+    bool wasReleasing = releasing;
+    releasing = true;
+    for(size_t i = 0; i < max && pending.len; i++) {
+        TextBufferObj obj;
+        lv_buf_pop(&pending, &obj);
+        releaseValue(&obj);
+    }
+    releasing = wasReleasing;
+}
+
+size_t lv_expr_pendingCount(void) {
+
+    return pending.len;
+}
+
+void lv_expr_printStats(void) {
+
+    printf("Release backlog: %lu pending, %lu peak\n",
+        (unsigned long) pending.len, (unsigned long) pendingPeak);
+}
+
+void lv_expr_onShutdown(void) {
+
+    lv_expr_releasePending(SIZE_MAX);
+    lv_free(pending.data);
+    memset(&pending, 0, sizeof(pending));
+}
+
 void lv_expr_cleanup(TextBufferObj* obj, size_t len) {
 
+    bool added = false;
     for(size_t i = 0; i < len; i++) {
-        switch(obj[i].type) {
+        if(!LV_IS_DYNAMIC(&obj[i]))
+            continue;
+        switch(LV_TAG(&obj[i])) {
             case OPT_STRING:
-                assert(obj[i].str->refCount);
-                if(--obj[i].str->refCount == 0)
-                    lv_free(obj[i].str);
-                break;
-            case OPT_CAPTURE:
-                assert(obj[i].capture->refCount);
-                if(--obj[i].capture->refCount == 0) {
-                    lv_expr_cleanup(obj[i].capture->value, obj[i].capfunc->captureCount);
-                    lv_free(obj[i].capture);
-                }
+            case LV_TAG_BIG_INT:
+                assert(*LV_REFCOUNT(&obj[i]));
+                if(--*LV_REFCOUNT(&obj[i]) == 0)
+                    lv_free(LV_PTR(&obj[i]));
                 break;
-            case OPT_VECT:
-                assert(obj[i].vect->refCount);
-                if(--obj[i].vect->refCount == 0) {
-                    lv_expr_cleanup(obj[i].vect->data, obj[i].vect->len);
-                    lv_free(obj[i].vect);
+            case OPT_STR_VIEW: {
+                LvStrView* view = LV_SVIEW(&obj[i]);
+                assert(view->refCount);
+                if(--view->refCount == 0) {
+                    if(--view->parent->refCount == 0)
+                        lv_free(view->parent);
+                    lv_free(view->flat);
+                    lv_free(view);
                 }
                 break;
-            case OPT_MAP:
-                assert(obj[i].map->refCount);
-                if(--obj[i].map->refCount == 0) {
-                    size_t s = obj[i].map->len;
-                    for(size_t j = 0; j < s; j++) {
-                        lv_expr_cleanup(&obj[i].map->data[j].key, 1);
-                        lv_expr_cleanup(&obj[i].map->data[j].value, 1);
-                    }
-                    lv_free(obj[i].map);
+            }
+            default:
+                assert(*LV_REFCOUNT(&obj[i]));
+                if(--*LV_REFCOUNT(&obj[i]) == 0) {
+                    addPending(&obj[i]);
+                    added = true;
                 }
                 break;
-            default:
-                ;
         }
     }
+    if(added && !releasing && !lv_expr_releaseLimit)
+        lv_expr_releasePending(SIZE_MAX);
 }
 
-void lv_expr_free(TextBufferObj* obj, size_t len) {
+void lv_expr_free(LvInst* code, size_t len) {
 
-    lv_expr_cleanup(obj, len);
-    lv_free(obj);
+    for(size_t i = 0; i < len; i++) {
+        if(code[i].type == OPT_CONSTANT)
+            lv_expr_cleanup(&code[i].value, 1);
+    }
+    lv_free(code);
 }
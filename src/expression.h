@@ -54,16 +54,38 @@ Operator* lv_expr_declareFunction(Token* tokens, Operator* nspace, Token** bodyT
  * If an error occurs, sets LV_EXPR_ERROR and returns the token
  * that caused the error.
  */
-Token* lv_expr_parseExpr(Token* tokens, Operator* decl, TextBufferObj** res, size_t* len);
+Token* lv_expr_parseExpr(Token* tokens, Operator* decl, LvInst** res, size_t* len);
 
 /**
- * Calls lv_expr_cleanup and additionally frees obj.
+ * Releases the values of the constants in the given parsed code,
+ * which has not been added to the text buffer, and frees the code.
  */
-void lv_expr_free(TextBufferObj* obj, size_t len);
+void lv_expr_free(LvInst* code, size_t len);
 
 /**
- * Frees data associated with the objects given.
+ * Frees data associated with the objects given. Values whose
+ * refCount reaches zero are added to the pending list, which
+ * is drained before returning unless lv_expr_releaseLimit is set.
  */
 void lv_expr_cleanup(TextBufferObj* obj, size_t len);
 
+/**
+ * The maximum number of pending values to free per function call,
+ * or zero to free values as soon as they become unreferenced.
+ */
+size_t lv_expr_releaseLimit;
+
+/**
+ * Frees at most max values from the pending list.
+ */
+void lv_expr_releasePending(size_t max);
+
+/**
+ * Returns the number of values waiting to be freed.
+ */
+size_t lv_expr_pendingCount(void);
+
+void lv_expr_printStats(void);
+void lv_expr_onShutdown(void);
+
 #endif
@@ -0,0 +1,99 @@
+#include "hash.h"
+#include <string.h>
+
+//the constants of wyhash (public domain, by Wang Yi)
+static const uint64_t secret[] = {
+    0xa0761d6478bd642full,
+    0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull
+};
+
+static uint64_t read8(const unsigned char* p) {
+
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read4(const unsigned char* p) {
+
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/** Replaces a and b with the low and high halves of their product. */
+static void multiply(uint64_t* a, uint64_t* b) {
+
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, la = (uint32_t)*a;
+    uint64_t hb = *b >> 32, lb = (uint32_t)*b;
+    uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+    uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+    *a = (mid << 32) | (uint32_t)ll;
+    *b = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+uint64_t lv_hash_bytes(const void* data, size_t len) {
+
+    const unsigned char* p = data;
+    uint64_t seed = mix(secret[0], secret[1]);
+    uint64_t a, b;
+    if(len <= 16) {
+        if(len >= 4) {
+            //two overlapping reads from each end
+            size_t off = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + off);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - off);
+        } else if(len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if(i > 48) {
+            //three independent lanes
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+                seed1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ seed1);
+                seed2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while(i > 16) {
+            seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        //the last 16 bytes, which may overlap those already read
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    multiply(&a, &b);
+    return mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+uint64_t lv_hash_str(const char* str) {
+
+    return lv_hash_bytes(str, strlen(str));
+}
@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+//The hash function for strings, used both for string values (and so
+//for map keys) and for the operator and intrinsic tables. It is a
+//variant of wyhash: it reads eight bytes at a time, and every bit of
+//the input affects every bit of the result, so the low bits may be
+//used directly as a table index.
+
+/**
+ * Returns the hash of the given bytes.
+ */
+uint64_t lv_hash_bytes(const void* data, size_t len);
+
+/**
+ * Returns the hash of the given terminated string.
+ * Equal to lv_hash_bytes over its characters.
+ */
+uint64_t lv_hash_str(const char* str);
+
+#endif
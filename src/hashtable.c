@@ -1,6 +1,8 @@
 #include "hashtable.h"
 #include "lavender.h"
+#include "hash.h"
 #include <string.h>
+#include <stdio.h>
 
 #define INIT_TABLE_LEN 64 //must be power of two
 #define TABLE_LOAD_FACT 0.75
@@ -14,12 +16,8 @@ struct HashNode {
 static void resize(Hashtable* table);
 
 static size_t hash(char* str) {
-    //djb2 hash
-    size_t res = 5381;
-    int c;
-    while((c = *str++))
-        res = ((res << 5) + res) + c;
-    return res;
+
+    return lv_hash_str(str);
 }
 
 void lv_tbl_init(Hashtable* table) {
@@ -101,6 +99,31 @@ void lv_tbl_clear(Hashtable* table, void (*cb)(char*, void*)) {
     table->len = 0;
 }
 
+size_t lv_tbl_memSize(Hashtable* table) {
+
+    return table->cap * sizeof(HashNode*) + table->len * sizeof(HashNode);
+}
+
+void lv_tbl_printStats(Hashtable* table, char* name) {
+
+    size_t used = 0;
+    size_t longest = 0;
+    for(size_t i = 0; i < table->cap; i++) {
+        size_t chain = 0;
+        for(HashNode* node = table->table[i]; node; node = node->next)
+            chain++;
+        used += chain != 0;
+        if(chain > longest)
+            longest = chain;
+    }
+    printf("Table %s: %lu keys, %lu of %lu buckets used, longest chain %lu\n",
+        name,
+        (unsigned long) table->len,
+        (unsigned long) used,
+        (unsigned long) table->cap,
+        (unsigned long) longest);
+}
+
 static void resize(Hashtable* table) {
 
     HashNode** oldTable = table->table;
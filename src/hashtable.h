@@ -44,5 +44,17 @@ void* lv_tbl_del(Hashtable* table, char* key, char** oldKey);
  */
 void lv_tbl_clear(Hashtable* table, void (*cb)(char*, void*));
 
+/**
+ * Returns the number of bytes used by the table itself,
+ * not counting the keys and values.
+ */
+size_t lv_tbl_memSize(Hashtable* table);
+
+/**
+ * Prints the number of keys in the table, the number of buckets
+ * used, and the length of the longest chain of colliding keys.
+ */
+void lv_tbl_printStats(Hashtable* table, char* name);
+
 
 #endif
@@ -4,6 +4,7 @@
 #include "builtin.h"
 #include "command.h"
 #include "dynbuffer.h"
+#include "memory.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,50 +17,106 @@ size_t lv_maxStackSize = 512 * 1024 / sizeof(TextBufferObj); //512KiB
 struct LvMainArgs lv_mainArgs = { NULL, 0 };
 
 static void readInput(FILE* in, bool repl);
-static size_t jumpAndLink(Operator* func);
-static void runCycle(void);
+static void jumpAndLink(Operator* func);
+static void execute(size_t exitDepth);
 
-static DynBuffer stack; //of TextBufferObj
+/**
+ * The operand stack. Pushes are not bounds checked; instead, space
+ * is reserved once per call frame using the maximum stack depth
+ * computed for the function when its body is defined.
+ */
+typedef struct VmStack {
+    TextBufferObj* base;    //bottom of the stack
+    TextBufferObj* top;     //one past the top value
+    TextBufferObj* limit;   //one past the end of the allocation
+} VmStack;
+
+/**
+ * A Lavender function call frame. Frames are kept apart from
+ * the operand stack so the call chain may be walked directly.
+ */
+typedef struct Frame {
+    size_t pc;      //return address
+    size_t fp;      //frame pointer of the caller
+    Operator* func; //the called function
+} Frame;
+
+#define INIT_STACK_LEN 1024
+#define INIT_FRAMES_LEN 256
+static VmStack stack;
+static Frame* frames;   //call frame stack
+static size_t framesLen;    //allocated length of frames
 static size_t pc;   //program counter
 static size_t fp;   //frame pointer: index of the first argument
+static size_t callDepth;    //number of active Lavender function frames
 static Operator atFunc; //built in sys:__at__
 static Builtin sysLt; //built in sys:__lt__
 static Operator scope = { .type = FUN_FWD_DECL };
+static size_t callCacheHits;    //value calls set up from the inline cache
+static size_t callCacheMisses;  //value calls set up by setUpFuncCall
+
+static size_t stackLen(void) {
 
-static void push(TextBufferObj* obj) {
+    return stack.top - stack.base;
+}
 
-    if(obj->type & LV_DYNAMIC)
-        ++*obj->refCount;
-    if(lv_maxStackSize
-        && (stack.len + 1) == stack.cap
-        && stack.len >= lv_maxStackSize) {
+/**
+ * Grows the stack so that at least the given number of values
+ * may be pushed. If the stack would exceed the maximum stack size,
+ * the runtime exits.
+ */
+static void growStack(size_t numToReserve) {
+
+    size_t len = stackLen();
+    size_t needed = len + numToReserve;
+    if(lv_maxStackSize && needed > lv_maxStackSize) {
         //we've exceeded the maximum stack size
-        LvString* inst = lv_tb_getString(&TEXT_BUFFER[pc]);
-        LvString* arg = lv_tb_getString(obj);
-        printf("Stack overflow: pc=%lu, inst=%s, toPush=%s\n",
-            pc, inst->value, arg->value);
-        if(inst->refCount == 0)
-            lv_free(inst);
-        if(arg->refCount == 0)
-            lv_free(arg);
+        LvString* inst = lv_tb_getInstString(&TEXT_BUFFER[pc]);
+        printf("Stack overflow: pc=%lu, inst=%s, size=%lu, depth=%lu, in=%s\n",
+            pc, inst->value, needed, callDepth,
+            callDepth > 0 ? frames[callDepth - 1].func->name : "<none>");
+        lv_free(inst);
         lv_shutdown();
     }
-    lv_buf_push(&stack, obj);
+    size_t cap = (stack.limit - stack.base) * 2;
+    if(cap < needed)
+        cap = needed;
+    if(lv_maxStackSize && cap > lv_maxStackSize)
+        cap = lv_maxStackSize;
+    stack.base = lv_realloc(stack.base, cap * sizeof(TextBufferObj));
+    stack.top = stack.base + len;
+    stack.limit = stack.base + cap;
+}
+
+/**
+ * Ensures the given number of values may be pushed
+ * onto the stack. This may move the stack.
+ */
+static inline void reserve(size_t numToReserve) {
+
+    if((size_t)(stack.limit - stack.top) < numToReserve)
+        growStack(numToReserve);
 }
 
-static void popAll(size_t numToPop) {
+static inline void push(TextBufferObj* obj) {
 
-    TextBufferObj* start = lv_buf_get(&stack, stack.len - numToPop);
-    lv_expr_cleanup(start, numToPop);
-    stack.len -= numToPop;
+    assert(stack.top < stack.limit);
+    if(LV_IS_DYNAMIC(obj))
+        ++*LV_REFCOUNT(obj);
+    *stack.top++ = *obj;
 }
 
-static TextBufferObj removeTop(void) {
+static inline void popAll(size_t numToPop) {
 
-    TextBufferObj res;
-    lv_buf_pop(&stack, &res);
-    if(res.type & LV_DYNAMIC)
-        --*res.refCount;
+    stack.top -= numToPop;
+    lv_expr_cleanup(stack.top, numToPop);
+}
+
+static inline TextBufferObj removeTop(void) {
+
+    TextBufferObj res = *--stack.top;
+    if(LV_IS_DYNAMIC(&res))
+        --*LV_REFCOUNT(&res);
     return res;
 }
 
@@ -81,17 +138,24 @@ static bool addFile(char* file) {
     return true;
 }
 
+/**
+ * Stores the given global function in res. If the stdlib does not
+ * define it, res is undefined and the intrinsic is used instead.
+ */
+static void getGlobal(TextBufferObj* res, char* name, FuncNamespace ns) {
+
+    Operator* func = lv_op_getOperator(name, ns);
+    *res = func ? lv_tb_box(OPT_FUNCTION_VAL, func) : LV_UNDEFINED;
+}
+
 void lv_run(void) {
 
     lv_startup();
     bool load = lv_readFile("sys") && lv_readFile("global");
     if(load) {
-        lv_globalEquals.type = OPT_FUNCTION;
-        lv_globalEquals.func = lv_op_getOperator("global:=", FNS_INFIX);
-        lv_globalHash.type = OPT_FUNCTION;
-        lv_globalHash.func = lv_op_getOperator("global:hash", FNS_PREFIX);
-        lv_globalLt.type = OPT_FUNCTION;
-        lv_globalLt.func = lv_op_getOperator("global:<", FNS_INFIX);
+        getGlobal(&lv_globalEquals, "global:=", FNS_INFIX);
+        getGlobal(&lv_globalHash, "global:hash", FNS_PREFIX);
+        getGlobal(&lv_globalLt, "global:<", FNS_INFIX);
     }
     if(!load) {
         puts("Fatal: stdlib does not exist");
@@ -108,33 +172,29 @@ void lv_run(void) {
             Operator* entryPoint = lv_op_getOperator(entryPointName, FNS_PREFIX);
             if(entryPoint && entryPoint->arity == 1) {
                 //box params
-                TextBufferObj args;
-                args.type = OPT_VECT;
-                args.vect = lv_alloc(sizeof(LvVect) + lv_mainArgs.count * sizeof(TextBufferObj));
-                args.vect->refCount = 0;
-                args.vect->len = lv_mainArgs.count;
-                for(size_t i = 0; i < args.vect->len; i++) {
+                LvVect* vect = lv_alloc(sizeof(LvVect) + lv_mainArgs.count * sizeof(TextBufferObj));
+                vect->refCount = 0;
+                vect->len = lv_mainArgs.count;
+                vect->hash.source = LV_HASH_NONE;
+                for(size_t i = 0; i < vect->len; i++) {
                     size_t argLen = strlen(lv_mainArgs.args[i]);
                     LvString* str =
                         lv_alloc(sizeof(LvString) + argLen + 1);
                     str->refCount = 1;
                     str->len = argLen;
+                    str->hash.source = LV_HASH_NONE;
                     strcpy(str->value, lv_mainArgs.args[i]);
-                    args.vect->data[i].type = OPT_STRING;
-                    args.vect->data[i].str = str;
+                    vect->data[i] = lv_tb_box(OPT_STRING, str);
                 }
+                TextBufferObj args = lv_tb_box(OPT_VECT, vect);
                 //call main function
+                reserve(1);
                 push(&args);
-                //there's no stack frame to keep track of
-                //and there's no expression in the text buffer
-                //so we have to go by stack size.
+                size_t depth = callDepth;
                 jumpAndLink(entryPoint);
-                do {
-                    runCycle();
-                } while(stack.len != 1);
+                execute(depth);
                 //print result
-                TextBufferObj obj;
-                lv_buf_pop(&stack, &obj);
+                TextBufferObj obj = *--stack.top;
                 LvString* str = lv_tb_getString(&obj);
                 puts(str->value);
                 if(str->refCount == 0) {
@@ -159,36 +219,15 @@ void lv_run(void) {
     lv_shutdown();
 }
 
-void* lv_alloc(size_t size) {
-
-    void* value = malloc(size);
-    if(!value) {
-        printf("Allocation failed: %lu bytes\n", size);
-        lv_shutdown();
-    }
-    return value;
-}
-
-void* lv_realloc(void* ptr, size_t size) {
-
-    void* tmp = realloc(ptr, size);
-    if(!tmp) {
-        free(ptr);
-        printf("Allocation failed: %lu bytes\n", size);
-        lv_shutdown();
-    }
-    return tmp;
-}
-
-void lv_free(void* ptr) {
-
-    free(ptr);
-}
-
 void lv_startup(void) {
 
     pc = fp = 0;
-    lv_buf_init(&stack, sizeof(TextBufferObj));
+    callDepth = 0;
+    stack.base = lv_alloc(INIT_STACK_LEN * sizeof(TextBufferObj));
+    stack.top = stack.base;
+    stack.limit = stack.base + INIT_STACK_LEN;
+    frames = lv_alloc(INIT_FRAMES_LEN * sizeof(Frame));
+    framesLen = INIT_FRAMES_LEN;
     lv_buf_init(&importedFiles, sizeof(char*));
     lv_tkn_onStartup();
     lv_op_onStartup();
@@ -207,17 +246,30 @@ void lv_startup(void) {
 
 void lv_shutdown(void) {
 
+    if(lv_debug) {
+        printf("Call cache: %lu hits, %lu misses\n",
+            (unsigned long) callCacheHits, (unsigned long) callCacheMisses);
+        lv_op_printStats();
+        lv_blt_printStats();
+        lv_tb_printStats();
+        lv_expr_printStats();
+        lv_mem_printStats();
+    }
+    //release values first, captures still refer to their operators
+    lv_expr_cleanup(stack.base, stackLen());
+    lv_expr_onShutdown();
     lv_cmd_onShutdown();
     lv_blt_onShutdown();
     lv_tb_onShutdown();
     lv_op_onShutdown();
     lv_tkn_onShutdown();
-    lv_expr_cleanup(stack.data, stack.len);
     for(size_t i = 0; i < importedFiles.len; i++) {
         lv_free(*(char**)lv_buf_get(&importedFiles, i));
     }
     lv_free(importedFiles.data);
-    lv_free(stack.data);
+    lv_free(stack.base);
+    lv_free(frames);
+    lv_mem_onShutdown();
     exit(0);
 }
 
@@ -444,19 +496,18 @@ static void readInput(FILE* in, bool repl) {
         } else {
             //parse expression
             scope.name = "repl:";      //expr requires an enclosing function
-            size_t startIdx, endIdx;
-            Token* end = lv_tb_parseExpr(toks, &scope, &startIdx, &endIdx);
+            Operator expr;
+            Token* end = lv_tb_parseExpr(toks, &scope, &expr);
             if(LV_EXPR_ERROR) {
                 printError(end, "Error parsing expression");
                 LV_EXPR_ERROR = 0;
             } else {
-                pc = startIdx;
-                while(pc != endIdx) {
-                    runCycle();
-                }
-                assert(stack.len == 1);
-                TextBufferObj obj;
-                lv_buf_pop(&stack, &obj);
+                //run the expression as a zero arity function
+                size_t depth = callDepth;
+                jumpAndLink(&expr);
+                execute(depth);
+                assert(stackLen() == 1);
+                TextBufferObj obj = *--stack.top;
                 LvString* str = lv_tb_getString(&obj);
                 puts(str->value);
                 if(str->refCount == 0) {
@@ -473,42 +524,44 @@ static void readInput(FILE* in, bool repl) {
 
 static void makeVect(int length) {
 
-    TextBufferObj vect;
-    vect.type = OPT_VECT;
-    vect.vect = lv_alloc(sizeof(LvVect) + length * sizeof(TextBufferObj));
-    vect.vect->refCount = 0;
-    vect.vect->len = length;
-    for(size_t i = vect.vect->len; i > 0; i--) {
-        //preserve refCounts because we are transferring to vect
-        lv_buf_pop(&stack, &vect.vect->data[i - 1]);
-    }
-    push(&vect);
+    LvVect* vect = lv_alloc(sizeof(LvVect) + length * sizeof(TextBufferObj));
+    vect->refCount = 0;
+    vect->len = length;
+    vect->hash.source = LV_HASH_NONE;
+    //preserve refCounts because we are transferring to vect
+    stack.top -= length;
+    memcpy(vect->data, stack.top, length * sizeof(TextBufferObj));
+    TextBufferObj obj = lv_tb_box(OPT_VECT, vect);
+    reserve(1);
+    push(&obj);
 }
 
 static void makeMap(int size) {
 
-    TextBufferObj map;
-    map.type = OPT_MAP;
-    map.map = lv_alloc(sizeof(LvMap) + size * sizeof(LvMapNode));
-    map.map->refCount = 0;
-    map.map->len = size;
+    LvMap* map = lv_alloc(sizeof(LvMap) + size * sizeof(LvMapNode));
+    map->refCount = 0;
+    map->len = size;
+    map->index = NULL;
+    map->hash.source = LV_HASH_NONE;
     for(int i = size; i > 0; i--) {
-        LvMapNode* n = &map.map->data[i - 1];
+        LvMapNode* n = &map->data[i - 1];
         TextBufferObj key;
-        lv_buf_pop(&stack, &n->value);
-        lv_buf_pop(&stack, &n->key);
+        n->value = *--stack.top;
+        n->key = *--stack.top;
         //keys must be eagerly evaluated, unfortunately
         if(lv_evalByName(&n->key, &key)) {
             lv_expr_cleanup(&n->key, 1);
-            if(key.type & LV_DYNAMIC) {
-                ++*key.refCount;
+            if(LV_IS_DYNAMIC(&key)) {
+                ++*LV_REFCOUNT(&key);
             }
             n->key = key;
         }
         n->hash = lv_blt_hash(&n->key);
     }
-    lv_tb_initMap(&map.map);
-    push(&map);
+    lv_tb_initMap(&map);
+    TextBufferObj obj = lv_tb_box(OPT_MAP, map);
+    reserve(1);
+    push(&obj);
 }
 
 /**
@@ -524,17 +577,17 @@ static bool setUpFuncCall(TextBufferObj* _func, size_t numArgs, Operator** under
     assert(underlying);
     bool success = false;
     Operator* op = NULL;
-    TextBufferObj realFunc = { .type = OPT_UNDEFINED };
+    TextBufferObj realFunc = LV_UNDEFINED;
     TextBufferObj* func = _func;
     if(numArgs != 0 && lv_evalByName(_func, &realFunc)) {
-        if(realFunc.type & LV_DYNAMIC) {
-            ++*realFunc.refCount;
+        if(LV_IS_DYNAMIC(&realFunc)) {
+            ++*LV_REFCOUNT(&realFunc);
         }
         func = &realFunc;
     }
-    switch(func->type) {
+    switch(LV_TYPE(func)) {
         case OPT_FUNCTION_VAL: {
-            op = func->func;
+            op = LV_FUNC(func);
             //collect varargs into vect
             if(op->varargs) {
                 int vectLen = numArgs - (op->arity - 1);
@@ -548,7 +601,7 @@ static bool setUpFuncCall(TextBufferObj* _func, size_t numArgs, Operator** under
             break;
         }
         case OPT_CAPTURE: {
-            op = func->capfunc;
+            op = LV_CAPTURE(func)->func;
             int nonCapArity = op->arity - op->captureCount;
             //collect varargs into vect
             if(op->varargs) {
@@ -560,18 +613,26 @@ static bool setUpFuncCall(TextBufferObj* _func, size_t numArgs, Operator** under
             }
             if(numArgs == nonCapArity) {
                 //push captured params onto stack
+                reserve(op->captureCount);
                 for(int i = 0; i < op->captureCount; i++) {
-                    push(&func->capture->value[i]);
+                    push(&LV_CAPTURE(func)->value[i]);
                 }
                 success = true;
             }
             break;
         }
         case OPT_STRING:
+        case OPT_SHORT_STR:
+        case OPT_ROPE:
+        case OPT_STR_VIEW:
         case OPT_VECT:
+        case OPT_VECT_TREE:
+        case OPT_VECT_VIEW:
         case OPT_MAP:
+        case OPT_MAP_TRIE:
             if(numArgs == 1) {
                 op = &atFunc;
+                reserve(1);
                 push(func);
                 success = true;
             }
@@ -583,22 +644,87 @@ static bool setUpFuncCall(TextBufferObj* _func, size_t numArgs, Operator** under
     if(!success)
         popAll(numArgs);
     *underlying = op;
-    if(realFunc.type != OPT_UNDEFINED) {
+    if(LV_TYPE(&realFunc) != OPT_UNDEFINED) {
         //cleanup by-name expression result
         lv_expr_cleanup(&realFunc, 1);
     }
     return success;
 }
 
+/**
+ * Returns the function underlying the given function value or
+ * capture, or NULL if the value is not a function.
+ */
+static inline Operator* getCalledFunc(TextBufferObj* func) {
+
+    switch(LV_TYPE(func)) {
+        case OPT_FUNCTION_VAL:
+            return LV_FUNC(func);
+        case OPT_CAPTURE:
+            return LV_CAPTURE(func)->func;
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Prepares the stack for calling the given function from a call site
+ * with the given inline cache. If the function was set up from the
+ * site before, the checks in setUpFuncCall are skipped.
+ */
+static bool setUpCachedCall(CallCache* cache, TextBufferObj* func,
+    size_t numArgs, Operator** underlying) {
+
+    Operator* op = getCalledFunc(func);
+    for(int i = 0; i < LV_CALL_CACHE_WAYS; i++) {
+        if(op && cache->ways[i].func == op && cache->ways[i].type == LV_TYPE(func)) {
+            callCacheHits++;
+            if(LV_TYPE(func) == OPT_CAPTURE) {
+                reserve(op->captureCount);
+                for(int j = 0; j < op->captureCount; j++) {
+                    push(&LV_CAPTURE(func)->value[j]);
+                }
+            }
+            *underlying = op;
+            return true;
+        }
+    }
+    callCacheMisses++;
+    if(!setUpFuncCall(func, numArgs, underlying))
+        return false;
+    //by-name values and varargs calls are not cached
+    if(*underlying == op && !op->varargs) {
+        memmove(&cache->ways[1], &cache->ways[0],
+            (LV_CALL_CACHE_WAYS - 1) * sizeof(cache->ways[0]));
+        cache->ways[0].type = LV_TYPE(func);
+        cache->ways[0].func = op;
+    }
+    return true;
+}
+
 /**
  * Evaluates the given object iff it is a zero-arity function and
  * returns the result through ret. Returns true if obj was a zero
- * arity function and false if it was not.
+ * arity function and false if it was not. Captures (such as by-name
+ * args) are evaluated once, and the result is kept in the capture.
  */
 bool lv_evalByName(TextBufferObj* obj, TextBufferObj* ret) {
 
-    if((obj->type == OPT_CAPTURE && obj->capfunc->arity == obj->capfunc->captureCount)
-    || (obj->type == OPT_FUNCTION_VAL && obj->func->arity == 0)) {
+    CaptureObj* capture = LV_TYPE(obj) == OPT_CAPTURE ? LV_CAPTURE(obj) : NULL;
+    if(capture && capture->func->arity == capture->func->captureCount) {
+        TextBufferObj* memo = &capture->value[capture->func->captureCount];
+        if(LV_TYPE(memo) == OPT_UNEVALUATED) {
+            TextBufferObj res;
+            lv_callFunction(obj, 0, NULL, &res);
+            //the capture keeps a reference to the result
+            if(LV_IS_DYNAMIC(&res))
+                ++*LV_REFCOUNT(&res);
+            *memo = res;
+        }
+        *ret = *memo;
+        return true;
+    }
+    if(LV_TYPE(obj) == OPT_FUNCTION_VAL && LV_FUNC(obj)->arity == 0) {
         lv_callFunction(obj, 0, NULL, ret);
         return true;
     }
@@ -608,12 +734,14 @@ bool lv_evalByName(TextBufferObj* obj, TextBufferObj* ret) {
 /**
  * Calls the given function by saving the current stack frame
  * and jumping to the first instruction of the given function.
- * Returns the value of the current (old) frame.
+ * Built in functions are run to completion immediately.
  */
-static size_t jumpAndLink(Operator* func) {
+static void jumpAndLink(Operator* func) {
 
     assert(func);
-    size_t frame = fp;
+    //in incremental mode, each call frees some of the pending values
+    if(lv_expr_releaseLimit)
+        lv_expr_releasePending(lv_expr_releaseLimit);
     switch(func->type) {
         case FUN_FWD_DECL: {
             //this should never happen
@@ -621,197 +749,377 @@ static size_t jumpAndLink(Operator* func) {
             break;
         }
         case FUN_BUILTIN: {
-            //call built in function, then pop args and push result
-            //we never actually pushed a new frame, so return the old
-            //(current) value.
-            size_t tmpFp = stack.len - func->arity;
-            TextBufferObj res = func->builtin(lv_buf_get(&stack, tmpFp));
-            //keep a reference to res while we pop
-            if(res.type & LV_DYNAMIC)
-                ++*res.refCount;
-            popAll(func->arity);
+            //call built in function, then release args and push result
+            //the args are moved off the stack because calling back into
+            //Lavender (e.g. to evaluate by-name args) may move the stack
+            //the built in function may take the args' references
+            TextBufferObj args[func->arity + 1];
+            stack.top -= func->arity;
+            memcpy(args, stack.top, func->arity * sizeof(TextBufferObj));
+            TextBufferObj res = func->builtin(args);
+            //keep a reference to res while we release the args
+            if(LV_IS_DYNAMIC(&res))
+                ++*LV_REFCOUNT(&res);
+            lv_expr_cleanup(args, func->arity);
             TextBufferObj tmp;
             if(lv_evalByName(&res, &tmp)) {
                 lv_expr_cleanup(&res, 1);
                 res = tmp;
-                if(res.type & LV_DYNAMIC)
-                    ++*res.refCount;
+                if(LV_IS_DYNAMIC(&res))
+                    ++*LV_REFCOUNT(&res);
             }
-            if(stack.len > 0) {
-                TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
-                if(top->type == OPT_FUNC_CALL2) {
-                    *top = res;
-                    break;
-                }
-            } //else
-            if(res.type & LV_DYNAMIC)
-                --*res.refCount;
-            push(&res);
+            //res already holds a reference
+            reserve(1);
+            *stack.top++ = res;
             break;
         }
         case FUN_FUNCTION: {
             //calling convention
             //  0. push <undefined> into local slots
-            //  1. push fp
-            //  2. set fp = stack.len - func.arity - func.locals - 1 (first argument)
-            //  3. push pc (return value)
-            //  4. set pc = first inst of function
+            //  1. push a frame holding pc, fp, and func
+            //  2. set fp = stack length - func.arity - func.locals (first argument)
+            //  3. set pc = first inst of function
             //The stack looks like this:
-            //  ... arg0 arg1 .. argN-1 fp pc ...
+            //  ... arg0 arg1 .. argN-1 local0 .. localM-1 ...
             //       ^^
             //       fp
-            TextBufferObj obj;
-            obj.type = OPT_UNDEFINED;
+            //Space for the locals and the values pushed
+            //by the function body is reserved up front.
+            reserve(func->locals + func->maxStack);
+            TextBufferObj obj = LV_UNDEFINED;
             for(int i = 0; i < func->locals; i++) {
                 push(&obj);
             }
-            obj.type = OPT_ADDR;
-            obj.addr = fp;
-            push(&obj);
-            fp = stack.len - func->arity - func->locals - 1;
-            obj.addr = pc;
-            push(&obj);
+            if(callDepth == framesLen) {
+                framesLen *= 2;
+                frames = lv_realloc(frames, framesLen * sizeof(Frame));
+            }
+            Frame* frame = &frames[callDepth++];
+            frame->pc = pc;
+            frame->fp = fp;
+            frame->func = func;
+            fp = stackLen() - func->arity - func->locals;
             pc = func->textOffset;
             break;
         }
     }
-    return frame;
 }
 
-static void runCycle(void) {
+/**
+ * Whether the value is equal to the given number, integer,
+ * or string literal, as by the built in equality function.
+ */
+static bool equalsLiteral(TextBufferObj* val, TextBufferObj* lit) {
 
-    TextBufferObj* value = &TEXT_BUFFER[pc++];
+    if(LV_IS_STRING(lit)) {
+        return LV_IS_STRING(val)
+            && LV_STR_LEN(val) == LV_STR_LEN(lit)
+            && memcmp(LV_STR_CHARS(val), LV_STR_CHARS(lit), LV_STR_LEN(lit)) == 0;
+    }
+    if(LV_TYPE(val) != LV_TYPE(lit))
+        return false;
+    switch(LV_TYPE(lit)) {
+        case OPT_NUMBER:
+            return val->number == lit->number;
+        case OPT_INTEGER:
+            return LV_INTEGER(val) == LV_INTEGER(lit);
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+/**
+ * Calls the given function in place of the current function.
+ * The current frame's args and locals are replaced with the args
+ * on top of the stack, then the function is called as if from the
+ * current function's caller. If the function is built in, the
+ * result is left on the caller's stack.
+ */
+static void tailCall(Operator* func) {
+
+    TextBufferObj* base = stack.base + fp;
+    TextBufferObj* args = stack.top - func->arity;
+    lv_expr_cleanup(base, args - base);
+    memmove(base, args, func->arity * sizeof(TextBufferObj));
+    stack.top = base + func->arity;
+    Frame* frame = &frames[--callDepth];
+    pc = frame->pc;
+    fp = frame->fp;
+    jumpAndLink(func);
+}
+
+//Instruction dispatch. With threaded code, each routine jumps
+//directly to the routine of the next instruction through
+//TEXT_THREAD instead of returning to the switch. The switch is
+//still used to enter the first instruction.
+#ifdef LV_THREADED_CODE
+#define TARGET(op) case op: TARGET_##op
+#define DISPATCH() \
+    do { inst = &TEXT_BUFFER[pc]; goto *TEXT_THREAD[pc++]; } while(0)
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+#endif
+
+/**
+ * Runs instructions starting at pc until the function frame
+ * at exitDepth is returned to. Does nothing if no frame was
+ * pushed (for example, if a built in function was called).
+ */
+static void execute(size_t exitDepth) {
+
+#ifdef LV_THREADED_CODE
+    //routine addresses indexed by OpType
+    static void* const routines[OPT_EMPTY_ARGS + 1] = {
+        [OPT_UNDEFINED] = &&TARGET_OPT_UNDEFINED,
+        [OPT_INTEGER] = &&TARGET_OPT_INTEGER,
+        [OPT_SYMB] = &&TARGET_OPT_SYMB,
+        [OPT_SHORT_STR] = &&TARGET_OPT_SHORT_STR,
+        [OPT_FUNCTION_VAL] = &&TARGET_OPT_FUNCTION_VAL,
+        [OPT_UNEVALUATED] = &&TARGET_OPT_UNEVALUATED,
+        [OPT_STRING] = &&TARGET_OPT_STRING,
+        [OPT_VECT] = &&TARGET_OPT_VECT,
+        [OPT_MAP] = &&TARGET_OPT_MAP,
+        [OPT_CAPTURE] = &&TARGET_OPT_CAPTURE,
+        [OPT_ROPE] = &&TARGET_OPT_ROPE,
+        [OPT_VECT_TREE] = &&TARGET_OPT_VECT_TREE,
+        [OPT_STR_VIEW] = &&TARGET_OPT_STR_VIEW,
+        [OPT_VECT_VIEW] = &&TARGET_OPT_VECT_VIEW,
+        [OPT_MAP_TRIE] = &&TARGET_OPT_MAP_TRIE,
+        [OPT_NUMBER] = &&TARGET_OPT_NUMBER,
+        [OPT_CONSTANT] = &&TARGET_OPT_CONSTANT,
+        [OPT_PARAM] = &&TARGET_OPT_PARAM,
+        [OPT_PUT_PARAM] = &&TARGET_OPT_PUT_PARAM,
+        [OPT_MOVE_PARAM] = &&TARGET_OPT_MOVE_PARAM,
+        [OPT_FUNCTION] = &&TARGET_OPT_FUNCTION,
+        [OPT_FUNC_CAP] = &&TARGET_OPT_FUNC_CAP,
+        [OPT_FUNC_CALL2] = &&TARGET_OPT_FUNC_CALL2,
+        [OPT_MAKE_VECT] = &&TARGET_OPT_MAKE_VECT,
+        [OPT_MAKE_MAP] = &&TARGET_OPT_MAKE_MAP,
+        [OPT_RETURN] = &&TARGET_OPT_RETURN,
+        [OPT_BEQZ] = &&TARGET_OPT_BEQZ,
+        [OPT_TAIL] = &&TARGET_OPT_TAIL,
+        [OPT_TAIL_CALL2] = &&TARGET_OPT_TAIL_CALL2,
+        [OPT_SWITCH] = &&TARGET_OPT_SWITCH,
+        [OPT_ADD] = &&TARGET_OPT_ADD,
+        [OPT_SUB] = &&TARGET_OPT_SUB,
+        [OPT_MUL] = &&TARGET_OPT_MUL,
+        [OPT_DIV] = &&TARGET_OPT_DIV,
+        [OPT_IDIV] = &&TARGET_OPT_IDIV,
+        [OPT_REM] = &&TARGET_OPT_REM,
+        [OPT_EQ] = &&TARGET_OPT_EQ,
+        [OPT_LT] = &&TARGET_OPT_LT,
+        [OPT_GT] = &&TARGET_OPT_GT,
+        [OPT_LE] = &&TARGET_OPT_LE,
+        [OPT_GE] = &&TARGET_OPT_GE,
+        [OPT_LITERAL] = &&TARGET_OPT_LITERAL,
+        [OPT_EMPTY_ARGS] = &&TARGET_OPT_EMPTY_ARGS,
+    };
+    lv_tb_decode(routines);
+#endif
+    if(callDepth == exitDepth)
+        return;
+    LvInst* inst;
     TextBufferObj func; //used in some operations
-    switch(value->type) {
-        case OPT_FUNC_CAP: {
-            //capture outer arguments into function object
-            //see expression.c:shuntingYard for capture stack layout
-            func = removeTop();
-            assert(func.func->type == FUN_FUNCTION); //only Lv functions can capture
-            TextBufferObj obj;
-            obj.type = OPT_CAPTURE;
-            obj.capfunc = func.func;
-            obj.capture = lv_alloc(sizeof(CaptureObj)
-                + func.func->captureCount * sizeof(TextBufferObj));
-            obj.capture->refCount = 0;
-            for(int i = func.func->captureCount - 1; i >= 0; i--) {
+    for(;;) {
+        inst = &TEXT_BUFFER[pc++];
+        switch(inst->type) {
+            TARGET(OPT_FUNC_CAP): {
+                //capture outer arguments into function object
+                //see expression.c:shuntingYard for capture stack layout
+                func = removeTop();
+                Operator* op = LV_FUNC(&func);
+                assert(op->type == FUN_FUNCTION); //only Lv functions can capture
+                CaptureObj* capture = lv_alloc(sizeof(CaptureObj)
+                    + LV_CAPTURE_LEN(op) * sizeof(TextBufferObj));
+                capture->refCount = 0;
+                capture->func = op;
                 //preserve refCounts because we are transferring to capture
-                lv_buf_pop(&stack, &obj.capture->value[i]);
+                int count = op->captureCount;
+                stack.top -= count;
+                memcpy(capture->value, stack.top, count * sizeof(TextBufferObj));
+                if(op->arity == count)
+                    capture->value[count] = LV_UNEVALUATED;
+                TextBufferObj obj = lv_tb_box(OPT_CAPTURE, capture);
+                push(&obj);
+                DISPATCH();
             }
-            push(&obj);
-            break;
-        }
-        case OPT_MAKE_VECT: {
-            makeVect(value->callArity);
-            break;
-        }
-        case OPT_MAKE_MAP:
-            makeMap(value->callArity);
-            break;
-        case OPT_FUNCTION_VAL:
-        case OPT_UNDEFINED:
-        case OPT_NUMBER:
-        case OPT_INTEGER:
-        case OPT_STRING:
-        case OPT_CAPTURE:
-        case OPT_VECT:
-        case OPT_MAP:
-        case OPT_SYMB:
-            //push it on the stack
-            push(value);
-            break;
-        case OPT_PARAM:
-            //does not evaluate zero-arity functions
-            push(lv_buf_get(&stack, fp + value->param));
-            break;
-        case OPT_PUT_PARAM: {
-            //pop top and place in i'th param
-            TextBufferObj* param = lv_buf_get(&stack, fp + value->param);
-            lv_buf_pop(&stack, &func);
-            *param = func;
-            break;
-        }
-        case OPT_BEQZ: {
-            TextBufferObj obj = removeTop();
-            if(!lv_blt_toBool(&obj))
-                pc += value->branchAddr - 1;
-            break;
-        }
-        case OPT_FUNC_CALL2: {
-            int arity = value->callArity;
-            //in contrast to func call 1, the function is at the bottom
-            {
-                //remove the function logically from the stack
-                TextBufferObj* pos = lv_buf_get(&stack, stack.len - arity);
+            TARGET(OPT_MAKE_VECT):
+                makeVect(inst->callArity);
+                DISPATCH();
+            TARGET(OPT_MAKE_MAP):
+                makeMap(inst->callArity);
+                DISPATCH();
+            TARGET(OPT_CONSTANT):
+                push(&TEXT_CONSTANTS[inst->constant]);
+                DISPATCH();
+            TARGET(OPT_UNDEFINED):
+                func = LV_UNDEFINED;
+                push(&func);
+                DISPATCH();
+            TARGET(OPT_FUNCTION_VAL):
+                func = lv_tb_box(OPT_FUNCTION_VAL, inst->func);
+                push(&func);
+                DISPATCH();
+            TARGET(OPT_PARAM):
+                //does not evaluate zero-arity functions
+                push(&stack.base[fp + inst->param]);
+                DISPATCH();
+            TARGET(OPT_MOVE_PARAM): {
+                //the param is not used again, so take its
+                //reference instead of copying it
+                TextBufferObj* param = &stack.base[fp + inst->param];
+                *stack.top++ = *param;
+                *param = LV_UNDEFINED;
+                DISPATCH();
+            }
+            TARGET(OPT_PUT_PARAM): {
+                //pop top and place in i'th param
+                stack.base[fp + inst->param] = *--stack.top;
+                DISPATCH();
+            }
+            TARGET(OPT_BEQZ): {
+                //the condition may be a heap integer
+                TextBufferObj* obj = --stack.top;
+                bool cond = lv_blt_toBool(obj);
+                if(LV_IS_DYNAMIC(obj))
+                    lv_expr_cleanup(obj, 1);
+                if(!cond)
+                    pc += inst->branchAddr - 1;
+                DISPATCH();
+            }
+            TARGET(OPT_FUNC_CALL2):
+            TARGET(OPT_TAIL_CALL2): {
+                int arity = inst->callArity;
+                //in contrast to func call 1, the function is at the bottom
+                //remove it and move the args down so the result
+                //takes the place of the function
+                TextBufferObj* pos = stack.top - arity;
                 func = *pos;
-                //signal for return instruction to remove bottom func
-                pos->type = OPT_FUNC_CALL2;
+                memmove(pos, pos + 1, (arity - 1) * sizeof(TextBufferObj));
+                stack.top--;
+                Operator* op;
+                bool setup = setUpCachedCall(&CALL_CACHE[inst->callSite],
+                    &func, arity - 1, &op);
+                lv_expr_cleanup(&func, 1);
+                if(!setup) {
+                    //the function's slot is free
+                    *stack.top++ = LV_UNDEFINED;
+                } else if(inst->type == OPT_TAIL_CALL2) {
+                    tailCall(op);
+                    if(callDepth == exitDepth)
+                        return;
+                } else {
+                    jumpAndLink(op);
+                }
+                DISPATCH();
             }
-            Operator* op;
-            bool setup = setUpFuncCall(&func, arity - 1, &op);
-            lv_expr_cleanup(&func, 1);
-            if(!setup) {
-                assert(stack.len > 0);
-                TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
-                top->type = OPT_UNDEFINED;
-            } else {
-                jumpAndLink(op);
+            TARGET(OPT_TAIL):
+                tailCall(inst->func);
+                if(callDepth == exitDepth)
+                    return;
+                DISPATCH();
+            TARGET(OPT_SWITCH): {
+                //the cases follow in sequence, each has the form
+                //  param literal = beqz(next case) body return
+                //jump to the body of the first case that matches,
+                //or past the cases if none match
+                TextBufferObj* arg = &stack.base[fp + inst->switchParam];
+                if(LV_TYPE(arg) == OPT_FUNCTION_VAL || LV_TYPE(arg) == OPT_CAPTURE) {
+                    //may be by-name, let the conditions evaluate it
+                    DISPATCH();
+                }
+                size_t addr = pc;
+                for(int i = 0; i < inst->caseCount; i++) {
+                    LvInst* cond = &TEXT_BUFFER[addr];
+                    LvInst* lit = cond[0].type == OPT_PARAM ? &cond[1] : &cond[0];
+                    if(equalsLiteral(arg, &TEXT_CONSTANTS[lit->constant])) {
+                        addr += 4;
+                        break;
+                    }
+                    addr += 3 + cond[3].branchAddr;
+                }
+                pc = addr;
+                DISPATCH();
             }
-            break;
-        }
-        case OPT_TAIL: {
-            //replace fp parameters with the recently pushed parameters
-            assert(value->func->type == FUN_FUNCTION);
-            int ar = value->func->arity;
-            lv_expr_cleanup(lv_buf_get(&stack, fp), ar + value->func->locals);
-            memcpy(lv_buf_get(&stack, fp), lv_buf_get(&stack, stack.len - ar), ar * sizeof(TextBufferObj));
-            stack.len -= ar;
-            pc = value->func->textOffset;
-            break;
-        }
-        case OPT_FUNCTION: {
-            jumpAndLink(value->func);
-            break;
-        }
-        case OPT_RETURN: {
-            //bypass removeTop for the return value
-            //so we keep its string refCount intact
-            //this keeps popAll from freeing the return value
-            TextBufferObj retVal;
-            lv_buf_pop(&stack, &retVal);
-            //reset pc and fp
-            pc = removeTop().addr;
-            size_t tmpFp = removeTop().addr;
-            //pop args
-            popAll(stack.len - fp);
-            fp = tmpFp;
-            TextBufferObj tmp;
-            if(lv_evalByName(&retVal, &tmp)) {
-                lv_expr_cleanup(&retVal, 1);
-                //evalByName does not refCount the return value
-                if(tmp.type & LV_DYNAMIC) {
-                    ++*tmp.refCount;
+            TARGET(OPT_FUNCTION):
+                jumpAndLink(inst->func);
+                DISPATCH();
+            TARGET(OPT_ADD):
+            TARGET(OPT_SUB):
+            TARGET(OPT_MUL):
+            TARGET(OPT_DIV):
+            TARGET(OPT_IDIV):
+            TARGET(OPT_REM):
+            TARGET(OPT_EQ):
+            TARGET(OPT_LT):
+            TARGET(OPT_GT):
+            TARGET(OPT_LE):
+            TARGET(OPT_GE): {
+                //operate directly on the top two values if they are
+                //numbers, otherwise call the function as usual
+                TextBufferObj* args = stack.top - 2;
+                if(lv_blt_quickOp(inst->type, args, &func)) {
+                    args[0] = func;
+                    stack.top--;
+                } else {
+                    jumpAndLink(inst->func);
                 }
-                retVal = tmp;
+                DISPATCH();
             }
-            if(stack.len > 0) {
-                TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
-                if(top->type == OPT_FUNC_CALL2) {
-                    *top = retVal;
-                    break;
+            TARGET(OPT_RETURN): {
+                //bypass removeTop for the return value
+                //so we keep its string refCount intact
+                //this keeps popAll from freeing the return value
+                TextBufferObj retVal = *--stack.top;
+                //pop args
+                popAll(stackLen() - fp);
+                //reset pc and fp
+                Frame* frame = &frames[--callDepth];
+                pc = frame->pc;
+                fp = frame->fp;
+                TextBufferObj tmp;
+                if(lv_evalByName(&retVal, &tmp)) {
+                    lv_expr_cleanup(&retVal, 1);
+                    //evalByName does not refCount the return value
+                    if(LV_IS_DYNAMIC(&tmp)) {
+                        ++*LV_REFCOUNT(&tmp);
+                    }
+                    retVal = tmp;
                 }
-            } //else
-            lv_buf_push(&stack, &retVal);
-            break;
+                //the slots of the popped frame are still reserved
+                *stack.top++ = retVal;
+                if(callDepth == exitDepth)
+                    return;
+                DISPATCH();
+            }
+            TARGET(OPT_INTEGER):
+            TARGET(OPT_SYMB):
+            TARGET(OPT_SHORT_STR):
+            TARGET(OPT_UNEVALUATED):
+            TARGET(OPT_STRING):
+            TARGET(OPT_VECT):
+            TARGET(OPT_MAP):
+            TARGET(OPT_CAPTURE):
+            TARGET(OPT_ROPE):
+            TARGET(OPT_VECT_TREE):
+            TARGET(OPT_STR_VIEW):
+            TARGET(OPT_VECT_VIEW):
+            TARGET(OPT_MAP_TRIE):
+            TARGET(OPT_NUMBER):
+            TARGET(OPT_LITERAL):
+            TARGET(OPT_EMPTY_ARGS):
+                //values are pushed by constant instructions
+                assert(false);
+                return;
         }
-        case OPT_LITERAL:
-        case OPT_ADDR:
-        case OPT_EMPTY_ARGS:
-            assert(false);
-            return;
     }
 }
 
+#undef TARGET
+#undef DISPATCH
+
 /**
  * Calls the function given with the parameters given and returns
  * the result. This function handles captures, vects, strings, and functions.
@@ -820,18 +1128,18 @@ void lv_callFunction(TextBufferObj* func, size_t numArgs, TextBufferObj* args, T
 
     //push args onto stack
     Operator* op;
+    reserve(numArgs);
     for(size_t i = 0; i < numArgs; i++) {
         push(&args[i]);
     }
     if(!setUpFuncCall(func, numArgs, &op)) {
-        ret->type = OPT_UNDEFINED;
+        *ret = LV_UNDEFINED;
     } else {
-        size_t frame = jumpAndLink(op);
+        size_t depth = callDepth;
+        jumpAndLink(op);
         //we stop executing when the frame pushed by
         //jumpAndLink is popped.
-        while(fp != frame) {
-            runCycle();
-        }
+        execute(depth);
         *ret = removeTop();
     }
 }
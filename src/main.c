@@ -1,4 +1,5 @@
 #include "lavender.h"
+#include "expression.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -59,6 +60,19 @@ int main(int argc, char* argv[]) {
             }
             //in number of TextBufferObj
             lv_maxStackSize = size * multiplier / sizeof(TextBufferObj);
+        } else if(strcmp(argv[i], "-releaseLimit") == 0) {
+            //-releaseLimit takes one argument
+            if(i == (argc - 1)) {
+                puts("-releaseLimit takes one argument");
+                exit(1);
+            }
+            i++;
+            char* end;
+            lv_expr_releaseLimit = strtoul(argv[i], &end, 10);
+            if(*end || end == argv[i]) {
+                printf("Argument %s must be a nonnegative integer\n", argv[i]);
+                exit(1);
+            }
         } else if(strcmp(argv[i], "-help") == 0) {
             puts(
                 "Usage: lavender [options] [main file] [args]\n"
@@ -68,6 +82,8 @@ int main(int argc, char* argv[]) {
                 "                  -debug : Enables debug logging.\n"
                 "    -maxStackSize <size> : Sets the maximum size of the Lavender stack\n"
                 "                           in kibibytes (K), mebibiyes (M), or gibibytes (G).\n"
+                "   -releaseLimit <count> : Frees at most count unreferenced values\n"
+                "                           per function call, instead of all at once.\n"
                 "                -version : Print version information and exit.\n"
                 "                   -help : Print this information and exit."
             );
@@ -0,0 +1,426 @@
+#include "map.h"
+#include "lavender.h"
+#include "expression.h"
+#include "builtin.h"
+#include <string.h>
+#include <assert.h>
+
+//Tries are passed around along with their level, the number of nodes
+//above them. Nodes at the collision level have no indices, and hold
+//entries with equal hashes ordered by key. Functions that take a trie
+//consume the caller's reference to it, and functions that return a
+//trie give the caller one reference to it. A node that is referred
+//to only by the caller is modified in place.
+
+#define COLLISION_LEVEL (LV_MAP_TRIE_DEPTH - 1)
+#define INDEX_COUNT (1 << LV_MAP_TRIE_BITS)
+
+static int bitCount(uint32_t bits) {
+
+    return __builtin_popcount(bits);
+}
+
+/** Returns the index of the given hash in a node of the given level. */
+static int hashIndex(uint64_t hash, int level) {
+
+    int shift = 64 - LV_MAP_TRIE_BITS * (level + 1);
+    if(shift >= 0)
+        return (hash >> shift) & (INDEX_COUNT - 1);
+    //the last level indexes the remaining bits
+    return hash & ((1u << (shift + LV_MAP_TRIE_BITS)) - 1);
+}
+
+/** Returns the number of set bits of the bitmap below the given index. */
+static int position(uint32_t bitmap, int idx) {
+
+    return bitCount(bitmap & ((1u << idx) - 1));
+}
+
+static int entryCount(LvMapTrie* node, int level) {
+
+    return level == COLLISION_LEVEL ? (int)node->len : bitCount(node->datamap);
+}
+
+static LvMapTrie** subtries(LvMapTrie* node, int level) {
+
+    return (LvMapTrie**)(node->data + entryCount(node, level));
+}
+
+static size_t nodeSize(int entries, int subs) {
+
+    return sizeof(LvMapTrie) + entries * sizeof(LvMapNode) + subs * sizeof(LvMapTrie*);
+}
+
+static LvMapTrie* newNode(int entries, int subs) {
+
+    LvMapTrie* node = lv_alloc(nodeSize(entries, subs));
+    node->refCount = 1;
+    return node;
+}
+
+static void shareEntry(LvMapNode* entry) {
+
+    if(LV_IS_DYNAMIC(&entry->key))
+        ++*LV_REFCOUNT(&entry->key);
+    if(LV_IS_DYNAMIC(&entry->value))
+        ++*LV_REFCOUNT(&entry->value);
+}
+
+static void releaseEntry(LvMapNode* entry) {
+
+    lv_expr_cleanup(&entry->key, 1);
+    lv_expr_cleanup(&entry->value, 1);
+}
+
+static void freeTrie(LvMapTrie* node, int level) {
+
+    int entries = entryCount(node, level);
+    for(int i = 0; i < entries; i++)
+        releaseEntry(&node->data[i]);
+    LvMapTrie** subs = subtries(node, level);
+    for(int i = 0; i < bitCount(node->nodemap); i++) {
+        assert(subs[i]->refCount);
+        if(--subs[i]->refCount == 0)
+            freeTrie(subs[i], level + 1);
+    }
+    lv_free(node);
+}
+
+void lv_map_free(LvMapTrie* trie) {
+
+    freeTrie(trie, 0);
+}
+
+/**
+ * Gives up the caller's reference to a node whose entries and
+ * subtries were copied into a new node. If the caller's reference
+ * was the only one, they are moved and the node is freed. Otherwise
+ * the new node takes references to them.
+ */
+static void donate(LvMapTrie* node, int level) {
+
+    if(node->refCount == 1) {
+        lv_free(node);
+        return;
+    }
+    node->refCount--;
+    int entries = entryCount(node, level);
+    for(int i = 0; i < entries; i++)
+        shareEntry(&node->data[i]);
+    LvMapTrie** subs = subtries(node, level);
+    for(int i = 0; i < bitCount(node->nodemap); i++)
+        subs[i]->refCount++;
+}
+
+/** Returns the node, or a copy of it if it is shared, for modification. */
+static LvMapTrie* editable(LvMapTrie* node, int level) {
+
+    if(node->refCount == 1)
+        return node;
+    size_t size = nodeSize(entryCount(node, level), bitCount(node->nodemap));
+    LvMapTrie* copy = lv_alloc(size);
+    memcpy(copy, node, size);
+    copy->refCount = 1;
+    donate(node, level);
+    return copy;
+}
+
+static LvMapTrie* emptyTrie(void) {
+
+    LvMapTrie* node = newNode(0, 0);
+    node->len = 0;
+    node->datamap = 0;
+    node->nodemap = 0;
+    return node;
+}
+
+/**
+ * Returns the node with the entry inserted at the given position
+ * of its entries, and with the given datamap.
+ */
+static LvMapTrie* insertEntry(LvMapTrie* node, int level, int pos, uint32_t datamap, LvMapNode* entry) {
+
+    int entries = entryCount(node, level);
+    int subs = bitCount(node->nodemap);
+    LvMapTrie* res = newNode(entries + 1, subs);
+    res->len = node->len + 1;
+    res->datamap = datamap;
+    res->nodemap = node->nodemap;
+    memcpy(res->data, node->data, pos * sizeof(LvMapNode));
+    res->data[pos] = *entry;
+    memcpy(res->data + pos + 1, node->data + pos, (entries - pos) * sizeof(LvMapNode));
+    memcpy(res->data + entries + 1, subtries(node, level), subs * sizeof(LvMapTrie*));
+    donate(node, level);
+    return res;
+}
+
+/**
+ * Returns the node with the entry at the given index replaced by
+ * the given subtrie, which holds that entry.
+ */
+static LvMapTrie* pushDown(LvMapTrie* node, int level, int idx, LvMapTrie* sub) {
+
+    int entries = bitCount(node->datamap);
+    int subs = bitCount(node->nodemap);
+    int epos = position(node->datamap, idx);
+    int spos = position(node->nodemap, idx);
+    LvMapTrie* res = newNode(entries - 1, subs + 1);
+    res->len = node->len - 1 + sub->len;
+    res->datamap = node->datamap & ~(1u << idx);
+    res->nodemap = node->nodemap | (1u << idx);
+    memcpy(res->data, node->data, epos * sizeof(LvMapNode));
+    memcpy(res->data + epos, node->data + epos + 1, (entries - epos - 1) * sizeof(LvMapNode));
+    LvMapTrie** from = subtries(node, level);
+    LvMapTrie** to = (LvMapTrie**)(res->data + entries - 1);
+    memcpy(to, from, spos * sizeof(LvMapTrie*));
+    to[spos] = sub;
+    memcpy(to + spos + 1, from + spos, (subs - spos) * sizeof(LvMapTrie*));
+    donate(node, level);
+    return res;
+}
+
+/** Makes a trie of the given level holding two entries with different keys. */
+static LvMapTrie* pair(LvMapNode* a, LvMapNode* b, int level) {
+
+    LvMapTrie* node;
+    if(level == COLLISION_LEVEL) {
+        bool swap = lv_blt_lt(&b->key, &a->key);
+        node = newNode(2, 0);
+        node->datamap = 0;
+        node->nodemap = 0;
+        node->data[swap] = *a;
+        node->data[!swap] = *b;
+    } else {
+        int ia = hashIndex(a->hash, level);
+        int ib = hashIndex(b->hash, level);
+        if(ia == ib) {
+            node = newNode(0, 1);
+            node->datamap = 0;
+            node->nodemap = 1u << ia;
+            subtries(node, level)[0] = pair(a, b, level + 1);
+        } else {
+            node = newNode(2, 0);
+            node->datamap = (1u << ia) | (1u << ib);
+            node->nodemap = 0;
+            node->data[ia > ib] = *a;
+            node->data[ia < ib] = *b;
+        }
+    }
+    node->len = 2;
+    return node;
+}
+
+/**
+ * Returns the node with its entry at the given position replaced
+ * by the given entry if replace is set. Otherwise the given entry
+ * is released.
+ */
+static LvMapTrie* replaceEntry(LvMapTrie* node, int level, int pos, LvMapNode* entry, bool replace) {
+
+    if(!replace) {
+        releaseEntry(entry);
+        return node;
+    }
+    node = editable(node, level);
+    releaseEntry(&node->data[pos]);
+    node->data[pos] = *entry;
+    return node;
+}
+
+/**
+ * Returns the trie with the entry added, taking the entry's references.
+ * If the trie has an equal key, the entry replaces that key's entry
+ * if replace is set, and is released otherwise.
+ */
+static LvMapTrie* assoc(LvMapTrie* node, int level, LvMapNode* entry, bool replace) {
+
+    if(level == COLLISION_LEVEL) {
+        for(size_t i = 0; i < node->len; i++) {
+            if(lv_blt_equal(&node->data[i].key, &entry->key))
+                return replaceEntry(node, level, i, entry, replace);
+        }
+        size_t pos = 0;
+        while(pos < node->len && lv_blt_lt(&node->data[pos].key, &entry->key))
+            pos++;
+        return insertEntry(node, level, pos, 0, entry);
+    }
+    int idx = hashIndex(entry->hash, level);
+    uint32_t bit = 1u << idx;
+    if(node->datamap & bit) {
+        int pos = position(node->datamap, idx);
+        LvMapNode* old = &node->data[pos];
+        if(old->hash == entry->hash && lv_blt_equal(&old->key, &entry->key))
+            return replaceEntry(node, level, pos, entry, replace);
+        return pushDown(node, level, idx, pair(old, entry, level + 1));
+    }
+    if(node->nodemap & bit) {
+        node = editable(node, level);
+        LvMapTrie** sub = &subtries(node, level)[position(node->nodemap, idx)];
+        size_t len = (*sub)->len;
+        *sub = assoc(*sub, level + 1, entry, replace);
+        node->len += (*sub)->len - len;
+        return node;
+    }
+    return insertEntry(node, level, position(node->datamap, idx), node->datamap | bit, entry);
+}
+
+void lv_map_iter(LvMapIter* it, TextBufferObj* map) {
+
+    it->map = map;
+    it->idx = 0;
+    it->depth = 0;
+    if(LV_TYPE(map) == OPT_MAP_TRIE) {
+        it->path[0].node = LV_TRIE(map);
+        it->path[0].next = 0;
+        it->depth = 1;
+    }
+}
+
+LvMapNode* lv_map_next(LvMapIter* it) {
+
+    if(LV_TYPE(it->map) == OPT_MAP)
+        return &LV_MAP(it->map)->data[it->idx++];
+    for(;;) {
+        assert(it->depth > 0);
+        int level = it->depth - 1;
+        LvMapTrie* node = it->path[level].node;
+        int next = it->path[level].next;
+        if(level == COLLISION_LEVEL) {
+            if((size_t)next < node->len) {
+                it->path[level].next++;
+                return &node->data[next];
+            }
+        } else {
+            uint32_t rest = next < INDEX_COUNT ? (node->datamap | node->nodemap) >> next : 0;
+            if(rest) {
+                int idx = next + __builtin_ctz(rest);
+                it->path[level].next = idx + 1;
+                if(node->datamap & (1u << idx))
+                    return &node->data[position(node->datamap, idx)];
+                //visit the subtrie
+                it->path[level + 1].node = subtries(node, level)[position(node->nodemap, idx)];
+                it->path[level + 1].next = 0;
+                it->depth++;
+                continue;
+            }
+        }
+        it->depth--;
+    }
+}
+
+TextBufferObj* lv_map_get(LvMapTrie* trie, uint64_t hash, TextBufferObj* key) {
+
+    LvMapTrie* node = trie;
+    for(int level = 0; level < COLLISION_LEVEL; level++) {
+        int idx = hashIndex(hash, level);
+        uint32_t bit = 1u << idx;
+        if(node->datamap & bit) {
+            LvMapNode* entry = &node->data[position(node->datamap, idx)];
+            if(entry->hash == hash && lv_blt_equal(&entry->key, key))
+                return &entry->value;
+            return NULL;
+        }
+        if(!(node->nodemap & bit))
+            return NULL;
+        node = subtries(node, level)[position(node->nodemap, idx)];
+    }
+    for(size_t i = 0; i < node->len; i++) {
+        if(lv_blt_equal(&node->data[i].key, key))
+            return &node->data[i].value;
+    }
+    return NULL;
+}
+
+/** Returns the given map as a trie. */
+static LvMapTrie* toTrie(TextBufferObj* map) {
+
+    if(LV_TYPE(map) == OPT_MAP_TRIE) {
+        LV_TRIE(map)->refCount++;
+        return LV_TRIE(map);
+    }
+    LvMapTrie* root = emptyTrie();
+    for(size_t i = 0; i < LV_MAP(map)->len; i++) {
+        LvMapNode entry = LV_MAP(map)->data[i];
+        shareEntry(&entry);
+        root = assoc(root, 0, &entry, true);
+    }
+    return root;
+}
+
+void lv_map_concat(TextBufferObj* a, TextBufferObj* b, TextBufferObj* res) {
+
+    assert(LV_MAP_LEN(a) + LV_MAP_LEN(b) >= LV_MAP_TRIE_MIN
+        || LV_TYPE(a) == OPT_MAP_TRIE || LV_TYPE(b) == OPT_MAP_TRIE);
+    //add the entries of the shorter map to the longer map
+    bool intoA = LV_MAP_LEN(a) >= LV_MAP_LEN(b);
+    LvMapTrie* root = toTrie(intoA ? a : b);
+    TextBufferObj* from = intoA ? b : a;
+    LvMapIter it;
+    lv_map_iter(&it, from);
+    for(size_t i = 0; i < LV_MAP_LEN(from); i++) {
+        LvMapNode entry = *lv_map_next(&it);
+        shareEntry(&entry);
+        root = assoc(root, 0, &entry, intoA);
+    }
+    //the root may be shared, if no entries were added
+    root->refCount--;
+    *res = lv_tb_box(OPT_MAP_TRIE, root);
+    root->hash.source = LV_HASH_NONE;
+}
+
+/** Copies the trie, taking the values in order from values. */
+static LvMapTrie* copyWithValues(LvMapTrie* node, int level, TextBufferObj** values) {
+
+    int entries = entryCount(node, level);
+    LvMapTrie* res = newNode(entries, bitCount(node->nodemap));
+    res->len = node->len;
+    res->datamap = node->datamap;
+    res->nodemap = node->nodemap;
+    if(level == COLLISION_LEVEL) {
+        for(int i = 0; i < entries; i++) {
+            res->data[i].hash = node->data[i].hash;
+            res->data[i].key = node->data[i].key;
+            res->data[i].value = *(*values)++;
+            if(LV_IS_DYNAMIC(&res->data[i].key))
+                ++*LV_REFCOUNT(&res->data[i].key);
+        }
+        return res;
+    }
+    LvMapTrie** from = subtries(node, level);
+    LvMapTrie** to = subtries(res, level);
+    for(int idx = 0; idx < INDEX_COUNT; idx++) {
+        uint32_t bit = 1u << idx;
+        if(node->datamap & bit) {
+            int pos = position(node->datamap, idx);
+            res->data[pos].hash = node->data[pos].hash;
+            res->data[pos].key = node->data[pos].key;
+            res->data[pos].value = *(*values)++;
+            if(LV_IS_DYNAMIC(&res->data[pos].key))
+                ++*LV_REFCOUNT(&res->data[pos].key);
+        } else if(node->nodemap & bit) {
+            int pos = position(node->nodemap, idx);
+            to[pos] = copyWithValues(from[pos], level + 1, values);
+        }
+    }
+    return res;
+}
+
+void lv_map_withValues(LvMapTrie* trie, TextBufferObj* values, TextBufferObj* res) {
+
+    LvMapTrie* root = copyWithValues(trie, 0, &values);
+    root->refCount = 0;
+    *res = lv_tb_box(OPT_MAP_TRIE, root);
+    root->hash.source = LV_HASH_NONE;
+}
+
+void lv_map_fromFlat(LvMap* map, TextBufferObj* res) {
+
+    LvMapTrie* root = emptyTrie();
+    for(size_t i = 0; i < map->len; i++)
+        root = assoc(root, 0, &map->data[i], true);
+    lv_free(map->index);
+    lv_free(map);
+    root->refCount = 0;
+    *res = lv_tb_box(OPT_MAP_TRIE, root);
+    root->hash.source = LV_HASH_NONE;
+}
@@ -0,0 +1,70 @@
+#ifndef MAP_H
+#define MAP_H
+#include "textbuffer.h"
+
+//Operations on maps that may be stored as tries (OPT_MAP_TRIE).
+//Maps built by concatenating at least LV_MAP_TRIE_MIN entries, or by
+//concatenating a trie, are tries, all others are flat. A trie may be
+//shorter than LV_MAP_TRIE_MIN if the concatenated maps shared keys.
+//Both forms order their entries by hash, then by key, so a map
+//iterates in the same order in either form.
+
+/**
+ * Iterates over the entries of a flat or trie map in order.
+ */
+typedef struct LvMapIter {
+    TextBufferObj* map;
+    size_t idx;             //index of the next entry of a flat map
+    int depth;              //number of trie nodes being visited
+    struct {
+        LvMapTrie* node;
+        int next;           //the next index (or entry, below the last level)
+    } path[LV_MAP_TRIE_DEPTH];
+} LvMapIter;
+
+/**
+ * Starts iterating over the given map.
+ */
+void lv_map_iter(LvMapIter* it, TextBufferObj* map);
+
+/**
+ * Returns the next entry of the map. The caller must
+ * not advance the iterator past the end of the map.
+ */
+LvMapNode* lv_map_next(LvMapIter* it);
+
+/**
+ * Returns the value of the trie with the given key, whose
+ * hash is given, or NULL if the trie has no such key.
+ */
+TextBufferObj* lv_map_get(LvMapTrie* trie, uint64_t hash, TextBufferObj* key);
+
+/**
+ * Stores the entries of both maps in res, with the entries of b replacing
+ * the entries of a with equal keys. The maps must have at least
+ * LV_MAP_TRIE_MIN entries between them, or one of them must be a trie.
+ * The result is a trie with a refCount of zero. If a is a trie with a refCount of zero and is at least as long
+ * as b, it is modified in place.
+ */
+void lv_map_concat(TextBufferObj* a, TextBufferObj* b, TextBufferObj* res);
+
+/**
+ * Stores in res a trie with the keys of the given trie and the given
+ * values, in order. The trie takes the references to the values, and
+ * has a refCount of zero.
+ */
+void lv_map_withValues(LvMapTrie* trie, TextBufferObj* values, TextBufferObj* res);
+
+/**
+ * Stores the entries of the given flat map in res as a trie with a
+ * refCount of zero. The trie takes the map's references to the entries,
+ * and the map is freed.
+ */
+void lv_map_fromFlat(LvMap* map, TextBufferObj* res);
+
+/**
+ * Frees a trie whose refCount has reached zero.
+ */
+void lv_map_free(LvMapTrie* trie);
+
+#endif
@@ -0,0 +1,189 @@
+#include "memory.h"
+#include "lavender.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static void allocFailed(size_t size) {
+
+    printf("Allocation failed: %lu bytes\n", size);
+    lv_shutdown();
+}
+
+#ifdef LV_SYSTEM_ALLOC
+
+void* lv_alloc(size_t size) {
+
+    void* value = malloc(size);
+    if(!value)
+        allocFailed(size);
+    return value;
+}
+
+void* lv_realloc(void* ptr, size_t size) {
+
+    void* tmp = realloc(ptr, size);
+    if(!tmp) {
+        free(ptr);
+        allocFailed(size);
+    }
+    return tmp;
+}
+
+void lv_free(void* ptr) {
+
+    free(ptr);
+}
+
+void lv_mem_printStats(void) {
+
+    puts("Allocator: system");
+}
+
+void lv_mem_onShutdown(void) { }
+
+#else
+
+//Each block starts with a header holding the size of the block
+//(including the header). Blocks of up to MAX_SMALL_SIZE bytes are
+//carved out of slabs and are rounded up to a multiple of GRANULE.
+//Larger blocks are allocated by the system allocator.
+#define GRANULE 16
+#define SIZE_CLASS_COUNT 16
+#define MAX_SMALL_SIZE (GRANULE * SIZE_CLASS_COUNT)
+#define HEADER_SIZE sizeof(size_t)
+#define SLAB_SIZE (64 * 1024)
+
+/** A free block, linked into the free list of its size class. */
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+/** A slab of blocks of one size class. */
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+static FreeBlock* freeLists[SIZE_CLASS_COUNT];
+static Slab* slabs;         //all allocated slabs
+static size_t allocHits;    //allocations served from a free list
+static size_t allocMisses;  //allocations that called the system allocator
+static size_t bytesInUse;   //size of all allocated blocks
+
+/**
+ * Allocates a new slab for the given size class and adds
+ * its blocks to the free list.
+ */
+static void refill(int sizeClass) {
+
+    size_t blockSize = (sizeClass + 1) * GRANULE;
+    char* mem = malloc(SLAB_SIZE);
+    if(!mem)
+        allocFailed(SLAB_SIZE);
+    Slab* slab = (Slab*) mem;
+    slab->next = slabs;
+    slabs = slab;
+    //the first granule holds the slab link
+    for(char* block = mem + GRANULE; block + blockSize <= mem + SLAB_SIZE; block += blockSize) {
+        *(size_t*) block = blockSize;
+        FreeBlock* node = (FreeBlock*)(block + HEADER_SIZE);
+        node->next = freeLists[sizeClass];
+        freeLists[sizeClass] = node;
+    }
+}
+
+void* lv_alloc(size_t size) {
+
+    size_t blockSize = size + HEADER_SIZE;
+    if(blockSize <= MAX_SMALL_SIZE) {
+        int sizeClass = (blockSize - 1) / GRANULE;
+        if(freeLists[sizeClass]) {
+            allocHits++;
+        } else {
+            allocMisses++;
+            refill(sizeClass);
+        }
+        FreeBlock* block = freeLists[sizeClass];
+        freeLists[sizeClass] = block->next;
+        bytesInUse += (sizeClass + 1) * GRANULE;
+        return block;
+    }
+    allocMisses++;
+    size_t* block = malloc(blockSize);
+    if(!block)
+        allocFailed(size);
+    *block = blockSize;
+    bytesInUse += blockSize;
+    return block + 1;
+}
+
+void* lv_realloc(void* ptr, size_t size) {
+
+    if(!ptr)
+        return lv_alloc(size);
+    size_t* header = (size_t*) ptr - 1;
+    size_t oldSize = *header;
+    size_t blockSize = size + HEADER_SIZE;
+    if(oldSize > MAX_SMALL_SIZE && blockSize > MAX_SMALL_SIZE) {
+        if(blockSize <= oldSize && blockSize > oldSize / 2) {
+            //the large block is big enough and not too wasteful
+            return ptr;
+        }
+        //both large, let the system allocator move the block
+        allocMisses++;
+        size_t* tmp = realloc(header, blockSize);
+        if(!tmp) {
+            free(header);
+            allocFailed(size);
+        }
+        *tmp = blockSize;
+        bytesInUse += blockSize - oldSize;
+        return tmp + 1;
+    }
+    if(oldSize <= MAX_SMALL_SIZE && blockSize <= oldSize) {
+        //the small block is big enough
+        return ptr;
+    }
+    void* res = lv_alloc(size);
+    size_t oldLen = oldSize - HEADER_SIZE;
+    memcpy(res, ptr, oldLen < size ? oldLen : size);
+    lv_free(ptr);
+    return res;
+}
+
+void lv_free(void* ptr) {
+
+    if(!ptr)
+        return;
+    size_t* header = (size_t*) ptr - 1;
+    size_t blockSize = *header;
+    bytesInUse -= blockSize;
+    if(blockSize <= MAX_SMALL_SIZE) {
+        int sizeClass = blockSize / GRANULE - 1;
+        FreeBlock* block = ptr;
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    } else {
+        free(header);
+    }
+}
+
+void lv_mem_printStats(void) {
+
+    printf("Allocator: %lu hits, %lu misses, %lu bytes in use\n",
+        (unsigned long) allocHits,
+        (unsigned long) allocMisses,
+        (unsigned long) bytesInUse);
+}
+
+void lv_mem_onShutdown(void) {
+
+    while(slabs) {
+        Slab* next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    memset(freeLists, 0, sizeof(freeLists));
+}
+
+#endif
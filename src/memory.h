@@ -0,0 +1,21 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+//lv_alloc, lv_realloc, and lv_free (declared in lavender.h) serve
+//small blocks from per size class free lists carved out of slabs
+//define LV_SYSTEM_ALLOC to use malloc and free directly
+//(for example, when running under a memory checker)
+
+/**
+ * Prints the allocator hit and miss counts and the number
+ * of bytes in use.
+ */
+void lv_mem_printStats(void);
+
+/**
+ * Releases all slabs. Must be called after all other
+ * modules have shut down.
+ */
+void lv_mem_onShutdown(void);
+
+#endif
@@ -91,6 +91,12 @@ static void freeList(Operator* head) {
     }
 }
 
+void lv_op_printStats(void) {
+
+    lv_tbl_printStats(&funcNamespaces[FNS_PREFIX], "prefix");
+    lv_tbl_printStats(&funcNamespaces[FNS_INFIX], "infix");
+}
+
 void lv_op_onStartup(void) {
 
     for(int i = 0; i < FNS_COUNT; i++) {
@@ -29,6 +29,7 @@ struct Operator {
     Fixing fixing;
     int captureCount;
     int locals;
+    int maxStack;   //maximum operand stack depth of the body
     union {
         int textOffset;
         Param* params;
@@ -72,6 +73,12 @@ bool lv_op_addOperator(Operator* op, FuncNamespace ns);
  */
 bool lv_op_removeOperator(char* name, FuncNamespace ns);
 
+/**
+ * Prints how the operator names are spread over
+ * the buckets of each namespace's table.
+ */
+void lv_op_printStats(void);
+
 /**
  * Retrieves all operators in the specified scope.
  */
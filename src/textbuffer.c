@@ -4,10 +4,14 @@
 #include "operator.h"
 #include "builtin.h"
 #include "dynbuffer.h"
+#include "hashtable.h"
+#include "vector.h"
+#include "map.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <math.h>
 #include <assert.h>
 
 static int mapKeyCmp(const void* p1, const void* p2) {
@@ -57,318 +61,731 @@ void lv_tb_initMap(LvMap** map) {
     }
 }
 
+void lv_tb_mergeMap(LvMap* map, LvMap* other) {
+
+    //merge from the back, so the entries of map are not
+    //overwritten before they are merged
+    LvMapNode* data = map->data;
+    size_t i = map->len;
+    size_t j = other->len;
+    size_t total = i + j;
+    size_t k = total;
+    while(j > 0) {
+        LvMapNode* b = &other->data[j - 1];
+        if(i > 0) {
+            LvMapNode* a = &data[i - 1];
+            if(a->hash == b->hash && lv_blt_equal(&a->key, &b->key)) {
+                //the entry of other replaces this one
+                lv_expr_cleanup(&a->key, 1);
+                lv_expr_cleanup(&a->value, 1);
+                i--;
+            } else if(mapKeyCmp(a, b) > 0) {
+                data[--k] = *a;
+                i--;
+                continue;
+            }
+        }
+        data[--k] = *b;
+        if(LV_IS_DYNAMIC(&b->key))
+            ++*LV_REFCOUNT(&b->key);
+        if(LV_IS_DYNAMIC(&b->value))
+            ++*LV_REFCOUNT(&b->value);
+        j--;
+    }
+    //close the gap left by replaced entries
+    if(k > i)
+        memmove(data + i, data + k, (total - k) * sizeof(LvMapNode));
+    map->len = i + total - k;
+}
+
 //redeclaration of the global text buffer
-TextBufferObj* TEXT_BUFFER;
+LvInst* TEXT_BUFFER;
 #define INIT_TEXT_BUFFER_LEN 1024
 static size_t textBufferLen;    //one past the end of the buffer
 static size_t textBufferTop;    //one past the top of the buffer
 
+//redeclaration of the constant table
+TextBufferObj* TEXT_CONSTANTS;
+#define INIT_CONSTANTS_LEN 256
+static size_t constantsLen;     //one past the end of the table
+static size_t constantsTop;     //one past the last used constant
+
+//redeclaration of the call site caches
+CallCache* CALL_CACHE;
+#define INIT_CALL_CACHE_LEN 64
+static size_t callCacheLen;     //one past the end of the caches
+static size_t callCacheTop;     //one past the last used cache
+
+/**
+ * Gives a value call instruction a new, empty inline cache.
+ */
+static void addCallSite(LvInst* inst) {
+
+    if(callCacheTop == callCacheLen) {
+        callCacheLen *= 2;
+        CALL_CACHE = lv_realloc(CALL_CACHE, callCacheLen * sizeof(CallCache));
+    }
+    memset(&CALL_CACHE[callCacheTop], 0, sizeof(CallCache));
+    inst->callSite = (int) callCacheTop++;
+}
+
+/**
+ * Moves the value of a constant instruction into the constant table.
+ */
+static void addConstant(LvInst* inst) {
+
+    if(constantsTop == constantsLen) {
+        constantsLen *= 2;
+        TEXT_CONSTANTS = lv_realloc(TEXT_CONSTANTS, constantsLen * sizeof(TextBufferObj));
+    }
+    TEXT_CONSTANTS[constantsTop] = inst->value;
+    inst->constant = (int) constantsTop++;
+}
+
+#ifdef LV_THREADED_CODE
+//redeclaration of the threaded code buffer
+void** TEXT_THREAD;
+static size_t decodedTop;       //one past the last decoded instruction
+
+void lv_tb_decode(void* const* routines) {
+
+    for(size_t i = decodedTop; i < textBufferTop; i++) {
+        TEXT_THREAD[i] = routines[TEXT_BUFFER[i].type];
+        assert(TEXT_THREAD[i]);
+    }
+    decodedTop = textBufferTop;
+}
+#endif
+
+/**
+ * Sets the top of the text buffer after code has been removed,
+ * and releases the constants of the removed code.
+ */
+static void setTextTop(size_t top) {
+
+    //call sites and constants are numbered in order,
+    //so free the caches and values of the removed ones
+    size_t constTop = constantsTop;
+    for(size_t i = top; i < textBufferTop; i++) {
+        OpType type = TEXT_BUFFER[i].type;
+        if((type == OPT_FUNC_CALL2 || type == OPT_TAIL_CALL2)
+            && (size_t)TEXT_BUFFER[i].callSite < callCacheTop)
+            callCacheTop = TEXT_BUFFER[i].callSite;
+        else if(type == OPT_CONSTANT && (size_t)TEXT_BUFFER[i].constant < constTop)
+            constTop = TEXT_BUFFER[i].constant;
+    }
+    lv_expr_cleanup(TEXT_CONSTANTS + constTop, constantsTop - constTop);
+    constantsTop = constTop;
+    textBufferTop = top;
+#ifdef LV_THREADED_CODE
+    if(decodedTop > top)
+        decodedTop = top;
+#endif
+}
+
+static size_t foldedInsts; //instructions removed by constant folding
+
+static bool isFoldable(LvInst* inst) {
+
+    if(inst->type != OPT_CONSTANT)
+        return false;
+    OpType type = LV_TYPE(&inst->value);
+    return type == OPT_NUMBER
+        || type == OPT_INTEGER
+        || type == OPT_STRING
+        || type == OPT_SHORT_STR;
+}
+
+/**
+ * Replaces calls to pure built in functions on literal arguments
+ * with the result of the call. Returns the new length of the code.
+ */
+static size_t foldConstants(LvInst* code, size_t len) {
+
+    size_t top = 0;
+    for(size_t i = 0; i < len; i++) {
+        code[top] = code[i];
+        LvInst* inst = &code[top];
+        if(inst->type == OPT_FUNCTION && (size_t)inst->func->arity <= top) {
+            //in postfix code, the args are the values just before the call
+            int ar = inst->func->arity;
+            LvInst* args = inst - ar;
+            bool literals = true;
+            for(int j = 0; j < ar; j++)
+                literals = literals && isFoldable(&args[j]);
+            TextBufferObj values[ar + 1];
+            for(int j = 0; literals && j < ar; j++)
+                values[j] = args[j].value;
+            TextBufferObj res;
+            if(literals && lv_blt_fold(inst->func, values, &res)) {
+                lv_expr_cleanup(values, ar);
+                args->type = OPT_CONSTANT;
+                args->value = res;
+                top -= ar;
+            }
+        }
+        top++;
+    }
+    foldedInsts += len - top;
+    return top;
+}
+
 /**
  * Adds the text to the buffer and appends a return object to the end.
  */
-static void pushText(TextBufferObj* text, size_t len) {
+static void pushText(LvInst* text, size_t len) {
 
-    if(textBufferLen - textBufferTop < len) {
+    while(textBufferLen - textBufferTop < len) {
         //we must reallocate the buffer
         TEXT_BUFFER =
-            lv_realloc(TEXT_BUFFER, textBufferLen * 2 * sizeof(TextBufferObj));
-        memset(TEXT_BUFFER + textBufferLen, 0, textBufferLen * sizeof(TextBufferObj));
+            lv_realloc(TEXT_BUFFER, textBufferLen * 2 * sizeof(LvInst));
+        memset(TEXT_BUFFER + textBufferLen, 0, textBufferLen * sizeof(LvInst));
+#ifdef LV_THREADED_CODE
+        TEXT_THREAD = lv_realloc(TEXT_THREAD, textBufferLen * 2 * sizeof(void*));
+#endif
         textBufferLen *= 2;
     }
-    memcpy(TEXT_BUFFER + textBufferTop, text, len * sizeof(TextBufferObj));
+    memcpy(TEXT_BUFFER + textBufferTop, text, len * sizeof(LvInst));
+    len = foldConstants(TEXT_BUFFER + textBufferTop, len);
+    //replace calls to arithmetic and comparison functions
+    //with their quickened forms, set up value call caches,
+    //and move the values of constants to the constant table
+    for(size_t i = textBufferTop; i < textBufferTop + len; i++) {
+        if(TEXT_BUFFER[i].type == OPT_FUNCTION)
+            TEXT_BUFFER[i].type = lv_blt_getQuickOp(TEXT_BUFFER[i].func);
+        else if(TEXT_BUFFER[i].type == OPT_FUNC_CALL2)
+            addCallSite(&TEXT_BUFFER[i]);
+        else if(TEXT_BUFFER[i].type == OPT_CONSTANT)
+            addConstant(&TEXT_BUFFER[i]);
+    }
     textBufferTop += len;
 }
 
-size_t lv_tb_addExpr(size_t len, TextBufferObj* expr) {
+/**
+ * Computes the maximum number of values the code in the given range
+ * of the text buffer pushes onto the stack. Each function body
+ * (and each conditional piece) starts with an empty stack and ends
+ * with a return, so a linear scan is sufficient. Nested function
+ * bodies in the range may make the result an overestimate.
+ */
+static int stackDepth(size_t start, size_t end) {
+
+    int depth = 0;
+    int max = 0;
+    for(size_t i = start; i < end; i++) {
+        LvInst* inst = &TEXT_BUFFER[i];
+        switch(inst->type) {
+            case OPT_PUT_PARAM:
+            case OPT_BEQZ:
+                depth--;
+                break;
+            case OPT_FUNC_CAP:
+                //pops the function value and its captures
+                assert(i > start && TEXT_BUFFER[i - 1].type == OPT_FUNCTION_VAL);
+                depth -= TEXT_BUFFER[i - 1].func->captureCount;
+                break;
+            case OPT_FUNC_CALL2:
+            case OPT_TAIL_CALL2:
+            case OPT_MAKE_VECT:
+                depth -= inst->callArity - 1;
+                break;
+            case OPT_MAKE_MAP:
+                depth -= 2 * inst->callArity - 1;
+                break;
+            case OPT_RETURN:
+            case OPT_TAIL:
+                depth = 0;
+                break;
+            case OPT_SWITCH:
+                break;
+            case OPT_FUNCTION:
+            case OPT_ADD:
+            case OPT_SUB:
+            case OPT_MUL:
+            case OPT_DIV:
+            case OPT_IDIV:
+            case OPT_REM:
+            case OPT_EQ:
+            case OPT_LT:
+            case OPT_GT:
+            case OPT_LE:
+            case OPT_GE:
+                depth -= inst->func->arity - 1;
+                break;
+            default:
+                //literals and params
+                depth++;
+                break;
+        }
+        if(depth > max)
+            max = depth;
+    }
+    return max;
+}
+
+/**
+ * Converts a call at the top of the text buffer, which must be
+ * followed by a return, into a tail call. Calls to built in
+ * functions are left as is.
+ */
+static void markTailCall(void) {
+
+    LvInst* last = &TEXT_BUFFER[textBufferTop - 1];
+    if(last->type == OPT_FUNCTION && last->func->type != FUN_BUILTIN)
+        last->type = OPT_TAIL;
+    else if(last->type == OPT_FUNC_CALL2)
+        last->type = OPT_TAIL_CALL2;
+}
+
+/**
+ * Turns the last read of each param in the given range of the text
+ * buffer into a move, so the param slot does not keep the value alive
+ * for the rest of the call. The code must run straight through,
+ * as function bodies do.
+ */
+static void markLastUses(size_t start, size_t end) {
+
+    int maxParam = -1;
+    for(size_t i = start; i < end; i++) {
+        if(TEXT_BUFFER[i].type == OPT_PARAM && TEXT_BUFFER[i].param > maxParam)
+            maxParam = TEXT_BUFFER[i].param;
+    }
+    if(maxParam < 0)
+        return;
+    bool used[maxParam + 1];
+    memset(used, 0, sizeof(used));
+    for(size_t i = end; i-- > start;) {
+        LvInst* inst = &TEXT_BUFFER[i];
+        if(inst->type == OPT_PARAM && !used[inst->param]) {
+            used[inst->param] = true;
+            inst->type = OPT_MOVE_PARAM;
+        }
+    }
+}
+
+void lv_tb_addExpr(Operator* func, size_t len, LvInst* expr) {
 
     size_t save = textBufferTop;
-    TextBufferObj ret = { .type = OPT_RETURN };
+    LvInst ret = { .type = OPT_RETURN };
     pushText(expr, len);
+    markTailCall();
+    markLastUses(save, textBufferTop);
     pushText(&ret, 1);
-    return save;
+    func->textOffset = (int) save;
+    func->maxStack = stackDepth(save, textBufferTop);
 }
 
-static DynBuffer symbols; //of char*
+static DynBuffer symbols;   //of char*, the name of each symbol
+static Hashtable symbolIds; //of symbol index + 1, by name
+static size_t symbolBytes;  //total length of the names
 
 TextBufferObj lv_tb_getSymb(char* name) {
-    size_t idx = 0;
-    char** arr = symbols.data;
-    while(idx < symbols.len) {
-        if(strcmp(name, arr[idx]) == 0) {
-            break;
-        }
-        idx++;
-    }
-    if(idx == symbols.len) {
+    size_t idx = (uintptr_t)lv_tbl_get(&symbolIds, name);
+    if(idx != 0) {
+        idx--;
+    } else {
         //make a new symbol for this name
         size_t len = strlen(name) + 1;
         char* str = lv_alloc(len);
         memcpy(str, name, len);
+        idx = symbols.len;
         lv_buf_push(&symbols, &str);
+        lv_tbl_put(&symbolIds, str, (void*)(uintptr_t)(idx + 1));
+        symbolBytes += len;
     }
-    TextBufferObj res = { .type = OPT_SYMB, .symbIdx = idx };
-    return res;
+    return LV_BOXED(OPT_SYMB, idx);
 }
 
-//calculate the number of decimal digits
-//in practice the index is usually < 10
-static size_t length(int number) {
+TextBufferObj lv_tb_newBigInt(uint64_t integer) {
 
-    size_t len = 1;
-    while((number /= 10) != 0)
-        len++;
-    return len;
+    LvBigInt* res = lv_alloc(sizeof(LvBigInt));
+    res->refCount = 0;
+    res->value = integer;
+    return lv_tb_box(LV_TAG_BIG_INT, res);
 }
 
-LvString* lv_tb_getString(TextBufferObj* obj) {
+char* lv_tb_newString(TextBufferObj* res, size_t len) {
 
-    LvString* res;
-    switch(obj->type) {
-        case OPT_UNDEFINED: {
-            static char str[] = "<undefined>";
-            res = lv_alloc(sizeof(LvString) + sizeof(str));
-            res->refCount = 0;
-            res->len = sizeof(str) - 1;
-            strcpy(res->value, str);
-            return res;
-        }
-        case OPT_STRING: {
-            res = obj->str;
-            return res;
+    if(len <= LV_SHORT_STR_CAP) {
+        //the payload is cleared, which terminates the characters
+        *res = LV_BOXED(OPT_SHORT_STR, (uint64_t)len << LV_SHORT_LEN_SHIFT);
+        return LV_SHORT_CHARS(res);
+    }
+    LvString* str = lv_alloc(sizeof(LvString) + len + 1);
+    str->refCount = 0;
+    str->len = len;
+    str->hash.source = LV_HASH_NONE;
+    str->value[len] = '\0';
+    *res = lv_tb_box(OPT_STRING, str);
+    return str->value;
+}
+
+LvString* lv_tb_flatten(LvRope* rope) {
+
+    if(rope->flat)
+        return rope->flat;
+    LvString* str = lv_alloc(sizeof(LvString) + rope->len + 1);
+    str->refCount = 1;
+    str->len = rope->len;
+    str->hash.source = LV_HASH_NONE;
+    str->value[rope->len] = '\0';
+    //copy the pieces from last to first, following right halves
+    //and saving left halves for later. Ropes built by appending
+    //lean left, so few halves are saved at a time.
+    DynBuffer pending;
+    lv_buf_init(&pending, sizeof(TextBufferObj*));
+    size_t pos = rope->len;
+    TextBufferObj* piece = &rope->left;
+    lv_buf_push(&pending, &piece);
+    piece = &rope->right;
+    for(;;) {
+        if(LV_TYPE(piece) == OPT_ROPE && !LV_ROPE(piece)->flat) {
+            TextBufferObj* left = &LV_ROPE(piece)->left;
+            lv_buf_push(&pending, &left);
+            piece = &LV_ROPE(piece)->right;
+            continue;
         }
-        case OPT_NUMBER: {
-            //because rather nontrivial to find the length of a
-            //floating-point value before putting it into a string,
-            //we first call snprintf with an empty buffer. Then, we take
-            //the number of characters printed by snprintf and allocate
-            //the buffer to that length (plus 1 for the terminator).
-            int len = snprintf(NULL, 0, "%g", obj->number);
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            snprintf(res->value, len + 1, "%g", obj->number);
-            res->refCount = 0;
-            res->len = len;
-            return res;
+        size_t len = LV_STR_LEN(piece);
+        pos -= len;
+        memcpy(str->value + pos, LV_STR_CHARS(piece), len);
+        if(pending.len == 0)
+            break;
+        lv_buf_pop(&pending, &piece);
+    }
+    assert(pos == 0);
+    lv_free(pending.data);
+    //the halves are no longer needed
+    lv_expr_cleanup(&rope->left, 1);
+    lv_expr_cleanup(&rope->right, 1);
+    rope->left = LV_UNDEFINED;
+    rope->right = LV_UNDEFINED;
+    rope->flat = str;
+    return str;
+}
+
+char* lv_tb_viewValue(LvStrView* view) {
+
+    if(view->value + view->len == view->parent->value + view->parent->len)
+        return view->value;
+    if(!view->flat) {
+        LvString* str = lv_alloc(sizeof(LvString) + view->len + 1);
+        str->refCount = 1;
+        str->len = view->len;
+        str->hash.source = LV_HASH_NONE;
+        memcpy(str->value, view->value, view->len);
+        str->value[view->len] = '\0';
+        view->flat = str;
+    }
+    return view->flat->value;
+}
+
+void lv_tb_substring(TextBufferObj* str, size_t start, size_t end, TextBufferObj* res) {
+
+    size_t len = end - start;
+    LvString* parent;
+    char* value;
+    switch(LV_TYPE(str)) {
+        case OPT_STRING:
+            parent = LV_STR(str);
+            value = parent->value + start;
+            break;
+        case OPT_ROPE:
+            parent = lv_tb_flatten(LV_ROPE(str));
+            value = parent->value + start;
+            break;
+        case OPT_STR_VIEW:
+            parent = LV_SVIEW(str)->parent;
+            value = LV_SVIEW(str)->value + start;
+            break;
+        default:
+            parent = NULL;
+            value = LV_STR_VALUE(str) + start;
+            break;
+    }
+    if(!parent || len < LV_VIEW_MIN_LEN || len < parent->len / LV_VIEW_MAX_WASTE) {
+        memcpy(lv_tb_newString(res, len), value, len);
+        return;
+    }
+    LvStrView* view = lv_alloc(sizeof(LvStrView));
+    view->refCount = 0;
+    view->len = len;
+    view->value = value;
+    view->parent = parent;
+    view->flat = NULL;
+    parent->refCount++;
+    *res = lv_tb_box(OPT_STR_VIEW, view);
+}
+
+/**
+ * Builds a string by appending to it, growing the string
+ * geometrically so each character is copied a constant
+ * number of times.
+ */
+typedef struct StrBuilder {
+    LvString* str;  //the characters so far, not yet terminated
+    size_t cap;     //room for characters, including the terminator
+} StrBuilder;
+
+static void sbInit(StrBuilder* sb) {
+
+    #define INIT_BUILDER_CAP 32
+    sb->cap = INIT_BUILDER_CAP;
+    sb->str = lv_alloc(sizeof(LvString) + sb->cap);
+    sb->str->refCount = 0;
+    sb->str->len = 0;
+    #undef INIT_BUILDER_CAP
+}
+
+/** Makes room for len more characters, and returns where they go. */
+static char* sbReserve(StrBuilder* sb, size_t len) {
+
+    size_t needed = sb->str->len + len + 1;
+    if(needed > sb->cap) {
+        while(sb->cap < needed)
+            sb->cap *= 2;
+        sb->str = lv_realloc(sb->str, sizeof(LvString) + sb->cap);
+    }
+    return sb->str->value + sb->str->len;
+}
+
+static void sbAppend(StrBuilder* sb, const char* chars, size_t len) {
+
+    memcpy(sbReserve(sb, len), chars, len);
+    sb->str->len += len;
+}
+
+static void sbText(StrBuilder* sb, const char* text) {
+
+    sbAppend(sb, text, strlen(text));
+}
+
+/** Appends the decimal digits of the given value. */
+static void sbUnsigned(StrBuilder* sb, uint64_t value) {
+
+    char digits[20];
+    char* start = digits + sizeof(digits);
+    do {
+        *--start = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    sbAppend(sb, start, digits + sizeof(digits) - start);
+}
+
+/** Appends the given number as printf's %g would. */
+static void sbNumber(StrBuilder* sb, double number) {
+
+    //%g prints integers below a million without an exponent
+    if(fabs(number) < 1e6 && number == (int64_t)number && !(number == 0 && signbit(number))) {
+        if(number < 0) {
+            sbAppend(sb, "-", 1);
+            number = -number;
         }
+        sbUnsigned(sb, (uint64_t)number);
+        return;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%g", number);
+    sbAppend(sb, buf, len);
+}
+
+/** Terminates the string and returns it, with a refCount of zero. */
+static LvString* sbFinish(StrBuilder* sb) {
+
+    LvString* res = sb->str;
+    if(sb->cap > res->len + 1)
+        res = lv_realloc(res, sizeof(LvString) + res->len + 1);
+    res->value[res->len] = '\0';
+    res->hash.source = LV_HASH_NONE;
+    return res;
+}
+
+/** Appends the string representation of the given object. */
+static void render(StrBuilder* sb, TextBufferObj* obj) {
+
+    switch(LV_TYPE(obj)) {
+        case OPT_UNDEFINED:
+            sbText(sb, "<undefined>");
+            break;
+        case OPT_STRING:
+        case OPT_ROPE:
+        case OPT_STR_VIEW:
+        case OPT_SHORT_STR:
+            sbAppend(sb, LV_STR_CHARS(obj), LV_STR_LEN(obj));
+            break;
+        case OPT_NUMBER:
+            sbNumber(sb, obj->number);
+            break;
         case OPT_INTEGER: {
-            //get the sign bit
-            bool negative = obj->integer >> 63;
-            //get the magnitude of the value
-            uint64_t value = negative ? (-obj->integer) : obj->integer;
-            //get the length (+1 for minus sign)
-            size_t len = snprintf(NULL, 0, "%"PRIu64, value);
-            res = lv_alloc(sizeof(LvString) + negative + len + 1);
-            res->refCount = 0;
-            res->len = negative + len;
-            if(negative) {
-                res->value[0] = '-';
+            //integers are signed
+            uint64_t integer = LV_INTEGER(obj);
+            if(integer >> 63) {
+                sbAppend(sb, "-", 1);
+                sbUnsigned(sb, -integer);
+            } else {
+                sbUnsigned(sb, integer);
             }
-            snprintf(res->value + negative, len + 1, "%"PRIu64, value);
-            return res;
-        }
-        case OPT_SYMB: {
-            char* val = *(char**)lv_buf_get(&symbols, obj->symbIdx);
-            size_t len = strlen(val);
-            res = lv_alloc(sizeof(LvString) + len + 2);
-            res->refCount = 0;
-            res->len = len + 1;
-            res->value[0] = '.';
-            memcpy(res->value + 1, val, len + 1);
-            return res;
-        }
-        case OPT_TAIL:
-        case OPT_FUNCTION:
-        case OPT_FUNCTION_VAL: {
-            size_t len = strlen(obj->func->name);
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            res->len = len;
-            strcpy(res->value, obj->func->name);
-            return res;
+            break;
         }
+        case OPT_SYMB:
+            sbAppend(sb, ".", 1);
+            sbText(sb, *(char**)lv_buf_get(&symbols, LV_SYMB(obj)));
+            break;
+        case OPT_FUNCTION_VAL:
+            sbText(sb, LV_FUNC(obj)->name);
+            break;
         case OPT_CAPTURE: {
-            //func-name[cap1, cap2, ..., capn]
-            size_t len = strlen(obj->capfunc->name) + 1;
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            strcpy(res->value, obj->capfunc->name);
-            res->value[len - 1] = '[';
-            res->value[len] = '\0';
-            for(int i = 0; i < obj->capfunc->captureCount; i++) {
-                LvString* tmp = lv_tb_getString(&obj->capture->value[i]);
-                len += tmp->len + 1;
-                res = lv_realloc(res, sizeof(LvString) + len + 1);
-                strcat(res->value, tmp->value);
-                res->value[len - 1] = ',';
-                res->value[len] = '\0';
-                if(tmp->refCount == 0)
-                    lv_free(tmp);
+            //func-name[cap1,cap2,...,capn]
+            CaptureObj* capture = LV_CAPTURE(obj);
+            sbText(sb, capture->func->name);
+            sbAppend(sb, "[", 1);
+            for(int i = 0; i < capture->func->captureCount; i++) {
+                render(sb, &capture->value[i]);
+                sbAppend(sb, ",", 1);
             }
-            res->value[len - 1] = ']';
-            res->len = len;
-            return res;
+            //replace the last separator
+            sb->str->value[sb->str->len - 1] = ']';
+            break;
         }
-        case OPT_VECT: {
-            //handle Nil vect separately
-            if(obj->vect->len == 0) {
-                static char str[] = "{ }";
-                res = lv_alloc(sizeof(LvString) + sizeof(str));
-                res->refCount = 0;
-                res->len = sizeof(str) - 1;
-                memcpy(res->value, str, sizeof(str));
-                return res;
+        case OPT_VECT:
+        case OPT_VECT_TREE:
+        case OPT_VECT_VIEW: {
+            //{ val1, val2, ..., valn }
+            if(LV_VECT_LEN(obj) == 0) {
+                sbText(sb, "{ }");
+                break;
             }
-            //[ val1, val2, ..., valn ]
-            size_t len = 2;
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            res->value[0] = '{';
-            res->value[1] = ' ';
-            res->value[2] = '\0';
-            //concatenate values
-            for(size_t i = 0; i < obj->vect->len; i++) {
-                LvString* tmp = lv_tb_getString(&obj->vect->data[i]);
-                len += tmp->len + 2;
-                res = lv_realloc(res, sizeof(LvString) + len + 1);
-                strcat(res->value, tmp->value);
-                res->value[len - 2] = ',';
-                res->value[len - 1] = ' ';
-                res->value[len] = '\0';
-                if(tmp->refCount == 0)
-                    lv_free(tmp);
+            sbAppend(sb, "{ ", 2);
+            LvVectIter it;
+            lv_vec_iter(&it, obj, 0);
+            for(size_t i = 0; i < LV_VECT_LEN(obj); i++) {
+                render(sb, lv_vec_next(&it));
+                sbAppend(sb, ", ", 2);
             }
-            res->value[len - 2] = ' ';
-            res->value[len - 1] = '}';
-            res->len = len;
-            return res;
+            sb->str->value[sb->str->len - 2] = ' ';
+            sb->str->value[sb->str->len - 1] = '}';
+            break;
         }
-        case OPT_MAP: {
-            if(obj->map->len == 0) {
-                static char str[] = "{ }";
-                res = lv_alloc(sizeof(LvString) + sizeof(str));
-                res->refCount = 0;
-                res->len = sizeof(str) - 1;
-                memcpy(res->value, str, sizeof(str));
-                return res;
+        case OPT_MAP:
+        case OPT_MAP_TRIE: {
+            //{ key1 => val1, ..., keyn => valn }
+            if(LV_MAP_LEN(obj) == 0) {
+                sbText(sb, "{ }");
+                break;
             }
-            size_t len = 2;
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            res->value[0] = '{';
-            res->value[1] = ' ';
-            res->value[2] = '\0';
-            //concatenate keys and values
-            for(size_t i = 0; i < obj->map->len; i++) {
-                LvString* tmp = lv_tb_getString(&obj->map->data[i].key);
-                len += tmp->len + 4;
-                res = lv_realloc(res, sizeof(LvString) + len + 1);
-                strcat(res->value, tmp->value);
-                res->value[len - 4] = ' ';
-                res->value[len - 3] = '=';
-                res->value[len - 2] = '>';
-                res->value[len - 1] = ' ';
-                res->value[len] = '\0';
-                if(tmp->refCount == 0)
-                    lv_free(tmp);
-                tmp = lv_tb_getString(&obj->map->data[i].value);
-                len += tmp->len + 2;
-                res = lv_realloc(res, sizeof(LvString) + len + 1);
-                strcat(res->value, tmp->value);
-                res->value[len - 2] = ',';
-                res->value[len - 1] = ' ';
-                res->value[len] = '\0';
-                if(tmp->refCount == 0)
-                    lv_free(tmp);
+            sbAppend(sb, "{ ", 2);
+            LvMapIter it;
+            lv_map_iter(&it, obj);
+            for(size_t i = 0; i < LV_MAP_LEN(obj); i++) {
+                LvMapNode* node = lv_map_next(&it);
+                render(sb, &node->key);
+                sbAppend(sb, " => ", 4);
+                render(sb, &node->value);
+                sbAppend(sb, ", ", 2);
             }
-            res->value[len - 2] = ' ';
-            res->value[len - 1] = '}';
-            res->len = len;
-            return res;
-        }
-        //not called outside of debug mode
-        case OPT_PARAM: {
-            static char str[] = "param ";
-            size_t len = length(obj->param);
-            len += sizeof(str) - 1;
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            res->len = len;
-            strcpy(res->value, str);
-            sprintf(res->value + sizeof(str) - 1, "%d", obj->param);
-            return res;
-        }
-        case OPT_PUT_PARAM: {
-            static char str[] = "put ";
-            size_t len = length(obj->param);
-            len += sizeof(str) - 1;
-            res = lv_alloc(sizeof(LvString) + len + 1);
-            res->refCount = 0;
-            res->len = len;
-            strcpy(res->value, str);
-            sprintf(res->value + sizeof(str) - 1, "%d", obj->param);
-            return res;
+            sb->str->value[sb->str->len - 2] = ' ';
+            sb->str->value[sb->str->len - 1] = '}';
+            break;
         }
+        default:
+            sbText(sb, "<internal operator>");
+    }
+}
+
+/** Appends a description of the given instruction. */
+static void renderInst(StrBuilder* sb, LvInst* inst) {
+
+    char buf[64];
+    switch(inst->type) {
+        case OPT_CONSTANT:
+            render(sb, &TEXT_CONSTANTS[inst->constant]);
+            break;
+        case OPT_UNDEFINED:
+            sbText(sb, "<undefined>");
+            break;
+        case OPT_ADD:
+        case OPT_SUB:
+        case OPT_MUL:
+        case OPT_DIV:
+        case OPT_IDIV:
+        case OPT_REM:
+        case OPT_EQ:
+        case OPT_LT:
+        case OPT_GT:
+        case OPT_LE:
+        case OPT_GE:
+        case OPT_TAIL:
+        case OPT_FUNCTION:
+        case OPT_FUNCTION_VAL:
+            sbText(sb, inst->func->name);
+            break;
+        case OPT_PARAM:
+            snprintf(buf, sizeof(buf), "param %d", inst->param);
+            sbText(sb, buf);
+            break;
+        case OPT_PUT_PARAM:
+            snprintf(buf, sizeof(buf), "put %d", inst->param);
+            sbText(sb, buf);
+            break;
+        case OPT_MOVE_PARAM:
+            snprintf(buf, sizeof(buf), "move %d", inst->param);
+            sbText(sb, buf);
+            break;
         case OPT_MAKE_VECT:
         case OPT_MAKE_MAP:
-        case OPT_FUNC_CALL2: {
-            #define LEN sizeof(" CALL")
-            size_t len = length(obj->callArity);
-            len += LEN - 1;
-            res = lv_alloc(sizeof(LvString) + len + LEN);
-            res->refCount = 0;
-            res->len = len;
-            sprintf(res->value, "%d", obj->callArity);
-            strcat(res->value, obj->type == OPT_MAKE_VECT ? " VECT"
-                : obj->type == OPT_MAKE_MAP ? " MAT " : " CAL2");
-            return res;
-            #undef LEN
-        }
-        case OPT_FUNC_CAP: {
-            static char str[] = "CAP";
-            res = lv_alloc(sizeof(LvString) + sizeof(str));
-            res->refCount = 0;
-            res->len = sizeof(str) - 1;
-            strcpy(res->value, str);
-            return res;
-        }
-        case OPT_RETURN: {
-            static char str[] = "return";
-            res = lv_alloc(sizeof(LvString) + sizeof(str));
-            res->refCount = 0;
-            res->len = sizeof(str) - 1;
-            strcpy(res->value, str);
-            return res;
-        }
-        case OPT_BEQZ: {
-            static char str[] = "beqz ";
-            size_t len = length(obj->branchAddr) + sizeof(str) - 1;
-            res = lv_alloc(sizeof(LvString) + len + sizeof(str));
-            res->refCount = 0;
-            res->len = len;
-            strcpy(res->value, str);
-            sprintf(res->value + sizeof(str) - 1, "%d", obj->branchAddr);
-            return res;
-        }
-        default: {
-            static char str[] = "<internal operator>";
-            res = lv_alloc(sizeof(LvString) + sizeof(str));
-            res->refCount = 0;
-            res->len = sizeof(str) - 1;
-            strcpy(res->value, str);
-            return res;
-        }
+        case OPT_FUNC_CALL2:
+        case OPT_TAIL_CALL2:
+            snprintf(buf, sizeof(buf), "%d%s", inst->callArity,
+                inst->type == OPT_MAKE_VECT ? " VECT"
+                : inst->type == OPT_MAKE_MAP ? " MAT "
+                : inst->type == OPT_FUNC_CALL2 ? " CAL2" : " TCL2");
+            sbText(sb, buf);
+            break;
+        case OPT_SWITCH:
+            snprintf(buf, sizeof(buf), "switch param %d, %d cases", inst->switchParam, inst->caseCount);
+            sbText(sb, buf);
+            break;
+        case OPT_FUNC_CAP:
+            sbText(sb, "CAP");
+            break;
+        case OPT_RETURN:
+            sbText(sb, "return");
+            break;
+        case OPT_BEQZ:
+            snprintf(buf, sizeof(buf), "beqz %d", inst->branchAddr);
+            sbText(sb, buf);
+            break;
+        default:
+            sbText(sb, "<internal operator>");
     }
 }
 
+LvString* lv_tb_getString(TextBufferObj* obj) {
+
+    //heap strings and flattened ropes are returned as they are
+    if(LV_TYPE(obj) == OPT_STRING)
+        return LV_STR(obj);
+    if(LV_TYPE(obj) == OPT_ROPE)
+        return lv_tb_flatten(LV_ROPE(obj));
+    StrBuilder sb;
+    sbInit(&sb);
+    render(&sb, obj);
+    return sbFinish(&sb);
+}
+
+LvString* lv_tb_getInstString(LvInst* inst) {
+
+    StrBuilder sb;
+    sbInit(&sb);
+    renderInst(&sb, inst);
+    return sbFinish(&sb);
+}
+
 static void rollback(Operator* decl, size_t top) {
 
     lv_op_removeOperator(decl->name,
         decl->fixing == FIX_PRE ? FNS_PREFIX : FNS_INFIX);
     //reset the text buffer
-    for(size_t i = top; i < textBufferTop; i++) {
-        if(TEXT_BUFFER[i].type == OPT_STRING)
-            lv_free(TEXT_BUFFER[i].str);
-    }
-    textBufferTop = top;
+    setTextTop(top);
 }
 
 static bool isExprEnd(Token* head) {
@@ -404,19 +821,190 @@ Token* lv_tb_defineFunction(Token* head, Operator* scope, Operator** res) {
     return head;
 }
 
+/** A body of a function and its condition (if any). */
+typedef struct FuncPiece {
+    LvInst* body;
+    size_t blen;
+    LvInst* cond;
+    size_t clen;
+} FuncPiece;
+
+/**
+ * Frees the parsed pieces (and the partial piece, if not NULL), rolls
+ * back the function, and returns the erroring token.
+ */
+static Token* pieceError(Operator* decl, size_t top, DynBuffer* pieces, FuncPiece* partial, Token* err) {
+
+    FuncPiece* p = pieces->data;
+    for(size_t i = 0; i < pieces->len; i++) {
+        lv_expr_free(p[i].body, p[i].blen);
+        if(p[i].cond)
+            lv_expr_free(p[i].cond, p[i].clen);
+    }
+    lv_free(pieces->data);
+    if(partial) {
+        lv_expr_free(partial->body, partial->blen);
+        if(partial->cond)
+            lv_expr_free(partial->cond, partial->clen);
+    }
+    rollback(decl, top);
+    return err;
+}
+
+/**
+ * Returns whether the condition code at the top of the text buffer,
+ * starting at bgn, is constant, and sets its truth value.
+ * A condition is constant if it is a literal or a call to a function
+ * (such as otherwise) that returns a literal.
+ */
+static bool isConstCondition(size_t bgn, bool* truth) {
+
+    if(textBufferTop - bgn != 1)
+        return false;
+    LvInst* cond = &TEXT_BUFFER[bgn];
+    if(cond->type == OPT_FUNCTION
+        && cond->func->type == FUN_FUNCTION
+        && cond->func->arity == 0
+        && cond->func->locals == 0
+        && TEXT_BUFFER[cond->func->textOffset + 1].type == OPT_RETURN) {
+        cond = &TEXT_BUFFER[cond->func->textOffset];
+    }
+    if(cond->type != OPT_CONSTANT)
+        return false;
+    TextBufferObj* value = &TEXT_CONSTANTS[cond->constant];
+    switch(LV_TYPE(value)) {
+        case OPT_NUMBER:
+        case OPT_INTEGER:
+        case OPT_STRING:
+        case OPT_SHORT_STR:
+            *truth = lv_blt_toBool(value);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * If the condition has the form `param = literal` (or `literal = param`)
+ * using the built in equality, returns the index of the param.
+ * Otherwise returns -1.
+ */
+static int getSwitchParam(FuncPiece* piece) {
+
+    if(!piece->cond || piece->clen != 4)
+        return -1;
+    LvInst* cond = piece->cond + 1;
+    if(cond[2].type != OPT_FUNCTION || lv_blt_getQuickOp(cond[2].func) != OPT_EQ)
+        return -1;
+    LvInst* param = cond[0].type == OPT_PARAM ? &cond[0] : &cond[1];
+    LvInst* lit = cond[0].type == OPT_PARAM ? &cond[1] : &cond[0];
+    if(param->type != OPT_PARAM || lit->type != OPT_CONSTANT)
+        return -1;
+    OpType type = LV_TYPE(&lit->value);
+    if(type != OPT_NUMBER && type != OPT_INTEGER && type != OPT_STRING)
+        return -1;
+    return param->param;
+}
+
+//minimum number of consecutive `param = literal` conditions for a switch
+#define MIN_SWITCH_CASES 3
+
+/**
+ * Adds the code for the pieces of a function to the text buffer.
+ * Each conditional piece is laid out as
+ *   cond beqz(next cond) body return
+ * and a conditional function ends with a default case returning
+ * undefined. Constant conditions are removed along with any pieces
+ * that cannot be reached, and runs of `param = literal` conditions
+ * on the same param are preceded by a switch.
+ */
+static void emitPieces(FuncPiece* pieces, size_t count, bool conditional) {
+
+    size_t prevBranch = 0;  //the previous branch to patch, if any
+    bool reachable = true;  //whether the next piece may be reached
+    int switchParams[count];
+    for(size_t i = 0; i < count; i++)
+        switchParams[i] = getSwitchParam(&pieces[i]);
+    for(size_t i = 0; i < count; i++) {
+        FuncPiece* piece = &pieces[i];
+        if(!reachable) {
+            lv_expr_free(piece->body, piece->blen);
+            if(piece->cond)
+                lv_expr_free(piece->cond, piece->clen);
+            continue;
+        }
+        if(piece->cond) {
+            if(prevBranch) {
+                TEXT_BUFFER[prevBranch].branchAddr = textBufferTop - prevBranch;
+                prevBranch = 0;
+            }
+            //only start a switch at the beginning of a run of cases
+            int param = switchParams[i];
+            if(param >= 0 && (i == 0 || switchParams[i - 1] != param)) {
+                int cases = 1;
+                while(i + cases < count && switchParams[i + cases] == param)
+                    cases++;
+                if(cases >= MIN_SWITCH_CASES) {
+                    LvInst sw;
+                    sw.type = OPT_SWITCH;
+                    sw.switchParam = param;
+                    sw.caseCount = cases;
+                    pushText(&sw, 1);
+                }
+            }
+            size_t condBgn = textBufferTop;
+            pushText(piece->cond + 1, piece->clen - 1);
+            lv_free(piece->cond);
+            bool truth;
+            if(isConstCondition(condBgn, &truth)) {
+                setTextTop(condBgn);
+                if(!truth) {
+                    //the body is never run
+                    lv_expr_free(piece->body, piece->blen);
+                    continue;
+                }
+                //the body is always run
+                reachable = false;
+            } else {
+                LvInst branch;
+                branch.type = OPT_BEQZ;
+                branch.branchAddr = 0;
+                pushText(&branch, 1);
+                prevBranch = textBufferTop - 1;
+            }
+        } else {
+            reachable = false;
+        }
+        size_t bodyBgn = textBufferTop;
+        pushText(piece->body + 1, piece->blen - 1);
+        lv_free(piece->body);
+        markTailCall();
+        markLastUses(bodyBgn, textBufferTop);
+        LvInst ret = { .type = OPT_RETURN };
+        pushText(&ret, 1);
+    }
+    if(conditional && reachable) {
+        if(prevBranch) {
+            //set the last conditional branch
+            TEXT_BUFFER[prevBranch].branchAddr = textBufferTop - prevBranch;
+        }
+        //push the default case (return undefined)
+        LvInst nan[2];
+        nan[0].type = OPT_UNDEFINED;
+        nan[1].type = OPT_RETURN;
+        pushText(nan, 2);
+    }
+}
+
 static Token* parseFunctionLocals(Operator* decl, size_t* bgn);
 
 Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
 
     Token* beginningToken = head;
+    //count folded instructions of this function only
+    size_t foldStart = foldedInsts;
     //save the top so we can roll back if necessary
     size_t top = textBufferTop;
-    bool setbgn = false;
-    bool conditional = false;
-    //the index of the previous conditional branch
-    //the value requires modification if there are
-    //nested functions within this piecewise function
-    size_t prevCondBranch = 0;
     if(isExprEnd(head)) {
         //no empty bodies allowed
         LV_EXPR_ERROR = XPE_MISSING_BODY;
@@ -449,131 +1037,65 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
         decl->builtin = func;
         return head;
     }
-    //function begin, often the same as top, but
-    //different if there are nested functions.
-    //local defs are parsed before this function
-    //so fbgn is first set there
-    size_t fbgn;
-    //parse function local initializers (if any)
-    Token* err = parseFunctionLocals(decl, &fbgn);
-    if(LV_EXPR_ERROR) {
-        rollback(decl, top);
-        return err;
-    }
-    if(decl->locals > 0) {
-        //set the branch addr to the top for local jump
-        setbgn = true;
-        prevCondBranch = textBufferTop - 1;
-    }
+    //parse the bodies and conditions before adding any code, so that
+    //nested functions are defined first and the code of this
+    //function is contiguous
+    DynBuffer pieces;   //of FuncPiece
+    lv_buf_init(&pieces, sizeof(FuncPiece));
+    bool conditional = false;
     while(!isExprEnd(head)) {
-        TextBufferObj* text;
-        size_t len;
+        FuncPiece piece = { NULL, 0, NULL, 0 };
         Token* old = head;
-        head = lv_expr_parseExpr(head, decl, &text, &len);
+        head = lv_expr_parseExpr(head, decl, &piece.body, &piece.blen);
         if(LV_EXPR_ERROR) {
-            rollback(decl, top);
-            return head ? head : old;
+            return pieceError(decl, top, &pieces, NULL, head ? head : old);
         }
-        TextBufferObj end;
-        if(head) {
-            if(lv_tkn_cmp(head, "=>") == 0) {
-                //can't have two bodies
-                LV_EXPR_ERROR = XPE_UNEXPECT_TOKEN;
-                rollback(decl, top);
-                lv_expr_free(text, len);
-                return head;
-            } else if(head->start[0] == ';') {
-                conditional = true;
-                if(!head->next) { //a body is required
-                    LV_EXPR_ERROR = XPE_MISSING_BODY;
-                    rollback(decl, top);
-                    lv_expr_free(text, len);
-                    return head;
-                }
-                head = head->next;
-                //it's a conditional
-                TextBufferObj* cond;
-                size_t clen;
-                Token* old = head;
-                head = lv_expr_parseExpr(head, decl, &cond, &clen);
-                if(LV_EXPR_ERROR) {
-                    rollback(decl, top);
-                    lv_expr_free(text, len);
-                    return head ? head : old;
-                }
-                if(prevCondBranch) {
-                    //set the previous beanch statement's relative address.
-                    //The beginning of the current condition will be placed
-                    //at textBufferTop.
-                    TEXT_BUFFER[prevCondBranch].branchAddr = textBufferTop - prevCondBranch;
-                }
-                //set the branch to the next condition, which usually
-                //occurs at (len + 1) after the branch instruction,
-                //but may be later becuase of nested function definitions.
-                end.type = OPT_BEQZ;
-                end.branchAddr = 0; //sentinel, will update later
-                if(!setbgn) {
-                    //only set fbgn on first run
-                    fbgn = textBufferTop;
-                    setbgn = true;
-                }
-                pushText(cond + 1, clen - 1);
-                pushText(&end, 1);
-                prevCondBranch = textBufferTop - 1;
-                //another function body?
-                if(head) {
-                    if(lv_tkn_cmp(head, "=>") == 0) {
-                        if(isExprEnd(head->next)) {
-                            LV_EXPR_ERROR = XPE_MISSING_BODY;
-                            rollback(decl, top);
-                            lv_expr_free(text, len);
-                            lv_expr_free(cond, clen);
-                            return head;
-                        }
-                        head = head->next;
-                    } else if(head->start[0] == ';') {
-                        LV_EXPR_ERROR = XPE_UNEXPECT_TOKEN;
-                        rollback(decl, top);
-                        lv_expr_free(text, len);
-                        lv_expr_free(cond, clen);
-                        return head;
+        if(head && lv_tkn_cmp(head, "=>") == 0) {
+            //can't have two bodies
+            LV_EXPR_ERROR = XPE_UNEXPECT_TOKEN;
+            return pieceError(decl, top, &pieces, &piece, head);
+        } else if(head && head->start[0] == ';') {
+            conditional = true;
+            if(!head->next) { //a body is required
+                LV_EXPR_ERROR = XPE_MISSING_BODY;
+                return pieceError(decl, top, &pieces, &piece, head);
+            }
+            head = head->next;
+            //it's a conditional
+            old = head;
+            head = lv_expr_parseExpr(head, decl, &piece.cond, &piece.clen);
+            if(LV_EXPR_ERROR) {
+                return pieceError(decl, top, &pieces, &piece, head ? head : old);
+            }
+            //another function body?
+            if(head) {
+                if(lv_tkn_cmp(head, "=>") == 0) {
+                    if(isExprEnd(head->next)) {
+                        LV_EXPR_ERROR = XPE_MISSING_BODY;
+                        return pieceError(decl, top, &pieces, &piece, head);
                     }
+                    head = head->next;
+                } else if(head->start[0] == ';') {
+                    LV_EXPR_ERROR = XPE_UNEXPECT_TOKEN;
+                    return pieceError(decl, top, &pieces, &piece, head);
                 }
-                lv_free(cond);
-            } else if(prevCondBranch) {
-                //set locals jump to the first instruction of the body
-                TEXT_BUFFER[prevCondBranch].branchAddr = textBufferTop - prevCondBranch;
             }
-        } else if(conditional) {
+        } else if(!head && conditional) {
             //function did not have a condition for one of its bodies
             LV_EXPR_ERROR = XPE_MISSING_BODY;
-            rollback(decl, top);
-            lv_expr_free(text, len);
-            return beginningToken;
-        } else if(prevCondBranch) {
-            //set locals jump to the first instruction of the body
-            TEXT_BUFFER[prevCondBranch].branchAddr = textBufferTop - prevCondBranch;
-        }
-        if(!setbgn) {
-            fbgn = textBufferTop;
-            setbgn = true;
+            return pieceError(decl, top, &pieces, &piece, beginningToken);
         }
-        pushText(text + 1, len - 1);
-        end.type = OPT_RETURN;
-        pushText(&end, 1);
-        lv_free(text);
+        lv_buf_push(&pieces, &piece);
     }
-    if(conditional) {
-        if(prevCondBranch) {
-            //set the last conditional branch
-            TEXT_BUFFER[prevCondBranch].branchAddr = textBufferTop - prevCondBranch;
-        }
-        //push the default case (return undefined)
-        TextBufferObj nan[2];
-        nan[0].type = OPT_UNDEFINED;
-        nan[1].type = OPT_RETURN;
-        pushText(nan, 2);
+    //parse function local initializers (if any)
+    //and place them at the start of the function
+    size_t fbgn = textBufferTop;
+    Token* err = parseFunctionLocals(decl, &fbgn);
+    if(LV_EXPR_ERROR) {
+        return pieceError(decl, top, &pieces, NULL, err);
     }
+    emitPieces(pieces.data, pieces.len, conditional);
+    lv_free(pieces.data);
     //free param metadata
     for(int i = 0; i < (decl->arity + decl->locals); i++)
         lv_free(decl->params[i].name);
@@ -581,24 +1103,28 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
     //set out param value
     decl->type = FUN_FUNCTION;
     decl->textOffset = fbgn;
+    decl->maxStack = stackDepth(fbgn, textBufferTop);
+    size_t folded = foldedInsts - foldStart;
+    foldedInsts = foldStart;
     if(lv_debug) {
         //print function info
-        printf("Function name=%s, arity=%d, capture=%d, locals=%d, fixing=%c, varargs=%s, offset=%u\n",
+        printf("Function name=%s, arity=%d, capture=%d, locals=%d, fixing=%c, varargs=%s, offset=%u, stack=%d, folded=%lu\n",
             decl->name,
             decl->arity,
             decl->captureCount,
             decl->locals,
             decl->fixing,
             decl->varargs ? "true" : "false",
-            decl->textOffset);
+            decl->textOffset,
+            decl->maxStack,
+            folded);
         for(size_t i = decl->textOffset; i < textBufferTop; i++) {
-            LvString* str = lv_tb_getString(&TEXT_BUFFER[i]);
+            LvString* str = lv_tb_getInstString(&TEXT_BUFFER[i]);
             printf("%lu: type=%d, value=%s\n",
                 i,
                 TEXT_BUFFER[i].type,
                 str->value);
-            if(str->refCount == 0)
-                lv_free(str);
+            lv_free(str);
         }
     }
     return head;
@@ -606,7 +1132,7 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
 
 /**
  * Parses each function local initializer and places the code in sequence
- * before the function proper. The value of the initializer expression
+ * at the start of the function. The value of the initializer expression
  * is placed into the function local positions using the PUT operation.
  * Returns NULL if locals were successfully parsed, the erroring token
  * otherwise.
@@ -619,7 +1145,7 @@ static Token* parseFunctionLocals(Operator* decl, size_t* bgn) {
     }
     //array to store the local initializers
     struct Initializer {
-        TextBufferObj* code;
+        LvInst* code;
         size_t len;
     } initializers[decl->locals];
     int len = decl->arity + decl->locals;
@@ -655,51 +1181,73 @@ static Token* parseFunctionLocals(Operator* decl, size_t* bgn) {
     for(size_t i = 0; i < decl->locals; i++) {
         pushText(initializers[i].code + 1, initializers[i].len - 1);
         lv_free(initializers[i].code);
-        TextBufferObj put = { .type = OPT_PUT_PARAM, .param = i + decl->arity };
+        LvInst put;
+        put.type = OPT_PUT_PARAM;
+        put.param = i + decl->arity;
         pushText(&put, 1);
     }
-    TextBufferObj jump[2] = {
-        { .type = OPT_NUMBER, .number = 0 },
-        { .type = OPT_BEQZ, .branchAddr = 0 }
-    };
-    pushText(jump, 2);
     return NULL;
 }
 
 static size_t startOfTmpExpr;
 
-Token* lv_tb_parseExpr(Token* tokens, Operator* scope, size_t* start, size_t* end) {
+Token* lv_tb_parseExpr(Token* tokens, Operator* scope, Operator* expr) {
 
-    TextBufferObj* tmp;
+    LvInst* tmp;
     size_t tlen;
     Token* ret = lv_expr_parseExpr(tokens, scope, &tmp, &tlen);
     if(LV_EXPR_ERROR) {
         return ret;
     }
     //add expr to buffer and set start of expr
+    //the expression is run like the body of a zero arity function
     startOfTmpExpr = textBufferTop;
+    LvInst retInst = { .type = OPT_RETURN };
     pushText(tmp + 1, tlen - 1);
+    pushText(&retInst, 1);
     lv_free(tmp);
-    *start = startOfTmpExpr;
-    *end = textBufferTop;
+    memset(expr, 0, sizeof(Operator));
+    expr->name = scope->name;
+    expr->type = FUN_FUNCTION;
+    expr->textOffset = startOfTmpExpr;
+    expr->maxStack = stackDepth(startOfTmpExpr, textBufferTop);
     return ret;
 }
 
 void lv_tb_clearExpr(void) {
 
-    lv_expr_cleanup(TEXT_BUFFER + startOfTmpExpr, textBufferTop - startOfTmpExpr);
-    textBufferTop = startOfTmpExpr;
-    startOfTmpExpr = textBufferTop;
+    setTextTop(startOfTmpExpr);
 }
 
 void lv_tb_onStartup(void) {
 
-    TEXT_BUFFER = lv_alloc(INIT_TEXT_BUFFER_LEN * sizeof(TextBufferObj));
-    memset(TEXT_BUFFER, 0, INIT_TEXT_BUFFER_LEN * sizeof(TextBufferObj));
+    TEXT_BUFFER = lv_alloc(INIT_TEXT_BUFFER_LEN * sizeof(LvInst));
+    memset(TEXT_BUFFER, 0, INIT_TEXT_BUFFER_LEN * sizeof(LvInst));
     textBufferLen = INIT_TEXT_BUFFER_LEN;
     textBufferTop = 0;
+#ifdef LV_THREADED_CODE
+    TEXT_THREAD = lv_alloc(INIT_TEXT_BUFFER_LEN * sizeof(void*));
+    decodedTop = 0;
+#endif
+    TEXT_CONSTANTS = lv_alloc(INIT_CONSTANTS_LEN * sizeof(TextBufferObj));
+    constantsLen = INIT_CONSTANTS_LEN;
+    constantsTop = 0;
+    CALL_CACHE = lv_alloc(INIT_CALL_CACHE_LEN * sizeof(CallCache));
+    callCacheLen = INIT_CALL_CACHE_LEN;
+    callCacheTop = 0;
     startOfTmpExpr = 0;
     lv_buf_init(&symbols, sizeof(LvString*));
+    lv_tbl_init(&symbolIds);
+    symbolBytes = 0;
+}
+
+void lv_tb_printStats(void) {
+
+    size_t bytes = symbolBytes
+        + symbols.cap * symbols.dataSize
+        + lv_tbl_memSize(&symbolIds);
+    printf("Symbols: %lu interned, %lu bytes\n",
+        (unsigned long) symbols.len, (unsigned long) bytes);
 }
 
 void lv_tb_onShutdown(void) {
@@ -708,5 +1256,13 @@ void lv_tb_onShutdown(void) {
         lv_free(((char**)symbols.data)[i]);
     }
     lv_free(symbols.data);
-    lv_expr_free(TEXT_BUFFER, textBufferTop);
+    lv_tbl_clear(&symbolIds, NULL);
+    lv_free(symbolIds.table);
+    lv_expr_cleanup(TEXT_CONSTANTS, constantsTop);
+    lv_free(TEXT_CONSTANTS);
+    lv_free(TEXT_BUFFER);
+    lv_free(CALL_CACHE);
+#ifdef LV_THREADED_CODE
+    lv_free(TEXT_THREAD);
+#endif
 }
@@ -4,6 +4,26 @@
 #include "operator_fwd.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <assert.h>
+
+/** How a cached hash code was computed. */
+typedef enum LvHashSource {
+    LV_HASH_NONE,       //not computed yet
+    LV_HASH_INTRINSIC,  //while global:hash was the intrinsic
+    LV_HASH_USER,       //while global:hash was overridden
+} LvHashSource;
+
+/**
+ * The hash code of a string, vect or map. Values do not change once
+ * shared, so the hash is computed once and kept. The hash of a vect
+ * or map depends on the hashes global:hash gives its elements, so it
+ * is only reused while global:hash is the same kind of function.
+ * Values that are modified in place must reset their cached hash.
+ */
+typedef struct LvHashCache {
+    uint64_t value;
+    LvHashSource source;
+} LvHashCache;
 
 /**
  * Lavender's built in string object.
@@ -11,58 +31,357 @@
 struct LvString {
     size_t refCount;
     size_t len;
+    LvHashCache hash;
     char value[];
 };
 
 /**
  * A struct that stores a Lavender value. This may
  * be a number, string, function, etc. These values
- * are stored in the global text buffer.
+ * are stored on the stack, in vects and maps, and in
+ * the constant table of the text buffer.
+ *
+ * Values are NaN-boxed into 8 bytes. A number is stored as itself,
+ * and any other value is stored in the payload of a NaN whose top
+ * 13 bits are set, which no number has as NaNs are made canonical:
+ *
+ *     1111111111111 | 4 bit tag | 47 bit payload
+ *
+ * The tag is the OpType of the value, or LV_TAG_BIG_INT. The payload
+ * holds an integer of up to 47 bits, a symbol index, a short string,
+ * or a pointer shifted right by LV_PTR_SHIFT. Integers that do not fit
+ * are boxed on the heap. Values with a tag of at least OPT_STRING are
+ * dynamic: their payload points to an object starting with its refCount.
+ * Read values with the LV_ macros and make them with the lv_tb_ functions
+ * below rather than through their bits.
  */
 struct TextBufferObj {
-    OpType type;
-    OpType fromType;
     union {
-        double number;
-        uint64_t integer;
-        LvString* str;
-        LvVect* vect;
-        LvMap* map;
+        uint64_t bits;
+        double number;      //the value of a number, read only
+    };
+};
+
+_Static_assert(sizeof(TextBufferObj) == 8, "values must be 8 bytes");
+
+/** The bits set in every boxed value. */
+#define LV_BOX UINT64_C(0xFFF8000000000000)
+
+#define LV_TAG_SHIFT 47
+#define LV_PAYLOAD ((UINT64_C(1) << LV_TAG_SHIFT) - 1)
+
+/** Pointers are at least 4 byte aligned, so 49 bit addresses fit in a payload. */
+#define LV_PTR_SHIFT 2
+
+/** The sign bit of an inline integer. */
+#define LV_INT_SIGN (UINT64_C(1) << (LV_TAG_SHIFT - 1))
+
+/** The boxed value with the given tag and payload. */
+#define LV_BOXED(tag, payload) \
+    ((TextBufferObj){ .bits = LV_BOX | (uint64_t)(tag) << LV_TAG_SHIFT | (payload) })
+
+#define LV_UNDEFINED LV_BOXED(OPT_UNDEFINED, 0)
+#define LV_UNEVALUATED LV_BOXED(OPT_UNEVALUATED, 0)
+
+/** The tag of a value, which is meaningless for numbers. */
+#define LV_TAG(obj) ((int)((obj)->bits >> LV_TAG_SHIFT) & 0xF)
+
+/** Whether the object refers to a refCounted object. */
+#define LV_IS_DYNAMIC(obj) ((obj)->bits >= LV_BOXED(OPT_STRING, 0).bits)
+
+/** Whether the object is an integer stored inline. */
+#define LV_IS_SMALL_INT(obj) \
+    ((obj)->bits >> LV_TAG_SHIFT == LV_BOXED(OPT_INTEGER, 0).bits >> LV_TAG_SHIFT)
+
+/** Whether the integer is small enough to be stored inline. */
+#define LV_FITS_SMALL_INT(integer) ((uint64_t)(integer) + LV_INT_SIGN <= LV_PAYLOAD)
+
+#define LV_PTR(obj) ((void*)(uintptr_t)(((obj)->bits & LV_PAYLOAD) << LV_PTR_SHIFT))
+#define LV_REFCOUNT(obj) ((size_t*)LV_PTR(obj))
+#define LV_STR(obj) ((LvString*)LV_PTR(obj))
+#define LV_ROPE(obj) ((LvRope*)LV_PTR(obj))
+#define LV_SVIEW(obj) ((LvStrView*)LV_PTR(obj))
+#define LV_VECT(obj) ((LvVect*)LV_PTR(obj))
+#define LV_TREE(obj) ((LvVectTree*)LV_PTR(obj))
+#define LV_VVIEW(obj) ((LvVectView*)LV_PTR(obj))
+#define LV_MAP(obj) ((LvMap*)LV_PTR(obj))
+#define LV_TRIE(obj) ((LvMapTrie*)LV_PTR(obj))
+#define LV_CAPTURE(obj) ((CaptureObj*)LV_PTR(obj))
+#define LV_FUNC(obj) ((Operator*)LV_PTR(obj))
+#define LV_SYMB(obj) ((size_t)((obj)->bits & LV_PAYLOAD))
+
+/** The value of an integer object, stored either inline or on the heap. */
+#define LV_INTEGER(obj) \
+    (LV_IS_SMALL_INT(obj) ? (((obj)->bits & LV_PAYLOAD) ^ LV_INT_SIGN) - LV_INT_SIGN \
+    : ((LvBigInt*)LV_PTR(obj))->value)
+
+/**
+ * An integer too large to store inline in a value.
+ */
+struct LvBigInt {
+    size_t refCount;
+    uint64_t value;
+};
+
+/** The OpType of a value. */
+static inline OpType lv_tb_type(const TextBufferObj* obj) {
+    if(obj->bits < LV_BOX)
+        return OPT_NUMBER;
+    int tag = LV_TAG(obj);
+    return tag == LV_TAG_BIG_INT ? OPT_INTEGER : (OpType)tag;
+}
+
+#define LV_TYPE(obj) lv_tb_type(obj)
+
+/** Makes a number value. */
+static inline TextBufferObj lv_tb_number(double number) {
+    TextBufferObj res;
+    res.number = number;
+    if(number != number)
+        res.bits = UINT64_C(0x7FF8000000000000); //the canonical NaN
+    return res;
+}
+
+/**
+ * Makes an integer value. Integers too large to store inline are
+ * allocated with a refCount of zero, like other new values.
+ */
+static inline TextBufferObj lv_tb_integer(uint64_t integer) {
+    if(LV_FITS_SMALL_INT(integer))
+        return LV_BOXED(OPT_INTEGER, integer & LV_PAYLOAD);
+    return lv_tb_newBigInt(integer);
+}
+
+/** Makes a value of the given dynamic type, or a function value. */
+static inline TextBufferObj lv_tb_box(OpType type, const void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    assert(addr % (1 << LV_PTR_SHIFT) == 0 && (addr >> LV_PTR_SHIFT) <= LV_PAYLOAD);
+    return LV_BOXED(type, (uint64_t)addr >> LV_PTR_SHIFT);
+}
+
+/**
+ * The maximum length of a string stored inline. The characters take
+ * the low bytes of the payload followed by a terminator, and the length
+ * takes the three bits above them.
+ */
+#define LV_SHORT_STR_CAP 4
+#define LV_SHORT_LEN_SHIFT 40
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LV_SHORT_STR_OFFSET 3
+#else
+#define LV_SHORT_STR_OFFSET 0
+#endif
+
+/** The characters of a short string, which are terminated. */
+#define LV_SHORT_CHARS(obj) ((char*)(obj) + LV_SHORT_STR_OFFSET)
+#define LV_SHORT_LEN(obj) ((size_t)((obj)->bits >> LV_SHORT_LEN_SHIFT) & 7)
+
+/** Whether the object is a string, stored either inline or on the heap. */
+#define LV_IS_STRING(obj) \
+    (LV_TYPE(obj) == OPT_STRING || LV_TYPE(obj) == OPT_SHORT_STR \
+    || LV_TYPE(obj) == OPT_ROPE || LV_TYPE(obj) == OPT_STR_VIEW)
+
+/**
+ * The (terminated) characters of a string object. Flattens ropes,
+ * and copies the characters of views that need a terminator.
+ */
+#define LV_STR_VALUE(obj) \
+    (LV_TYPE(obj) == OPT_SHORT_STR ? LV_SHORT_CHARS(obj) \
+    : LV_TYPE(obj) == OPT_STRING ? LV_STR(obj)->value \
+    : LV_TYPE(obj) == OPT_ROPE ? lv_tb_flatten(LV_ROPE(obj))->value \
+    : lv_tb_viewValue(LV_SVIEW(obj)))
+
+/**
+ * The characters of a string object, which are not necessarily
+ * terminated. Use this with LV_STR_LEN where possible.
+ */
+#define LV_STR_CHARS(obj) \
+    (LV_TYPE(obj) == OPT_STR_VIEW ? LV_SVIEW(obj)->value : LV_STR_VALUE(obj))
+
+/** The length of a string object. */
+#define LV_STR_LEN(obj) \
+    (LV_TYPE(obj) == OPT_SHORT_STR ? LV_SHORT_LEN(obj) \
+    : LV_TYPE(obj) == OPT_STRING ? LV_STR(obj)->len \
+    : LV_TYPE(obj) == OPT_ROPE ? LV_ROPE(obj)->len \
+    : LV_SVIEW(obj)->len)
+
+/**
+ * An instruction in the text buffer. Instructions are kept apart
+ * from values so that their operands do not make values larger: a
+ * constant instruction pushes a value of the constant table by index.
+ * While an expression is parsed its constants hold their values, which
+ * move to the constant table when the expression is added to the text
+ * buffer.
+ */
+struct LvInst {
+    OpType type : 8;
+    OpType fromType : 8;        //the type of a func call 2 before it was one
+    union {
+        TextBufferObj value;    //the value of a constant being parsed
+        int constant;           //index of a constant's value in TEXT_CONSTANTS
         int param;
-        size_t symbIdx;
         Operator* func;
         struct {
-            CaptureObj* capture;
-            Operator* capfunc;
+            int callArity;
+            int callSite;       //index of a value call's inline cache
         };
-        int callArity;
         int branchAddr;
-        size_t addr;
+        struct {
+            int switchParam;    //param tested by a switch
+            int caseCount;      //number of cases following a switch
+        };
         char literal;
-        size_t* refCount; //aliases (dynamic obj)->refCount
     };
 };
 
+/**
+ * A string formed by concatenating two strings (of any form), which
+ * makes concatenation constant time. The characters are copied into
+ * a single string only when they are needed, and that string then
+ * replaces the two halves.
+ */
+struct LvRope {
+    size_t refCount;
+    size_t len;
+    LvString* flat;         //the characters, or NULL if not yet flattened
+    TextBufferObj left;     //the halves, undefined once flattened
+    TextBufferObj right;
+};
+
+/**
+ * The minimum length of a string built as a rope. Shorter
+ * concatenations are cheaper to copy.
+ */
+#define LV_ROPE_MIN_LEN 256
+
+/** The maximum length of a rope's right piece that is appended to in place. */
+#define LV_ROPE_LEAF_LEN 1024
+
+/**
+ * A string made by slicing a heap string, which shares the characters
+ * of the string it was sliced from (its parent). Views of views share
+ * the characters of the original parent.
+ */
+struct LvStrView {
+    size_t refCount;
+    size_t len;
+    char* value;            //the first character, in the parent
+    LvString* parent;
+    LvString* flat;         //a terminated copy of the characters, or NULL
+};
+
+/**
+ * The minimum length of a string or vect slice made as a view.
+ * Shorter slices are cheaper to copy.
+ */
+#define LV_VIEW_MIN_LEN 32
+
+/**
+ * Slices shorter than 1 / LV_VIEW_MAX_WASTE of their parent are
+ * copied, so that a small view does not keep a large parent alive.
+ */
+#define LV_VIEW_MAX_WASTE 4
+
 /**
  * Dynamically allocated capture arguments.
  * Captures keep a refCount of all the times they
  * are referred to. e.g. the stack and another capture
- * object.
+ * object. Captures of zero arity functions (thunks) hold
+ * one more value after the captured params, which caches
+ * the result of the function once it has been evaluated.
  */
 struct CaptureObj {
     size_t refCount;
+    Operator* func;
     TextBufferObj value[];
 };
 
+/** The number of values in a capture of the given function. */
+#define LV_CAPTURE_LEN(func) \
+    ((func)->captureCount + ((func)->arity == (func)->captureCount))
+
+/** The number of functions remembered by each call site cache. */
+#define LV_CALL_CACHE_WAYS 2
+
+/**
+ * Inline cache for a value call site (func call 2). Each way holds
+ * the type and underlying function of a value that was called from
+ * the site, so later calls of the same function skip type dispatch
+ * and arity checks. Varargs functions are not cached.
+ */
+struct CallCache {
+    struct {
+        OpType type;
+        Operator* func;
+    } ways[LV_CALL_CACHE_WAYS];
+};
+
 /**
  * Vector object.
  */
 struct LvVect {
     size_t refCount;
     size_t len;
+    LvHashCache hash;
     TextBufferObj data[];
 };
 
+/** The maximum number of children of a vect tree node, and of elements of a leaf. */
+#define LV_VECT_BRANCH 32
+
+/**
+ * The minimum length of a vect built as a tree. Shorter
+ * vects are cheaper to copy.
+ */
+#define LV_VECT_TREE_MIN 128
+
+/**
+ * Node of a persistent vect tree (a relaxed radix balanced tree).
+ * The leaves of the tree are flat vects of at most LV_VECT_BRANCH
+ * elements, and all leaves are at the same depth. Nodes and leaves
+ * are shared between trees and never modified once built, so
+ * concatenating and slicing trees copies only the nodes along the
+ * edges. Each child records the number of elements up to its end,
+ * so children need not be full.
+ */
+struct LvVectTree {
+    size_t refCount;
+    size_t len;
+    LvHashCache hash;
+    int height;     //1 if the children are leaves
+    int count;      //number of children
+    struct {
+        size_t end;
+        union {
+            LvVect* leaf;
+            LvVectTree* node;
+        };
+    } child[];
+};
+
+/**
+ * A vect made by slicing a flat vect, which shares the elements
+ * of the vect it was sliced from (its parent). Views of views share
+ * the elements of the original parent.
+ */
+struct LvVectView {
+    size_t refCount;
+    size_t len;
+    TextBufferObj* data;    //the first element, in the parent
+    LvVect* parent;
+};
+
+/** Whether the object is a vect, stored either flat, as a tree, or as a view. */
+#define LV_IS_VECT(obj) \
+    (LV_TYPE(obj) == OPT_VECT || LV_TYPE(obj) == OPT_VECT_TREE || LV_TYPE(obj) == OPT_VECT_VIEW)
+
+/** The length of a vect object. */
+#define LV_VECT_LEN(obj) \
+    (LV_TYPE(obj) == OPT_VECT ? LV_VECT(obj)->len \
+    : LV_TYPE(obj) == OPT_VECT_TREE ? LV_TREE(obj)->len \
+    : LV_VVIEW(obj)->len)
+
 typedef struct LvMapNode {
     size_t hash;
     TextBufferObj key;
@@ -71,12 +390,64 @@ typedef struct LvMapNode {
 
 /**
  * Map object. Maps are implemented using a lookup table sorted
- * according to the hash value of the key.
+ * according to the hash value of the key. Maps of at least
+ * LV_MAP_INDEX_MIN entries are also given a hash index on their
+ * first lookup, which must be freed if the entries are moved.
  */
 struct LvMap {
     size_t refCount;
     size_t len;
+    uint32_t* index;    //open addressed table of entry index + 1, or NULL
+    LvHashCache hash;
     LvMapNode data[];
 };
 
+/**
+ * The minimum length of a map that is given a hash
+ * index. Shorter maps are binary searched.
+ */
+#define LV_MAP_INDEX_MIN 64
+
+/** The number of hash bits indexed by each level of a map trie. */
+#define LV_MAP_TRIE_BITS 5
+
+/**
+ * The maximum depth of a map trie. The last level indexes the
+ * remaining 4 bits of the hash, and nodes below it hold keys
+ * whose hashes are equal.
+ */
+#define LV_MAP_TRIE_DEPTH 14
+
+/**
+ * The minimum length of a map built as a trie. Shorter
+ * maps are cheaper to copy.
+ */
+#define LV_MAP_TRIE_MIN 64
+
+/**
+ * Node of a persistent map trie (a hash array mapped trie). Each
+ * level indexes the next LV_MAP_TRIE_BITS of the key hashes, starting
+ * from the most significant bits, so visiting the indices in order
+ * visits the keys in the same order as a sorted map. An index holds
+ * either one entry or a subtrie. Nodes are shared between tries and
+ * are only modified when not shared, so adding a key copies at most
+ * the nodes along one path.
+ */
+struct LvMapTrie {
+    size_t refCount;
+    size_t len;         //number of entries in the trie
+    LvHashCache hash;   //of the trie, if this node is the root
+    uint32_t datamap;   //indices holding an entry
+    uint32_t nodemap;   //indices holding a subtrie
+    LvMapNode data[];   //the entries, followed by the subtries
+};
+
+/** Whether the object is a map, stored either flat or as a trie. */
+#define LV_IS_MAP(obj) \
+    (LV_TYPE(obj) == OPT_MAP || LV_TYPE(obj) == OPT_MAP_TRIE)
+
+/** The length of a map object. */
+#define LV_MAP_LEN(obj) \
+    (LV_TYPE(obj) == OPT_MAP ? LV_MAP(obj)->len : LV_TRIE(obj)->len)
+
 #endif
@@ -3,19 +3,34 @@
 #include "operator_fwd.h"
 #include "token.h"
 #include <stddef.h>
+#include <stdint.h>
 
-//must be a power of two and greater than number of OpTypes
-//this prevents us having to add a field to TextBufferObj
-#define LV_DYNAMIC 32
+//the OpTypes of values are the tags they are boxed with (see TextBufferObj),
+//except for integers too large to store inline, which have their own tag
+#define LV_TAG_BIG_INT 15
 typedef enum OpType {
-    OPT_UNDEFINED,      //undefined value
-    OPT_NUMBER,         //Lavender number
+    OPT_UNDEFINED,      //undefined value (also an instruction pushing it)
     OPT_INTEGER,        //signed 64bit int
     OPT_SYMB,           //dot symbol
+    OPT_SHORT_STR,      //Lavender string stored inline
+    OPT_FUNCTION_VAL,   //function value (also an instruction pushing it)
+    OPT_UNEVALUATED,    //thunk result placeholder (not present in text buffer)
+    OPT_STRING,         //dynamic objects start here: Lavender string
+    OPT_VECT,           //Lavender vector
+    OPT_MAP,            //Lavender map
+    OPT_CAPTURE,        //function value with captured params
+    OPT_ROPE,           //Lavender string built by concatenation
+    OPT_VECT_TREE,      //Lavender vector stored as a tree
+    OPT_STR_VIEW,       //Lavender string sharing another's characters
+    OPT_VECT_VIEW,      //Lavender vector sharing another's elements
+    OPT_MAP_TRIE,       //Lavender map stored as a trie
+    OPT_NUMBER =        //Lavender number (not boxed)
+        LV_TAG_BIG_INT + 1,
+    OPT_CONSTANT,       //push a value from the constant table
     OPT_PARAM,          //function parameter
     OPT_PUT_PARAM,      //store top in param
+    OPT_MOVE_PARAM,     //push param and clear it (last use of param)
     OPT_FUNCTION,       //function definition
-    OPT_FUNCTION_VAL,   //function value
     OPT_FUNC_CAP,       //capture function with params
     OPT_FUNC_CALL2,     //call value as function (paren notation)
     OPT_MAKE_VECT,      //make vector from args
@@ -23,23 +38,72 @@ typedef enum OpType {
     OPT_RETURN,         //return from function
     OPT_BEQZ,           //relative branch if zero
     OPT_TAIL,           //tail call
-    OPT_ADDR,           //internal address (not present in text buffer)
+    OPT_TAIL_CALL2,     //tail call value as function
+    OPT_SWITCH,         //jump to the first matching `param = literal` case
+    OPT_ADD,            //quickened arithmetic and comparison calls
+    OPT_SUB,            //(these fall back to calling the function
+    OPT_MUL,            //if the arguments are not numbers)
+    OPT_DIV,
+    OPT_IDIV,
+    OPT_REM,
+    OPT_EQ,
+    OPT_LT,
+    OPT_GT,
+    OPT_LE,
+    OPT_GE,
     OPT_LITERAL,        //literal value (not present in final code)
     OPT_EMPTY_ARGS,     //empty args placeholder (not present in final code)
-    OPT_STRING =        //dynamic objects start here
-        LV_DYNAMIC,     //Lavender string
-    OPT_VECT,           //Lavender vector
-    OPT_MAP,            //Lavender map
-    OPT_CAPTURE,        //function value with captured params
 } OpType;
 
 typedef struct TextBufferObj TextBufferObj;
+typedef struct LvInst LvInst;
+typedef struct LvBigInt LvBigInt;
 typedef struct CaptureObj CaptureObj;
+typedef struct CallCache CallCache;
 typedef struct LvString LvString;
+typedef struct LvRope LvRope;
 typedef struct LvVect LvVect;
+typedef struct LvVectTree LvVectTree;
+typedef struct LvStrView LvStrView;
+typedef struct LvVectView LvVectView;
 typedef struct LvMap LvMap;
+typedef struct LvMapTrie LvMapTrie;
 
-TextBufferObj* TEXT_BUFFER;
+LvInst* TEXT_BUFFER;
+
+/**
+ * The values pushed by constant instructions, indexed by
+ * the constant of each constant instruction.
+ */
+TextBufferObj* TEXT_CONSTANTS;
+
+/**
+ * The inline caches of value call sites, indexed by
+ * the callSite of each func call 2 instruction.
+ */
+CallCache* CALL_CACHE;
+
+//the interpreter uses direct-threaded dispatch (GNU labels as values)
+//where available, define LV_SWITCH_DISPATCH to use the portable switch
+#if defined(__GNUC__) && !defined(LV_SWITCH_DISPATCH)
+#define LV_THREADED_CODE
+#endif
+
+#ifdef LV_THREADED_CODE
+/**
+ * The direct-threaded form of the text buffer. Each entry holds the
+ * address of the interpreter routine for the instruction at the same
+ * index in TEXT_BUFFER. Entries are filled in by lv_tb_decode.
+ */
+void** TEXT_THREAD;
+
+/**
+ * Fills in TEXT_THREAD for all instructions added to the text buffer
+ * since the last call, using the given routine addresses indexed
+ * by OpType.
+ */
+void lv_tb_decode(void* const* routines);
+#endif
 
 /**
  * Initialize the given map by sorting its values and by removing
@@ -47,17 +111,74 @@ TextBufferObj* TEXT_BUFFER;
  */
 void lv_tb_initMap(LvMap** map);
 
+/**
+ * Merges the entries of the sorted map other into the sorted map,
+ * which must have room for the entries of both. Entries of other
+ * replace the entries of map with equal keys. The map takes new
+ * references to the entries of other.
+ */
+void lv_tb_mergeMap(LvMap* map, LvMap* other);
+
 /**
  * Returns a Lavender string representation of the
  * given object.
  */
 LvString* lv_tb_getString(TextBufferObj* obj);
 
+/**
+ * Returns a Lavender string describing the given
+ * instruction, for debug output.
+ */
+LvString* lv_tb_getInstString(LvInst* inst);
+
+/**
+ * Returns a new integer value holding the given integer on the
+ * heap, with a refCount of zero. Use lv_tb_integer to make integers,
+ * which only boxes those too large to store inline.
+ */
+TextBufferObj lv_tb_newBigInt(uint64_t integer);
+
+/**
+ * Makes res a new string of the given length and returns a pointer to
+ * its characters, which the caller fills in. The string is terminated.
+ * Strings of up to LV_SHORT_STR_CAP characters are stored inline,
+ * longer strings are allocated with a refCount of zero.
+ */
+char* lv_tb_newString(TextBufferObj* res, size_t len);
+
+/**
+ * Returns the characters of the given rope as a single string,
+ * copying them out of the rope's pieces the first time. The
+ * returned string is owned by the rope.
+ */
+LvString* lv_tb_flatten(LvRope* rope);
+
+/**
+ * Returns the (terminated) characters of the given string view.
+ * Views that do not end where their parent ends copy their
+ * characters the first time. The view owns the characters.
+ */
+char* lv_tb_viewValue(LvStrView* view);
+
+/**
+ * Stores the characters of the given string from start to end in res.
+ * Long slices that are not much shorter than the string they are taken
+ * from share its characters, other slices are copied. The result has a
+ * refCount of zero.
+ */
+void lv_tb_substring(TextBufferObj* str, size_t start, size_t end, TextBufferObj* res);
+
 /**
  * Returns the Symb associated with the given string.
  */
 TextBufferObj lv_tb_getSymb(char* name);
 
+/**
+ * Prints the number of symbols and the memory
+ * used by their names and lookup table.
+ */
+void lv_tb_printStats(void);
+
 /**
  * Defines the function described by the given token
  * sequence in the given scope. Returns a pointer to
@@ -75,18 +196,20 @@ Token* lv_tb_defineFunction(Token* tokens, Operator* scope, Operator** res);
 Token* lv_tb_defineFunctionBody(Token* tokens, Operator* decl);
 
 /**
- * Parses the given expression and adds it to the text buffer temporarily.
- * The start index of the expression is returned through out param startIdx.
+ * Parses the given expression and adds it to the text buffer temporarily,
+ * followed by a return. The out param expr is set up as a zero arity function
+ * with the expression as its body.
  * If an error occurs, LV_EXPR_ERROR is set and this function returns NULL,
  * otherwise this function returns the next token in the sequence after the
  * expression. The next call of lv_tb_clearExpr frees the data for this expression.
  */
-Token* lv_tb_parseExpr(Token* tokens, Operator* scope, size_t* start, size_t* end);
+Token* lv_tb_parseExpr(Token* tokens, Operator* scope, Operator* expr);
 
 /**
- * Adds the given function body to the text buffer, and returns its index.
+ * Adds the given function body to the text buffer and sets the
+ * text offset and stack size of the function.
  */
-size_t lv_tb_addExpr(size_t len, TextBufferObj* body);
+void lv_tb_addExpr(Operator* func, size_t len, LvInst* body);
 
 /**
  * Clears the text buffer of any data associated with the previous parsed expression.
@@ -0,0 +1,372 @@
+#include "vector.h"
+#include "lavender.h"
+#include "expression.h"
+#include <string.h>
+#include <assert.h>
+
+//Subtrees are passed around as untyped pointers along with their
+//height. Height zero is a leaf (LvVect), any other height is a node
+//(LvVectTree). Both start with their refCount. Functions that return
+//a subtree give the caller one reference to it.
+
+static size_t subLen(void* sub, int height) {
+
+    return height ? ((LvVectTree*)sub)->len : ((LvVect*)sub)->len;
+}
+
+static void* share(void* sub) {
+
+    ++*(size_t*)sub;
+    return sub;
+}
+
+static void release(void* sub, int height) {
+
+    assert(*(size_t*)sub);
+    if(--*(size_t*)sub != 0)
+        return;
+    if(height == 0) {
+        LvVect* leaf = sub;
+        lv_expr_cleanup(leaf->data, leaf->len);
+        lv_free(leaf);
+    } else {
+        lv_vec_free(sub);
+    }
+}
+
+void lv_vec_free(LvVectTree* tree) {
+
+    for(int i = 0; i < tree->count; i++)
+        release(tree->child[i].node, tree->height - 1);
+    lv_free(tree);
+}
+
+/** Copies the given elements, taking a reference to each. */
+static void copyElems(TextBufferObj* dst, TextBufferObj* src, size_t len) {
+
+    memcpy(dst, src, len * sizeof(TextBufferObj));
+    for(size_t i = 0; i < len; i++) {
+        if(LV_IS_DYNAMIC(&dst[i]))
+            ++*LV_REFCOUNT(&dst[i]);
+    }
+}
+
+static LvVect* newLeaf(size_t len) {
+
+    assert(len <= LV_VECT_BRANCH);
+    LvVect* leaf = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+    leaf->refCount = 1;
+    leaf->len = len;
+    leaf->hash.source = LV_HASH_NONE;
+    return leaf;
+}
+
+/**
+ * Makes a node of the given height with the given children.
+ * The node takes the caller's references to the children.
+ */
+static LvVectTree* makeNode(int height, void** children, int count) {
+
+    assert(count > 0 && count <= LV_VECT_BRANCH);
+    LvVectTree* node = lv_alloc(sizeof(LvVectTree) + count * sizeof(node->child[0]));
+    node->refCount = 1;
+    node->hash.source = LV_HASH_NONE;
+    node->height = height;
+    node->count = count;
+    size_t end = 0;
+    for(int i = 0; i < count; i++) {
+        end += subLen(children[i], height - 1);
+        node->child[i].end = end;
+        node->child[i].node = children[i];
+    }
+    node->len = end;
+    return node;
+}
+
+/** Returns the index of the child of the node holding the element at idx. */
+static int findChild(LvVectTree* node, size_t idx) {
+
+    int lo = 0;
+    int hi = node->count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(node->child[mid].end > idx)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/** Returns the index of the first element of the given child. */
+static size_t childStart(LvVectTree* node, int i) {
+
+    return i ? node->child[i - 1].end : 0;
+}
+
+/**
+ * Returns the leaf holding the element at *idx, and
+ * sets *idx to the index of the element in the leaf.
+ */
+static LvVect* findLeaf(LvVectTree* node, size_t* idx) {
+
+    for(;;) {
+        int i = findChild(node, *idx);
+        *idx -= childStart(node, i);
+        if(node->height == 1)
+            return node->child[i].leaf;
+        node = node->child[i].node;
+    }
+}
+
+/** Returns the elements of a flat vect or a view. */
+static TextBufferObj* flatData(TextBufferObj* vect) {
+
+    return LV_TYPE(vect) == OPT_VECT ? LV_VECT(vect)->data : LV_VVIEW(vect)->data;
+}
+
+void lv_vec_iter(LvVectIter* it, TextBufferObj* vect, size_t start) {
+
+    it->vect = vect;
+    it->next = start;
+    it->elem = NULL;
+    it->end = NULL;
+}
+
+TextBufferObj* lv_vec_next(LvVectIter* it) {
+
+    if(it->elem == it->end) {
+        if(LV_TYPE(it->vect) != OPT_VECT_TREE) {
+            //the elements are contiguous
+            TextBufferObj* data = flatData(it->vect);
+            it->elem = data + it->next;
+            it->end = data + LV_VECT_LEN(it->vect);
+            it->next = LV_VECT_LEN(it->vect);
+            assert(it->elem < it->end);
+            return it->elem++;
+        }
+        //move to the leaf holding the next element
+        size_t idx = it->next;
+        LvVect* leaf = findLeaf(LV_TREE(it->vect), &idx);
+        assert(idx < leaf->len);
+        it->elem = leaf->data + idx;
+        it->end = leaf->data + leaf->len;
+        it->next += leaf->len - idx;
+    }
+    return it->elem++;
+}
+
+TextBufferObj* lv_vec_at(TextBufferObj* vect, size_t idx) {
+
+    if(LV_TYPE(vect) != OPT_VECT_TREE)
+        return &flatData(vect)[idx];
+    LvVect* leaf = findLeaf(LV_TREE(vect), &idx);
+    return &leaf->data[idx];
+}
+
+/**
+ * Returns the given vect as a subtree, and sets height to its height.
+ * Flat vects that are too long to be leaves are split into leaves.
+ */
+static void* toTree(TextBufferObj* vect, int* height) {
+
+    if(LV_TYPE(vect) == OPT_VECT_TREE) {
+        *height = LV_TREE(vect)->height;
+        return share(LV_TREE(vect));
+    }
+    *height = 0;
+    if(LV_TYPE(vect) == OPT_VECT && LV_VECT(vect)->len <= LV_VECT_BRANCH)
+        return share(LV_VECT(vect));
+    //views are copied into leaves of their own
+    TextBufferObj* data = flatData(vect);
+    size_t total = LV_VECT_LEN(vect);
+    size_t count = (total + LV_VECT_BRANCH - 1) / LV_VECT_BRANCH;
+    void** level = lv_alloc(count * sizeof(void*));
+    for(size_t i = 0; i < count; i++) {
+        size_t start = i * LV_VECT_BRANCH;
+        size_t len = total - start < LV_VECT_BRANCH ? total - start : LV_VECT_BRANCH;
+        LvVect* leaf = newLeaf(len);
+        copyElems(leaf->data, data + start, len);
+        level[i] = leaf;
+    }
+    //group each level into nodes until one node remains
+    while(count > 1) {
+        size_t parents = (count + LV_VECT_BRANCH - 1) / LV_VECT_BRANCH;
+        for(size_t i = 0; i < parents; i++) {
+            size_t start = i * LV_VECT_BRANCH;
+            int len = count - start < LV_VECT_BRANCH ? count - start : LV_VECT_BRANCH;
+            level[i] = makeNode(*height + 1, level + start, len);
+        }
+        count = parents;
+        ++*height;
+    }
+    void* root = level[0];
+    lv_free(level);
+    return root;
+}
+
+/**
+ * Joins the subtrees a and b (of heights ha and hb) into one or two
+ * subtrees of the greater height, which are stored in out. Returns the
+ * number of subtrees stored. Only the nodes along the right edge of a
+ * or the left edge of b are copied, and a leaf joined to an edge leaf
+ * is merged into it if both fit.
+ */
+static int join(void* a, int ha, void* b, int hb, void** out) {
+
+    void* children[LV_VECT_BRANCH + 1];
+    int count = 0;
+    if(ha == hb) {
+        if(ha == 0) {
+            LvVect* la = a;
+            LvVect* lb = b;
+            if(la->len + lb->len <= LV_VECT_BRANCH) {
+                LvVect* leaf = newLeaf(la->len + lb->len);
+                copyElems(leaf->data, la->data, la->len);
+                copyElems(leaf->data + la->len, lb->data, lb->len);
+                out[0] = leaf;
+                return 1;
+            }
+        } else {
+            LvVectTree* na = a;
+            LvVectTree* nb = b;
+            if(na->count + nb->count <= LV_VECT_BRANCH) {
+                for(int i = 0; i < na->count; i++)
+                    children[count++] = share(na->child[i].node);
+                for(int i = 0; i < nb->count; i++)
+                    children[count++] = share(nb->child[i].node);
+                out[0] = makeNode(ha, children, count);
+                return 1;
+            }
+        }
+        out[0] = share(a);
+        out[1] = share(b);
+        return 2;
+    }
+    void* joined[2];
+    int height;
+    if(ha > hb) {
+        //join b to the last child of a
+        LvVectTree* na = a;
+        int n = join(na->child[na->count - 1].node, ha - 1, b, hb, joined);
+        for(int i = 0; i < na->count - 1; i++)
+            children[count++] = share(na->child[i].node);
+        for(int i = 0; i < n; i++)
+            children[count++] = joined[i];
+        height = ha;
+    } else {
+        //join a to the first child of b
+        LvVectTree* nb = b;
+        int n = join(a, ha, nb->child[0].node, hb - 1, joined);
+        for(int i = 0; i < n; i++)
+            children[count++] = joined[i];
+        for(int i = 1; i < nb->count; i++)
+            children[count++] = share(nb->child[i].node);
+        height = hb;
+    }
+    if(count <= LV_VECT_BRANCH) {
+        out[0] = makeNode(height, children, count);
+        return 1;
+    }
+    out[0] = makeNode(height, children, count / 2);
+    out[1] = makeNode(height, children + count / 2, count - count / 2);
+    return 2;
+}
+
+void lv_vec_concat(TextBufferObj* a, TextBufferObj* b, TextBufferObj* res) {
+
+    assert(LV_VECT_LEN(a) + LV_VECT_LEN(b) >= LV_VECT_TREE_MIN);
+    int ha, hb;
+    void* ta = toTree(a, &ha);
+    void* tb = toTree(b, &hb);
+    void* out[2];
+    LvVectTree* root;
+    if(join(ta, ha, tb, hb, out) == 1) {
+        root = out[0];
+    } else {
+        root = makeNode((ha > hb ? ha : hb) + 1, out, 2);
+    }
+    release(ta, ha);
+    release(tb, hb);
+    assert(root->refCount == 1);
+    root->refCount = 0;
+    *res = lv_tb_box(OPT_VECT_TREE, root);
+}
+
+/**
+ * Returns the subtree of the given height holding the elements of
+ * sub from start to end. Whole children are shared, and only the
+ * nodes along the edges of the slice are copied.
+ */
+static void* sliceTree(void* sub, int height, size_t start, size_t end) {
+
+    if(start == 0 && end == subLen(sub, height))
+        return share(sub);
+    if(height == 0) {
+        LvVect* leaf = newLeaf(end - start);
+        copyElems(leaf->data, ((LvVect*)sub)->data + start, end - start);
+        return leaf;
+    }
+    LvVectTree* node = sub;
+    int first = findChild(node, start);
+    int last = findChild(node, end - 1);
+    void* children[LV_VECT_BRANCH];
+    for(int i = first; i <= last; i++) {
+        size_t offset = childStart(node, i);
+        size_t limit = node->child[i].end;
+        children[i - first] = sliceTree(node->child[i].node, height - 1,
+            start > offset ? start - offset : 0,
+            (end < limit ? end : limit) - offset);
+    }
+    return makeNode(height, children, last - first + 1);
+}
+
+void lv_vec_slice(TextBufferObj* vect, size_t start, size_t end, TextBufferObj* res) {
+
+    size_t len = end - start;
+    if(LV_TYPE(vect) == OPT_VECT_TREE && len >= LV_VECT_TREE_MIN) {
+        //descend to the smallest subtree holding the slice
+        LvVectTree* node = LV_TREE(vect);
+        for(;;) {
+            int first = findChild(node, start);
+            if(first != findChild(node, end - 1))
+                break;
+            assert(node->height > 1);
+            size_t offset = childStart(node, first);
+            start -= offset;
+            end -= offset;
+            node = node->child[first].node;
+        }
+        LvVectTree* root = sliceTree(node, node->height, start, end);
+        //the root may be shared, if the slice is a whole subtree
+        root->refCount--;
+        *res = lv_tb_box(OPT_VECT_TREE, root);
+        return;
+    }
+    if(LV_TYPE(vect) != OPT_VECT_TREE) {
+        LvVect* parent = LV_TYPE(vect) == OPT_VECT ? LV_VECT(vect) : LV_VVIEW(vect)->parent;
+        if(len >= LV_VIEW_MIN_LEN && len >= parent->len / LV_VIEW_MAX_WASTE) {
+            //share the elements of the parent
+            LvVectView* view = lv_alloc(sizeof(LvVectView));
+            view->refCount = 0;
+            view->len = len;
+            view->data = flatData(vect) + start;
+            view->parent = parent;
+            parent->refCount++;
+            *res = lv_tb_box(OPT_VECT_VIEW, view);
+            return;
+        }
+    }
+    LvVect* flat = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+    flat->refCount = 0;
+    flat->len = len;
+    flat->hash.source = LV_HASH_NONE;
+    LvVectIter it;
+    lv_vec_iter(&it, vect, start);
+    for(size_t i = 0; i < len; i++) {
+        flat->data[i] = *lv_vec_next(&it);
+        if(LV_IS_DYNAMIC(&flat->data[i]))
+            ++*LV_REFCOUNT(&flat->data[i]);
+    }
+    *res = lv_tb_box(OPT_VECT, flat);
+}
@@ -0,0 +1,58 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+#include "textbuffer.h"
+
+//Operations on vects that may be stored as trees (OPT_VECT_TREE)
+//or views (OPT_VECT_VIEW). Vects built by concatenating or slicing at
+//least LV_VECT_TREE_MIN elements are trees, except that slices of flat
+//vects are views if they are long enough. All others are flat.
+
+/**
+ * Iterates over the elements of a vect of any form in order.
+ */
+typedef struct LvVectIter {
+    TextBufferObj* vect;
+    size_t next;            //index of the element after the current chunk
+    TextBufferObj* elem;    //the next element of the current chunk
+    TextBufferObj* end;     //one past the end of the current chunk
+} LvVectIter;
+
+/**
+ * Starts iterating over the given vect from the given index.
+ */
+void lv_vec_iter(LvVectIter* it, TextBufferObj* vect, size_t start);
+
+/**
+ * Returns the next element of the vect. The caller must
+ * not advance the iterator past the end of the vect.
+ */
+TextBufferObj* lv_vec_next(LvVectIter* it);
+
+/**
+ * Returns the element of the vect at the given index,
+ * which must be in bounds.
+ */
+TextBufferObj* lv_vec_at(TextBufferObj* vect, size_t idx);
+
+/**
+ * Stores the concatenation of the two vects in res. The
+ * result is a tree with a refCount of zero and must be at
+ * least LV_VECT_TREE_MIN elements long.
+ */
+void lv_vec_concat(TextBufferObj* a, TextBufferObj* b, TextBufferObj* res);
+
+/**
+ * Stores the elements of the vect from start to end in res. Slices
+ * of trees that are at least LV_VECT_TREE_MIN elements long are trees.
+ * Slices of flat vects and views are views if they are long and not
+ * much shorter than the parent. Other slices are flat. The result
+ * has a refCount of zero.
+ */
+void lv_vec_slice(TextBufferObj* vect, size_t start, size_t end, TextBufferObj* res);
+
+/**
+ * Frees a tree whose refCount has reached zero.
+ */
+void lv_vec_free(LvVectTree* tree);
+
+#endif